@@ -0,0 +1,54 @@
+#ifndef BROADPHASE_H
+#define BROADPHASE_H
+/*================================================================================
+    Broadphase.
+    Every collider is given a world-space axis-aligned bounding box, and the broadphase
+    keeps a persistent list of the pairs of colliders whose boxes overlap. The rigid body and
+    player collision passes only run the narrowphase on these candidate pairs, so the work done
+    depends on how many objects are actually near each other rather than on the number of colliders.
+
+    usage:
+        broadphase_update() is called once per physics step, after the colliders have moved.
+        The pairs can then be iterated with
+            for_collision_pair(pair)
+                ... do something with pair->A, pair->A_entity, pair->B, pair->B_entity.
+            end_for_collision_pair()
+        If a single collider moves outside of the physics step (such as the player), broadphase_update_collider()
+        brings the pair list up to date for that collider.
+        broadphase_query_aabb() finds the colliders whose boxes overlap a given world-space box.
+        broadphase_collider_moved() tells whether a collider's box changed in the last broadphase_update(), including any
+        movement since the update before. This is how sleeping rigid bodies find out that a static collider under them has moved.
+    The method used is set by broadphase_method, which must be set before any colliders are added.
+================================================================================*/
+
+enum BroadphaseMethods {
+    SweepAndPrune,
+    DynamicAABBTree,
+};
+typedef uint8_t BroadphaseMethod;
+extern BroadphaseMethod broadphase_method;
+
+// Colliders are registered with the broadphase by add_collider.
+void broadphase_add_collider(Collider *collider, Entity *e);
+void broadphase_update(void);
+void broadphase_update_collider(Collider *collider);
+// Find the pairs of a collider again after its filtering has changed.
+void broadphase_refilter_collider(Collider *collider);
+// Returns the number of colliders written to the given array, at most max_colliders.
+int broadphase_query_aabb(float min[3], float max[3], Collider **colliders, int max_colliders);
+bool broadphase_collider_moved(Collider *collider);
+
+extern int num_collision_pairs;
+extern CollisionPair *collision_pairs;
+
+#define for_collision_pair(PAIR_LVALUE)\
+{\
+    for (int ___pair_index = 0; ___pair_index < num_collision_pairs; ___pair_index++) {\
+        CollisionPair *PAIR_LVALUE = &collision_pairs[___pair_index];\
+        {
+#define end_for_collision_pair()\
+        }\
+    }\
+}
+
+#endif // BROADPHASE_H
@@ -7,32 +7,220 @@
 #include "geometry.h"
 #include "museum.h"
 
+// The result of a collision query. separating_vector is the point of the Minkowski difference A - B closest to the origin.
+// If the colliders intersect, this is the smallest translation of B which separates them, and A_closest and B_closest are the deepest points.
+// If they are separated, this is A_closest - B_closest, and its length is the distance between the colliders.
 typedef struct GJKManifold_s {
     vec3 separating_vector;
     vec3 A_closest;
     vec3 B_closest;
 } GJKManifold;
-bool convex_hull_intersection(vec3 *A, int A_len, mat4x4 A_matrix, vec3 *B, int B_len, mat4x4 B_matrix, GJKManifold *manifold);
-
 // Debugging and visualization.
 Polyhedron compute_minkowski_difference(Polyhedron A, Polyhedron B);
 
+// A collider is either a convex polyhedron, given by a point cloud whose convex hull is the collider, or one of a few analytic shapes.
+// The analytic shapes still have points, which are the corners of the box or the cylinder's prism, or the core of a sphere (its center)
+// or a capsule (its axis segment). Their support points are found directly from the shape rather than by searching the points, and
+// pairs of spheres, capsules and boxes have closed-form collision tests. Other pairs use GJK.
+// Spheres and capsules are their core points rounded by the margin. The collision queries account for this, so the points alone are not the collider.
+enum ColliderShapes {
+    ColliderPolyhedron,
+    ColliderSphere,
+    ColliderCapsule,
+    ColliderBox,
+    ColliderCylinder,
+    ColliderCompound,
+};
+typedef uint8_t ColliderShape;
+
+// A compound collider is a group of convex child colliders, each with a rigid transform relative to the compound, which are bounded
+// together and take part in the broadphase as one collider. The children are kept in a small static bounding volume hierarchy, so that
+// queries only descend into the children near the other collider.
+// The nodes are in depth-first order, so the first child of an internal node is the node after it.
+typedef struct CompoundNode_s {
+    float min[3]; // The model-space box around the children under this node.
+    float max[3];
+    int child; // The index of the child collider of a leaf, or -1 for an internal node.
+    int right; // The second child of an internal node.
+} CompoundNode;
+
+// Collision filtering. A pair of colliders is only tested if each is in a layer which the other's mask includes, and at least one of them
+// is dynamic. Static colliders never move, kinematic colliders are moved by code (such as the tumbler of the rigid body exhibit), and
+// dynamic colliders respond to collisions (rigid bodies with mass, and the player), so pairs of static and kinematic colliders are skipped.
+// Filtered pairs are rejected by the broadphase before their boxes are compared.
+// For example, a rigid body ignores the player with set_collider_filter(rb->collider, CollisionLayerDefault, ~CollisionLayerPlayer).
+enum CollisionLayers {
+    CollisionLayerDefault = 1 << 0,
+    CollisionLayerPlayer = 1 << 1,
+};
+#define COLLISION_LAYERS_ALL 0xFFFFFFFF
+enum ColliderMotions {
+    ColliderStatic,
+    ColliderKinematic,
+    ColliderDynamic,
+};
+typedef uint8_t ColliderMotion;
+
 typedef struct Collider_s {
+    Entity *entity; // The entity this collider is attached to.
     vec3 *points;
     int num_points;
-    float radius; // Gives a bounding sphere from the collider origin.
-    bool use_aabb;
-    float aabb_min[3];
-    float aabb_max[3];
+    ColliderShape shape;
+    float margin; // The radius of a sphere or capsule, otherwise 0.
+    // The model-space parameters of an analytic shape. The axis of a capsule or cylinder is the y axis, and half_extents.y is half the
+    // length of the capsule's axis segment or half the height of the cylinder, with half_extents.x its radius.
+    vec3 shape_center;
+    vec3 half_extents;
+    int sides; // The number of sides of a cylinder's prism.
+    // A structure-of-arrays copy of the points for the support point search. The arrays are padded to
+    // a multiple of four by repeating the first point, so the search can test four points at a time.
+    int num_padded_points;
+    float *xs;
+    float *ys;
+    float *zs;
+    // For colliders with many points, support queries hill-climb over the vertex adjacency of the convex hull.
+    // The neighbours of point i are hull_neighbours[hull_neighbour_offsets[i]] up to hull_neighbours[hull_neighbour_offsets[i+1]],
+    // given as point indices. Points not on the hull have no neighbours. If the collider is small, these are NULL.
+    int *hull_neighbour_offsets;
+    int *hull_neighbours;
+    int hull_start; // A point on the hull to start climbing from.
+    // The faces of polyhedra, boxes and cylinders, with the coplanar triangles of the hull merged. The vertices of face i are the points
+    // face_vertices[face_offsets[i]] up to face_vertices[face_offsets[i+1]], in order around its outward unit normal face_normals[i].
+    // These are used to find the features which touch in a contact. Other colliders have no faces.
+    int num_faces;
+    vec3 *face_normals;
+    int *face_offsets;
+    int *face_vertices;
+    // Model-space bounding volumes, which include the margin. The sphere is the smallest sphere containing the collider, and the box
+    // is oriented along the principal axes of the points, or is axis-aligned if that is smaller. The columns of box_axes are the axes of the box.
+    vec3 bounding_center;
+    float bounding_radius;
+    vec3 box_center;
+    mat3x3 box_axes;
+    vec3 box_half_extents;
+    // A child of a compound collider has the compound here, and is transformed by the local matrix before the entity matrix.
+    // It is not a behaviour of the entity, and is not in the broadphase.
+    struct Collider_s *compound;
+    mat4x4 local_matrix;
+    // The children of a compound collider, which has no points of its own.
+    struct Collider_s **children;
+    int num_children;
+    CompoundNode *nodes;
+    // Colliders start in the default layer with every layer in their mask, and are static until made a rigid body. The children of a compound
+    // are filtered with their compound.
+    uint32_t layer;
+    uint32_t mask;
+    ColliderMotion motion;
+    int broadphase_proxy; // Handle of this collider in the broadphase, or -1 if it is not in the broadphase.
 } Collider;
-Collider *add_collider(Entity *e, vec3 *points, int num_points, bool can_rotate);
+// The points of a polyhedron collider are copied, with duplicates welded and points inside the convex hull removed.
+Collider *add_collider(Entity *e, vec3 *points, int num_points);
+// The analytic shapes are centered at the given model-space point. Capsules and cylinders are upright, and their height includes the caps,
+// as for make_capsule and make_cylinder. Boxes have the full width, height and depth, as for make_tessellated_block.
+Collider *add_sphere_collider(Entity *e, vec3 center, float radius);
+Collider *add_capsule_collider(Entity *e, vec3 center, float radius, float height);
+Collider *add_box_collider(Entity *e, vec3 center, float width, float height, float depth);
+Collider *add_cylinder_collider(Entity *e, vec3 center, float radius, float height, int sides);
+// The colliders added to the entity between these calls become the children of one compound collider, rather than separate colliders.
+// A compound can have at most MAX_COMPOUND_CHILDREN children.
+#define MAX_COMPOUND_CHILDREN 64
+Collider *begin_compound_collider(Entity *e);
+void end_compound_collider(Collider *compound);
+// Place a child of a compound which has not yet been ended, relative to the compound.
+void set_collider_local_transform(Collider *child, vec3 position, vec3 euler_angles);
+// Change the filtering of a collider. The broadphase pairs of the collider are updated.
+void set_collider_filter(Collider *collider, uint32_t layer, uint32_t mask);
+void set_collider_motion(Collider *collider, ColliderMotion motion);
+bool colliders_can_collide(Collider *A, Collider *B);
+// Compute the volume, center of mass and inertia tensor (about the center of mass) of the collider with uniform density.
+void collider_mass_properties(Collider *collider, float mass, float *volume, vec3 *center_of_mass, mat3x3 *inertia_tensor);
+// Test whether the bounding volumes of the colliders overlap.
 bool collider_bounding_test(Collider *A, Entity *A_entity, Collider *B, Entity *B_entity);
+// Compute a world-space axis-aligned box which bounds the collider.
+void collider_world_aabb(Collider *collider, Entity *e, float min[3], float max[3]);
+// Find the index of the collider point furthest in the given model-space direction.
+// For the analytic shapes, this is computed directly from the direction.
+// If the collider has hull adjacency, this hill-climbs from the start index (or anywhere on the hull, if start is -1).
+// Otherwise, all points are tested, and ties are broken by the lowest index.
+int collider_support_index(Collider *collider, vec3 direction, int start);
+
+// Information kept between collision queries of the same pair of colliders, so that the next query can start from where the last one ended.
+// The cache is keyed by the two colliders. The collider taking the role of A in the cache is the A of the first query, and if a later query
+// has the colliders the other way around, the roles are swapped.
+typedef struct CollisionCache_s {
+    Collider *A;
+    Collider *B;
+    // The last support points found on each collider, where the next support queries start hill-climbing from.
+    int support_A;
+    int support_B;
+    // The final GJK simplex, as indices of the points of A and B whose differences are its vertices.
+    int simplex_n;
+    int simplex_A[4];
+    int simplex_B[4];
+    // The last search direction in the configuration space of A - B.
+    vec3 direction;
+} CollisionCache;
+void init_collision_cache(CollisionCache *cache);
+
+// These GJK queries are on the point clouds only, ignoring the margins. The collider queries below should usually be used instead.
+// The cache can be NULL. If GJK fails to converge, which rounding error can cause for nearly degenerate configurations, there is no answer:
+// the intersection tests give false and the distance queries give INFINITY, with a zeroed manifold.
+bool convex_hull_intersection(Collider *A, mat4x4 A_matrix, Collider *B, mat4x4 B_matrix, CollisionCache *cache, GJKManifold *manifold);
+// Returns the distance between the colliders, with their closest points in the manifold, or 0 if they intersect, in which case
+// the penetration is not computed. If the distance is greater than max_distance, the query can stop before it has converged, and returns
+// a distance which is greater than max_distance, with the closest points found so far. A max_distance of 0 gives a quick intersection test.
+// The cache can be NULL.
+float convex_hull_distance(Collider *A, mat4x4 A_matrix, Collider *B, mat4x4 B_matrix, CollisionCache *cache, float max_distance, GJKManifold *manifold);
+// The same queries for whole colliders. These use the closed-form test for the pair of shapes if there is one, otherwise GJK, accounting for margins.
+// The matrix of a compound is its entity's matrix. A compound intersects another collider with its deepest intersecting child, and its
+// distance is that of its nearest child. The cache is only used if neither collider is a compound. A failed query gives no answer, as above.
+bool collider_intersection(Collider *A, mat4x4 A_matrix, Collider *B, mat4x4 B_matrix, CollisionCache *cache, GJKManifold *manifold);
+float collider_distance(Collider *A, mat4x4 A_matrix, Collider *B, mat4x4 B_matrix, CollisionCache *cache, float max_distance, GJKManifold *manifold);
+
+// A point of contact between two colliders. The point is kept on each collider, in its model space, so that it can be followed
+// from step to step as the colliders move.
+typedef struct ContactPoint_s {
+    vec3 A_point;
+    vec3 B_point;
+    vec3 position; // In world space, halfway between the points on each collider.
+    float depth; // The penetration along the contact normal, negative if the point has separated.
+    float normal_impulse; // The contact impulse of the last physics step, which the contact solver starts from.
+} ContactPoint;
+#define MAX_CONTACT_POINTS 4
+
+// Two colliders whose bounding volumes overlap. These are found by the broadphase, and are the candidates for the narrowphase (GJK/EPA).
+typedef struct CollisionPair_s {
+    Collider *A;
+    Entity *A_entity;
+    Collider *B;
+    Entity *B_entity;
+    CollisionCache cache;
+    // The contact manifold of two intersecting convex colliders. The points are found by clipping the touching features of the colliders
+    // against each other, and while they stay together they are kept from step to step instead of repeating the query.
+    vec3 contact_normal; // In world space, from A into B.
+    vec3 A_contact_normal; // The normal in the model spaces of A and B, which tell whether the colliders have turned relative to each other.
+    vec3 B_contact_normal;
+    ContactPoint contact_points[MAX_CONTACT_POINTS];
+    int num_contact_points;
+    // If either collider is a compound, the narrowphase is run on the pairs of convex children whose bounds overlap. These child pairs
+    // are kept between steps, so that each has its own cache and contact impulse, with the result of this step's narrowphase.
+    struct CollisionPair_s *child_pairs;
+    int num_child_pairs;
+    int child_pairs_size;
+    bool colliding;
+    GJKManifold manifold;
+} CollisionPair;
+// Run collider_intersection on many pairs at once, split between the threads of the thread pool. hits[i] tells whether the colliders
+// of pairs[i] intersect, with manifolds[i] from A to B. Pairs filtered out by their layers, or whose bounding volumes do not overlap,
+// do not intersect. The caches and contact manifolds of the pairs are updated, and a pair with a compound collider keeps its child pairs,
+// with the manifold of its deepest. If a pair's contact points are still valid, the manifold is that of its deepest point.
+// This can not be called from inside a parallel loop.
+void collider_intersection_batch(CollisionPair **pairs, int n, GJKManifold *manifolds, bool *hits);
 
 /*--------------------------------------------------------------------------------
 A RigidBody is simulated according to rigid body dynamics. The geometry need not be the
-same as what the object is being rendered as. Currently rigid bodies are restricted to being
-convex polyhedra, although the algorithms can be generalized to convex sets, and constraints can
-be incorporated along with convex decomposition to allow concave objects.
+same as what the object is being rendered as. The collider of a rigid body is convex, or is a
+compound of convex pieces, which allows concave objects by convex decomposition.
 --------------------------------------------------------------------------------*/
 typedef struct RigidBody_s {
     Collider *collider;
@@ -44,8 +232,56 @@ typedef struct RigidBody_s {
     vec3 center_of_mass;
     mat3x3 inertia_tensor;
     mat3x3 inverse_inertia_tensor;
+
+    // A body which has been still for long enough is put to sleep, and is not integrated or collided until something wakes it.
+    // Bodies in contact are grouped into islands, which fall asleep and wake together.
+    bool asleep;
+    float still_time;
+    int island; // While asleep, the island this body fell asleep in.
+    int index; // The index of this body in the island union-find, during a physics step.
+    // The transform at the start of the last step, which the entity is drawn interpolated from.
+    vec3 previous_position;
+    mat3x3 previous_orientation;
 } RigidBody;
+/*--------------------------------------------------------------------------------
+The physics is stepped at a fixed rate. physics_update() is called once per frame, and runs as many steps of
+1/physics_rate seconds as fit in the time since the last frame, keeping the remainder for the next frame. At most
+max_physics_substeps steps are run in a frame, and the time left after a long frame is dropped, so the physics cost of a
+frame is bounded. The rigid bodies are then drawn interpolated between their last two steps.
+rigid_body_dynamics() runs a single step.
+--------------------------------------------------------------------------------*/
+extern float physics_rate;
+extern int max_physics_substeps;
+void physics_update(void);
 void rigid_body_dynamics(void);
 RigidBody *add_rigid_body(Entity *e, float mass);
+// This must be called when a rigid body is moved or pushed from outside of the physics step. It wakes the body's whole island.
+void rigid_body_wake(RigidBody *rb);
+
+/*--------------------------------------------------------------------------------
+While physics_profiling is set, each rigid_body_dynamics() step adds the time spent in its phases, in nanoseconds, and
+counts of the tests made, to physics_profile. The phases are timed on the calling thread. The bounds tests, GJK and EPA
+are timed inside the narrowphase, so with worker threads their times are summed over the threads. gjk_time includes
+the time spent in EPA.
+--------------------------------------------------------------------------------*/
+typedef struct PhysicsProfile_s {
+    int64_t step_time;
+    int64_t integrate_time;
+    int64_t broadphase_time;
+    int64_t ccd_time;
+    int64_t narrowphase_time;
+    int64_t bounds_time;
+    int64_t gjk_time;
+    int64_t epa_time;
+    int64_t impulse_time;
+    int64_t num_steps;
+    int64_t num_pairs; // Pairs from the broadphase passed to the narrowphase.
+    int64_t num_bounds_tests;
+    int64_t num_gjk_queries;
+    int64_t num_epa_queries;
+    int64_t num_contacts; // Pairs found intersecting by the narrowphase.
+} PhysicsProfile;
+extern bool physics_profiling;
+extern PhysicsProfile physics_profile;
 
 #endif // COLLISION_H
@@ -17,7 +17,8 @@
             } ThingNode;
         Nodes are allocated on the heap, but this must be done by the user before
         adding a node to the list. Nodes live only in the list, so are freed when
-        they are removed.
+        they are removed. Nodes allocated some other way can be taken out of the
+        list without being freed by dl_unlink.
 ================================================================================*/
 typedef struct DLNode_s {
     struct DLNode_s *prev;
@@ -34,5 +35,8 @@ DLNode *___dl_add(DLList *list, DLNode *node);
 #define dl_remove(LIST,NODE)\
     ___dl_remove((DLList *) ( LIST ), (DLNode *) ( NODE ))
 void ___dl_remove(DLList *list, DLNode *node);
+#define dl_unlink(LIST,NODE)\
+    ___dl_unlink((DLList *) ( LIST ), (DLNode *) ( NODE ))
+void ___dl_unlink(DLList *list, DLNode *node);
 
 #endif // DOUBLY_LINKED_LIST_H
@@ -35,6 +35,10 @@ typedef struct BehaviourList_s {
     struct Behaviour_s *list;
 } BehaviourList;
 
+// Entities and behaviours are referred to by pointer, so their lists can't be moved to grow them. Instead the lists are
+// allocated at their maximum sizes, which are only backed by memory as they are filled.
+#define MAX_NUM_ENTITIES 65536
+#define MAX_NUM_BEHAVIOURS 65536
 extern struct Entity_s *entity_list;
 extern int entity_list_size;
 extern int entity_list_length;
@@ -63,12 +67,18 @@ typedef struct Entity_s {
     mat3x3 orientation; // Access this only with the entity_orientation function, as the entity may be euler-controlled, meaning this needs to be derived.
     vec3 center;
     float scale;
+    // Entities moved in fixed physics steps are drawn at a transform interpolated between their last two steps.
+    bool interpolated;
+    vec3 render_position;
+    mat3x3 render_orientation;
 
     Behaviour *behaviours[MAX_NUM_ENTITY_BEHAVIOURS];
     int num_behaviours;
 } Entity;
 
 mat4x4 entity_matrix(Entity *entity);
+mat4x4 entity_render_matrix(Entity *entity);
+mat4x4 entity_matrix_at(Entity *entity, vec3 position, mat3x3 orientation);
 mat3x3 entity_orientation(Entity *entity);
 void prepare_entity_matrix(Entity *entity);
 
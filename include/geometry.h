@@ -44,8 +44,13 @@ typedef struct PolyhedronTriangle_s {
     struct PolyhedronEdge_s *edges[3];
     int mark;
     int print_mark;
+    int first_conflict; // this is used in the convex hull algorithm, for the first of the points which can see this triangle.
 } PolyhedronTriangle;
-// The Polyhedron struct itself is just the three doubly linked lists of features.
+// Features are not allocated one at a time, but from slabs kept in an arena owned by the polyhedron (see geometry.c).
+// Removed features go onto a free list to be reused by the next feature of their type, and the whole arena is released at once
+// by polyhedron_destroy. Copies of a Polyhedron struct share the arena, so only one of them should be destroyed.
+struct PolyhedronArena_s;
+// The Polyhedron struct itself is just the three doubly linked lists of features, and the arena they are allocated from.
 typedef struct Polyhedron_s {
     int num_points;
     int num_edges;
@@ -63,10 +68,13 @@ typedef struct Polyhedron_s {
         PolyhedronTriangle *first;
         PolyhedronTriangle *last;
     } triangles;
+    struct PolyhedronArena_s *arena; // this is created when the first feature is added.
 } Polyhedron;
 
 // Create a new empty polyhedron.
 Polyhedron new_polyhedron(void);
+// Free all of the features of the polyhedron, leaving it empty.
+void polyhedron_destroy(Polyhedron *poly);
 
 // Add features to the polyhedron. It is up to the user to maintain that polyhedra are only ever "incomplete", as in, they can be disconnected and have holes,
 // supposedly as intermediary steps in geometric processing, but this data structure does not allow being "overcomplete", as in, having more than two triangles incident to one edge.
@@ -88,12 +96,83 @@ vec3 *polyhedron_points(Polyhedron poly);
 /*================================================================================
     Polyhedron algorithms.
 ================================================================================*/
+// The convex hull of the points. The print marks of the hull points are left as their indices in the array.
+// Flat point sets give a polygon of single-sided triangles, collinear points give a segment (two points and an edge),
+// and coincident points give a single point.
+// The method used is set by convex_hull_method. Quickhull is faster when many of the points are inside the hull.
+enum ConvexHullMethods {
+    IncrementalHull,
+    Quickhull,
+};
+typedef uint8_t ConvexHullMethod;
+extern ConvexHullMethod convex_hull_method;
 Polyhedron convex_hull(vec3 *points, int num_points);
 bool point_in_convex_polyhedron(vec3 p, Polyhedron poly);
 float polyhedron_volume(Polyhedron poly);
 vec3 polyhedron_extreme_point(Polyhedron poly, vec3 direction);
 // Assuming uniform mass of the polyhedron.
 vec3 polyhedron_center_of_mass(Polyhedron poly);
+// The inertia tensor is about the center of mass, for a polyhedron of uniform density with the given mass.
+void polyhedron_mass_properties(Polyhedron poly, float mass, float *volume, vec3 *center_of_mass, mat3x3 *inertia_tensor);
+// Approximates the inertia tensor by sampling a grid of points in the polyhedron. This is slow, and is kept for testing.
+mat3x3 brute_force_polyhedron_inertia_tensor(Polyhedron poly, vec3 center, float mass);
+
+/*================================================================================
+    Half-edge meshes.
+    This is a compact alternative to the Polyhedron structure, for triangle meshes which are built once and then queried
+    many times. Everything is in arrays indexed by 32-bit integers: the vertex positions are in their own array, and
+    the half-edges of triangle t are 3t, 3t+1 and 3t+2, going anti-clockwise, so only the origin vertex and the opposite
+    (twin) half-edge need to be stored for each. Half-edges on the boundary of an open mesh have no twin.
+    All of the arrays are in one allocation, which is freed by half_edge_mesh_destroy.
+================================================================================*/
+#define HALF_EDGE_NONE UINT32_MAX
+#define half_edge_triangle(HALF_EDGE) ( (HALF_EDGE) / 3 )
+#define half_edge_next(HALF_EDGE) ( (HALF_EDGE) % 3 == 2 ? (HALF_EDGE) - 2 : (HALF_EDGE) + 1 )
+#define half_edge_prev(HALF_EDGE) ( (HALF_EDGE) % 3 == 0 ? (HALF_EDGE) + 2 : (HALF_EDGE) - 1 )
+typedef struct HalfEdgeMesh_s {
+    int num_vertices;
+    int num_triangles;
+    vec3 *positions;
+    uint32_t *origins; // length is 3*num_triangles.
+    uint32_t *twins; // length is 3*num_triangles.
+    uint32_t *vertex_half_edges; // a half-edge leaving each vertex, or HALF_EDGE_NONE for vertices not in any triangle.
+} HalfEdgeMesh;
+// Allocate a mesh, whose positions and origins are then filled in before linking the twins.
+HalfEdgeMesh new_half_edge_mesh(int num_vertices, int num_triangles);
+void half_edge_mesh_link_twins(HalfEdgeMesh *mesh);
+void half_edge_mesh_destroy(HalfEdgeMesh *mesh);
+
+// Conversion to and from polyhedra. Edges of the polyhedron which are not on a triangle are not kept in the mesh.
+HalfEdgeMesh polyhedron_to_half_edge_mesh(Polyhedron poly);
+Polyhedron half_edge_mesh_to_polyhedron(HalfEdgeMesh *mesh);
+
+// These give the same results as the Polyhedron versions.
+bool point_in_convex_half_edge_mesh(vec3 p, HalfEdgeMesh *mesh);
+float half_edge_mesh_volume(HalfEdgeMesh *mesh);
+vec3 half_edge_mesh_extreme_point(HalfEdgeMesh *mesh, vec3 direction);
+
+/*================================================================================
+    Face planes of convex polyhedra.
+    Testing many points against one convex polyhedron only needs the plane of each triangle, which is computed once
+    as an outward unit normal and an offset, so that a point p is inside if dot(normal, p) <= offset for every plane.
+    The planes are kept as a structure of arrays, padded to a multiple of four with planes that every point is inside.
+================================================================================*/
+typedef struct ConvexPlanes_s {
+    int num_planes;
+    int num_padded_planes;
+    float *nxs;
+    float *nys;
+    float *nzs;
+    float *offsets;
+} ConvexPlanes;
+// Degenerate triangles, with no normal, are not given planes.
+ConvexPlanes polyhedron_planes(Polyhedron poly);
+ConvexPlanes half_edge_mesh_planes(HalfEdgeMesh *mesh);
+void convex_planes_destroy(ConvexPlanes *planes);
+// Points on the boundary are inside. The test stops at the first plane which the point is outside of.
+bool point_in_convex_planes(vec3 p, ConvexPlanes *planes);
+// Classify many points, four at a time, setting inside[i] for each point, and return the number of points inside.
+int points_in_convex_planes(vec3 *points, int num_points, ConvexPlanes *planes, bool *inside);
 
 /*================================================================================
     Polytope methods. Polytopes are represented by only their points, and their polyhedron
@@ -101,13 +180,20 @@ vec3 polyhedron_center_of_mass(Polyhedron poly);
     (Polyhedron representation may not be consistent due to triangulation of faces).
 ================================================================================*/
 vec3 polytope_center_of_mass(vec3 *points, int num_points);
+void polytope_mass_properties(vec3 *points, int num_points, float mass, float *volume, vec3 *center_of_mass, mat3x3 *inertia_tensor);
 vec3 polytope_extreme_point(vec3 *points, int num_points, vec3 direction);
+// The smallest sphere containing the points, by Welzl's algorithm.
+void polytope_bounding_sphere(vec3 *points, int num_points, vec3 *center, float *radius);
+// An oriented box containing the points. It is aligned with the principal axes of the points, unless the axis-aligned box is smaller.
+// The columns of axes are the box's axes, and center is in the same space as the points.
+void polytope_bounding_box(vec3 *points, int num_points, vec3 *center, mat3x3 *axes, vec3 *half_extents);
 
 /*================================================================================
     Closest-points methods.
 ================================================================================*/
 vec3 closest_point_on_line_to_point(vec3 a, vec3 b, vec3 p);
 vec3 closest_point_on_line_segment_to_point(vec3 a, vec3 b, vec3 p);
+void closest_points_on_line_segments(vec3 a1, vec3 b1, vec3 a2, vec3 b2, vec3 *p1, vec3 *p2);
 vec3 closest_point_on_triangle_to_point(vec3 a, vec3 b, vec3 c, vec3 p);
 vec3 closest_point_on_tetrahedron_to_point(vec3 a, vec3 b, vec3 c, vec3 d, vec3 p);
 
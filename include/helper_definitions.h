@@ -3,6 +3,8 @@
 #include <stdlib.h>
 
 #define ABS(X) ((X) < 0 ? -(X) : (X))
+#define MIN(X,Y) ((X) < (Y) ? (X) : (Y))
+#define MAX(X,Y) ((X) > (Y) ? (X) : (Y))
 
 #define mem_check(POINTER) {\
     if (( POINTER ) == NULL) {\
@@ -93,6 +93,7 @@ vec3 matrix_vec3(mat3x3 m, vec3 v);
 mat3x3 mat3x3_add(mat3x3 A, mat3x3 B);
 mat3x3 mat3x3_mul(mat3x3 m, float x);
 void mat3x3_orthonormalize(mat3x3 *m);
+void symmetric_mat3x3_eigenvectors(mat3x3 m, mat3x3 *eigenvectors, vec3 *eigenvalues);
 mat3x3 axis_angle_rotate_mat3x3(mat3x3 matrix, vec3 axis, float theta);
 
 // 4x4 matrices.
@@ -148,6 +149,7 @@ vec4 matrix_vec4(mat4x4 matrix, vec4 v);
 // "Rigid" 4x4 matrix routines. A "rigid" matrix is one that represents a frame of reference.
 mat4x4 rigid_mat4x4_inverse(mat4x4 m);
 vec3 rigid_matrix_vec3(mat4x4 matrix, vec3 v);
+vec3 rigid_matrix_transpose_vec3(mat4x4 matrix, vec3 v);
 vec3 translation_vector_rigid_mat4x4(mat4x4 m);
 mat3x3 rotation_part_rigid_mat4x4(mat4x4 m);
 mat4x4 mat4x4_lookat(vec3 origin, vec3 look_at, vec3 approx_up);
@@ -3,6 +3,10 @@
 
 Model load_OFF_model(char *filename);
 Model polyhedron_to_model(Polyhedron polyhedron);
+Model convex_hull_model(vec3 *points, int num_points);
+void model_destroy(Model *model);
+HalfEdgeMesh model_to_half_edge_mesh(Model model);
+Model half_edge_mesh_to_model(HalfEdgeMesh *mesh);
 Model make_surface_of_revolution(float *xs, float *ys, int num_points, int tessellation);
 Model make_capsule(float radius, float height);
 Model make_cylinder(float radius, float height);
@@ -12,10 +12,12 @@
 #include "helper_definitions.h"
 #include "mathematics.h"
 #include "doubly_linked_list.h"
+#include "thread_pool.h"
 #include "entities.h"
 #include "input.h"
 #include "geometry.h"
 #include "collision.h"
+#include "broadphase.h"
 #include "camera.h"
 #include "control_widget.h"
 #include "player.h"
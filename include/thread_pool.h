@@ -0,0 +1,22 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+/*================================================================================
+    Thread pool.
+    A fixed set of worker threads runs parallel loops, such as the phases of the physics step.
+
+    usage:
+        parallel_for(count, function, data);
+            calls function(i, data) for each i from 0 to count - 1, shared between the workers and the calling thread,
+            and returns once every call has finished.
+        Each call should only write to its own results, which are then merged in index order by the caller, so that
+        nothing depends on which thread ran which index. Then the results are the same for any number of threads.
+        parallel_for can not be called from inside a parallel loop.
+    num_worker_threads can be set before the first parallel_for. By default, one worker is started for each other processor.
+    If it is 0, everything runs on the calling thread.
+================================================================================*/
+
+typedef void (*ParallelFunction)(int index, void *data);
+extern int num_worker_threads;
+void parallel_for(int count, ParallelFunction function, void *data);
+
+#endif // THREAD_POOL_H
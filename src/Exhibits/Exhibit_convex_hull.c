@@ -196,11 +196,11 @@ static void split_model(Model model, vec3 point, vec3 normal, Model *part_a, Mod
         }
     }
     // Construct another model as an easy way to get the triangles.
-    Model ___part_a_model = polyhedron_to_model(convex_hull(part_a_model.vertices, part_a_model.num_vertices));
+    Model ___part_a_model = convex_hull_model(part_a_model.vertices, part_a_model.num_vertices);
     part_a_model.triangles = ___part_a_model.triangles;
     part_a_model.num_triangles = ___part_a_model.num_triangles;
     // Construct another model as an easy way to get the triangles.
-    Model ___part_b_model = polyhedron_to_model(convex_hull(part_b_model.vertices, part_b_model.num_vertices));
+    Model ___part_b_model = convex_hull_model(part_b_model.vertices, part_b_model.num_vertices);
     part_b_model.triangles = ___part_b_model.triangles;
     part_b_model.num_triangles = ___part_b_model.num_triangles;
     *part_a = part_a_model;
@@ -345,12 +345,12 @@ static void visualize_convex_hull(Entity *e, Behaviour *b)
                 Entity *part = add_entity(e->position, e->euler_angles);
                 part->scale = e->scale;
                 ModelRenderer *part_renderer = add_model_renderer(part, parts[i]);
-                add_collider(part, parts[i].vertices, parts[i].num_vertices, true);
+                add_collider(part, parts[i].vertices, parts[i].num_vertices);
                 add_rigid_body(part, 1);
             }
             #endif
 
-            //----Destroy the hull.
+            polyhedron_destroy(&v->hull);
             v->has_hull = false;
             v->point_index = 4;
             v->timer = 1.0 / rate;
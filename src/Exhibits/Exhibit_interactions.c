@@ -22,8 +22,7 @@ void create_exhibit_interactions(void)
 
         Entity *pillar = add_entity(pillar_pos, vec3_zero());
         ModelRenderer *pillar_renderer = add_model_renderer(pillar, pillar_model);
-        Polyhedron block = make_block(1.1,2.1,1.1);
-        add_collider(pillar, polyhedron_points(block), polyhedron_num_points(&block), false);
+        add_box_collider(pillar, vec3_zero(), 1.1,2.1,1.1);
 
         Model display_model;
         switch (i) {
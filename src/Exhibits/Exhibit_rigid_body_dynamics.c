@@ -14,18 +14,6 @@ typedef struct RigidBodyInteractor_s {
     float last_drag_y;
 } RigidBodyInteractor;
 
-void rigid_body_interactor_update(Entity *e, Behaviour *b)
-{
-    RigidBodyInteractor *rbi = b->data;
-
-    //--- Hack: If the objects glitch through the tumbler, try put them back.
-    vec3 d = vec3_sub(e->position, ex_pos);
-    if (vec3_dot(d, d) > 6*6) {
-        e->position = ex_pos;
-        rbi->rb->linear_momentum = vec3_zero();
-        rbi->rb->angular_momentum = vec3_zero();
-    }
-}
 void rigid_body_interactor_mouse_motion_listener(Entity *e, Behaviour *b, float x, float y)
 {
     RigidBodyInteractor *rbi = b->data;
@@ -58,6 +46,7 @@ void rigid_body_interactor_mouse_motion_listener(Entity *e, Behaviour *b, float
             vec3 diff = vec3_add(vec3_mul(vec3_sub(rect[3], rect[0]), dx), vec3_mul(vec3_sub(rect[0], rect[1]), dy));
             float drag_power = 1.3;
             rbi->rb->linear_momentum = vec3_add(rbi->rb->linear_momentum, vec3_mul(diff, rbi->rb->mass * drag_power));
+            rigid_body_wake(rbi->rb);
 
         } else {
             rbi->dragging = false;
@@ -91,7 +80,7 @@ static void make_rigid_body(vec3 *points, int num_points, vec3 position, float s
 {
     Entity *e = add_entity(position, vec3_zero());
     e->scale = scale;
-    Model model = polyhedron_to_model(convex_hull(points, num_points));
+    Model model = convex_hull_model(points, num_points);
     model_compute_normals(&model);
     model.flat_color = WHITE;
     // Compute orthogonally projected texture coordinates.
@@ -107,10 +96,10 @@ static void make_rigid_body(vec3 *points, int num_points, vec3 position, float s
     model.textured = true;
     ModelRenderer *renderer = add_model_renderer(e, model);
 
-    add_collider(e, model.vertices, model.num_vertices, true);
+    add_collider(e, model.vertices, model.num_vertices);
     RigidBody *rb = add_rigid_body(e, mass);
 
-    Behaviour *rbi_b = add_behaviour(e, rigid_body_interactor_update, sizeof(RigidBodyInteractor), NoID);
+    Behaviour *rbi_b = add_behaviour(e, NULL, sizeof(RigidBodyInteractor), NoID);
     rbi_b->mouse_listener = rigid_body_interactor_mouse_listener;
     rbi_b->mouse_motion_listener = rigid_body_interactor_mouse_motion_listener;
     RigidBodyInteractor *rbi = rbi_b->data;
@@ -156,35 +145,27 @@ void create_exhibit_rigid_body_dynamics(void)
         1,11,5,
         11,1,5,
     };
+    // The tumbler is a hollow box, made of a compound of its walls.
+    Collider *tumbler_collider = begin_compound_collider(tumbler);
     for (int i = 0; i < 4; i++) {
         Model side_model = make_tessellated_block_with_uvs(side_extents[3*i],side_extents[3*i+1],side_extents[3*i+2], 5,5,5, 5);
-        Model side_collider = make_tessellated_block(side_extents[3*i],side_extents[3*i+1],side_extents[3*i+2], 2,2,2);
         for (int j = 0; j < side_model.num_vertices; j++) {
             side_model.vertices[j] = vec3_add(side_model.vertices[j], side_positions[i]);
         }
-        for (int j = 0; j < side_collider.num_vertices; j++) {
-            side_collider.vertices[j] = vec3_add(side_collider.vertices[j], side_positions[i]);
-        }
         model_compute_normals(&side_model);
         side_model.textured = true;
         side_model.texture = load_texture("resources/rock.bmp");
         side_model.flat_color = GRAY;
         ModelRenderer *renderer = add_model_renderer(tumbler, side_model);
-        add_collider(tumbler, side_collider.vertices, side_collider.num_vertices, true);
+        add_box_collider(tumbler, side_positions[i], side_extents[3*i],side_extents[3*i+1],side_extents[3*i+2]);
     }
     for (float z = -2.5; z < 3; z += 5) {
-        Model block = make_tessellated_block(11,11,0.2, 2,2,2);
-        for (int j = 0; j < block.num_vertices; j++) Z(block.vertices[j]) += z;
-        add_collider(tumbler, block.vertices, block.num_vertices, true);
+        add_box_collider(tumbler, new_vec3(0,0,z), 11,11,0.2);
     }
+    end_compound_collider(tumbler_collider);
+    // The tumbler is spun by its update function, so it is kinematic rather than part of the static world.
+    set_collider_motion(tumbler_collider, ColliderKinematic);
 
-#if 0
-    for (int i = 0; i < 7; i++) {
-        int n = 30;
-        vec3 *points = random_points(1, n);
-        make_rigid_body(points, n, player_start_position, 2, 1);
-    }
-#endif
     Model icosahedron = make_icosahedron(1);
     make_rigid_body(icosahedron.vertices, icosahedron.num_vertices, ex_pos, 2, 0.9);
     Model cube = make_tessellated_block(1,1,1, 2,2,2);
@@ -222,7 +203,7 @@ void create_exhibit_rigid_body_dynamics(void)
         };
         vec3 *points = N == 0 ? points1 : points2;
         Entity *ramp = add_entity(vec3_add(ex_pos, new_vec3(10,-8.5,1)), new_vec3(0,-M_PI/2,0));
-        Model ramp_model = polyhedron_to_model(convex_hull(points, 8));
+        Model ramp_model = convex_hull_model(points, 8);
         model_compute_normals(&ramp_model);
         ramp_model.textured = true;
         float *uvs = malloc(sizeof(float) * 2*ramp_model.num_vertices);
@@ -241,7 +222,7 @@ void create_exhibit_rigid_body_dynamics(void)
         if (N == 0) ramp_model.texture = load_texture("resources/rock.bmp");
         else ramp_model.texture = load_texture("resources/floor.bmp");
         add_model_renderer(ramp, ramp_model);
-        add_collider(ramp, ramp_model.vertices, ramp_model.num_vertices, true);
+        add_collider(ramp, ramp_model.vertices, ramp_model.num_vertices);
     }
     for (int N = 0; N < 2; N++) {
         Model rod_model = make_tessellated_block_with_uvs(13,0.7,0.7, 4,2,2,  10);
@@ -281,7 +262,7 @@ void create_exhibit_rigid_body_dynamics(void)
             b1.textured = true;
             b1.texture = load_texture("resources/rock.bmp");
             add_model_renderer(e1, b1);
-            add_collider(e1, b1collider.vertices, b1collider.num_vertices, false);
+            add_collider(e1, b1collider.vertices, b1collider.num_vertices);
         }
     }
     #endif
@@ -0,0 +1,118 @@
+/*================================================================================
+    Physics benchmark.
+    This runs the rigid body dynamics without a window, for scenes of random convex bodies dropped into a walled
+    box, and prints the time per step spent in each phase, and the number of pairs tested per step, as CSV.
+    Each scene is built from the same seed, so runs can be compared for scaling regressions in the collision code.
+
+    usage:
+        ./bench_physics [steps [threads [bodies...]]]
+    The default is 300 steps, on one thread, with 10, 100, 1000 and 5000 bodies.
+================================================================================*/
+#include "museum.h"
+#include <unistd.h>
+#include <sys/wait.h>
+
+// The globals which are otherwise defined by the museum program.
+float aspect_ratio = DEFAULT_ASPECT_RATIO;
+int window_width = 0;
+int window_height = 0;
+float total_time = 0;
+float dt = 0;
+vec3 player_start_position = {{0,3,0}};
+float gravity_constant = 9.81;
+mat4x4 view_matrix = {{0}};
+Camera *main_camera = NULL;
+Entity *main_camera_entity = NULL;
+
+#define BENCH_SEED 1
+#define BENCH_SPACING 3.0
+#define BENCH_POINTS 30
+
+static void create_bench_scene(int num_bodies)
+{
+    srand(BENCH_SEED);
+    // The bodies start in a grid of layers over a box, which is walled so that they pile up.
+    int side = MAX(1, (int) ceil(sqrt(num_bodies / 4.0)));
+    float width = side * BENCH_SPACING + 2;
+    Entity *floor = add_entity(new_vec3(0,-0.5,0), vec3_zero());
+    add_box_collider(floor, vec3_zero(), width + 2, 1, width + 2);
+    float wall_height = 2 * BENCH_SPACING;
+    for (int i = 0; i < 4; i++) {
+        float side_offset = (i % 2 == 0 ? 1 : -1) * (width + 1) / 2;
+        vec3 position = i < 2 ? new_vec3(side_offset, wall_height/2, 0) : new_vec3(0, wall_height/2, side_offset);
+        Entity *wall = add_entity(position, vec3_zero());
+        if (i < 2) add_box_collider(wall, vec3_zero(), 1, wall_height, width + 2);
+        else add_box_collider(wall, vec3_zero(), width + 2, wall_height, 1);
+    }
+    for (int i = 0; i < num_bodies; i++) {
+        int layer = i / (side * side);
+        int x = (i % (side * side)) % side;
+        int z = (i % (side * side)) / side;
+        vec3 position = new_vec3((x - 0.5*(side - 1)) * BENCH_SPACING, 2 + layer * BENCH_SPACING, (z - 0.5*(side - 1)) * BENCH_SPACING);
+        Entity *e = add_entity(position, new_vec3(crand(), crand(), crand()));
+        vec3 *points = random_points(1, BENCH_POINTS);
+        add_collider(e, points, BENCH_POINTS);
+        add_rigid_body(e, 1);
+    }
+}
+
+static void print_header(void)
+{
+    printf("bodies,steps,threads,step_ms,integrate_ms,broadphase_ms,ccd_ms,narrowphase_ms,bounds_ms,gjk_ms,epa_ms,impulse_ms,"
+           "pairs_per_step,bounds_tests_per_step,gjk_queries_per_step,epa_queries_per_step,contacts_per_step\n");
+}
+
+// Run a scene and print its row. The times are the mean per step in milliseconds, and GJK is given without its EPA.
+static void run_bench(int num_bodies, int num_steps, int num_threads)
+{
+    num_worker_threads = num_threads - 1;
+    init_entity_system();
+    create_bench_scene(num_bodies);
+    physics_profiling = true;
+    memset(&physics_profile, 0, sizeof(PhysicsProfile));
+    for (int i = 0; i < num_steps; i++) rigid_body_dynamics();
+
+    PhysicsProfile *p = &physics_profile;
+    double ms = 1e-6 / num_steps;
+    double per_step = 1.0 / num_steps;
+    printf("%d,%d,%d,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+           num_bodies, num_steps, num_threads,
+           p->step_time * ms, p->integrate_time * ms, p->broadphase_time * ms, p->ccd_time * ms, p->narrowphase_time * ms,
+           p->bounds_time * ms, (p->gjk_time - p->epa_time) * ms, p->epa_time * ms, p->impulse_time * ms,
+           p->num_pairs * per_step, p->num_bounds_tests * per_step, p->num_gjk_queries * per_step, p->num_epa_queries * per_step,
+           p->num_contacts * per_step);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+    int num_steps = argc > 1 ? atoi(argv[1]) : 300;
+    int num_threads = argc > 2 ? atoi(argv[2]) : 1;
+    int default_counts[] = { 10, 100, 1000, 5000 };
+    int num_scenes = argc > 3 ? argc - 3 : (int) (sizeof(default_counts) / sizeof(int));
+    if (num_steps <= 0 || num_threads <= 0) {
+        fprintf(stderr, "ERROR: usage: ./bench_physics [steps [threads [bodies...]]]\n");
+        exit(EXIT_FAILURE);
+    }
+    print_header();
+    // The entity system can't be cleared, so each scene is run in its own process.
+    for (int i = 0; i < num_scenes; i++) {
+        int num_bodies = argc > 3 ? atoi(argv[3 + i]) : default_counts[i];
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid < 0) {
+            fprintf(stderr, "ERROR: Failed to fork the benchmark.\n");
+            exit(EXIT_FAILURE);
+        }
+        if (pid == 0) {
+            run_bench(num_bodies, num_steps, num_threads);
+            exit(EXIT_SUCCESS);
+        }
+        int status;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+            fprintf(stderr, "ERROR: The benchmark with %d bodies failed.\n", num_bodies);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
@@ -0,0 +1,653 @@
+/*================================================================================
+    Broadphase.
+    There are two methods for keeping the list of pairs of colliders with overlapping bounding boxes:
+
+    Persistent sweep-and-prune.
+        The minimum and maximum of each collider's bounding box are kept in a sorted endpoint list on each axis.
+        These lists are re-sorted every update by insertion sort starting from last update's order, which is nearly
+        linear since colliders move little between frames. When a minimum endpoint passes a maximum endpoint, two boxes
+        may have started to overlap, and when a maximum passes a minimum, two boxes have stopped overlapping. These swap
+        events are the only times the pair list is changed.
+    Dynamic AABB tree.
+        Each collider is a leaf of a bounding volume hierarchy, holding a "fat" box which is the collider's box
+        grown by a margin. A collider is only reinserted into the tree when its box leaves its fat box, so colliders
+        which do not move (such as the static scenery) are inserted once. New pairs are found by querying the tree with the
+        fat boxes of the reinserted colliders, and the tree is kept balanced by rotations, so each query costs O(log n).
+================================================================================*/
+#include "museum.h"
+
+BroadphaseMethod broadphase_method = DynamicAABBTree;
+
+typedef struct BroadphaseProxy_s {
+    Collider *collider;
+    Entity *entity;
+    // For the dynamic AABB tree, this is the fat box.
+    float min[3];
+    float max[3];
+    int leaf; // The tree node of this proxy, if using the dynamic AABB tree.
+    // The positions of the minimum and maximum endpoints in each axis's endpoint list, if using sweep-and-prune.
+    int sap_positions[3][2];
+    // The box of the collider at the last broadphase_update, and whether it changed in that update.
+    float last_min[3];
+    float last_max[3];
+    bool moved;
+} BroadphaseProxy;
+
+typedef struct SAPEndpoint_s {
+    float value;
+    int proxy;
+    bool is_max;
+} SAPEndpoint;
+
+static BroadphaseProxy *proxies = NULL;
+static int num_proxies = 0;
+static int proxies_size = 0;
+static SAPEndpoint *endpoints[3] = {NULL};
+
+// The pair list is kept dense for iteration. The set of pairs is also indexed by an open-addressing hash table,
+// keyed by the two proxy indices, so that pairs can be found when endpoints swap.
+int num_collision_pairs = 0;
+CollisionPair *collision_pairs = NULL;
+static uint64_t *pair_keys = NULL; // Parallel to collision_pairs.
+static int collision_pairs_size = 0;
+static int *pair_table = NULL; // Each slot holds a pair index + 1, or 0 if empty.
+static int pair_table_size = 0;
+
+#define pair_key(A,B) ( (A) < (B) ? ((uint64_t) (A) << 32) | (uint32_t) (B) : ((uint64_t) (B) << 32) | (uint32_t) (A) )
+static uint32_t hash_pair_key(uint64_t key)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return (uint32_t) key;
+}
+
+static int find_pair_slot(uint64_t key)
+{
+    // Returns the slot the key is in, or the empty slot where it would go.
+    int mask = pair_table_size - 1;
+    int slot = hash_pair_key(key) & mask;
+    while (pair_table[slot] != 0 && pair_keys[pair_table[slot] - 1] != key) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+static void resize_pair_table(int new_size)
+{
+    free(pair_table);
+    pair_table_size = new_size;
+    pair_table = calloc(pair_table_size, sizeof(int));
+    mem_check(pair_table);
+    for (int i = 0; i < num_collision_pairs; i++) {
+        pair_table[find_pair_slot(pair_keys[i])] = i + 1;
+    }
+}
+
+static void add_pair(int a, int b)
+{
+    if (pair_table_size == 0 || 2*(num_collision_pairs + 1) > pair_table_size) {
+        resize_pair_table(pair_table_size == 0 ? 256 : 2*pair_table_size);
+    }
+    uint64_t key = pair_key(a, b);
+    int slot = find_pair_slot(key);
+    if (pair_table[slot] != 0) return; // The pair is already in the list.
+
+    if (num_collision_pairs == collision_pairs_size) {
+        collision_pairs_size = collision_pairs_size == 0 ? 128 : 2*collision_pairs_size;
+        collision_pairs = realloc(collision_pairs, sizeof(CollisionPair) * collision_pairs_size);
+        mem_check(collision_pairs);
+        pair_keys = realloc(pair_keys, sizeof(uint64_t) * collision_pairs_size);
+        mem_check(pair_keys);
+    }
+    int lo = a < b ? a : b;
+    int hi = a < b ? b : a;
+    CollisionPair *pair = &collision_pairs[num_collision_pairs];
+    pair->A = proxies[lo].collider;
+    pair->A_entity = proxies[lo].entity;
+    pair->B = proxies[hi].collider;
+    pair->B_entity = proxies[hi].entity;
+    init_collision_cache(&pair->cache);
+    pair->num_contact_points = 0;
+    pair->child_pairs = NULL;
+    pair->num_child_pairs = 0;
+    pair->child_pairs_size = 0;
+    pair_keys[num_collision_pairs] = key;
+    pair_table[slot] = ++num_collision_pairs;
+}
+
+static void remove_pair(int a, int b)
+{
+    if (num_collision_pairs == 0) return;
+    uint64_t key = pair_key(a, b);
+    int slot = find_pair_slot(key);
+    if (pair_table[slot] == 0) return;
+    int index = pair_table[slot] - 1;
+
+    // Remove the table entry by shifting back the entries after it in the probe sequence, so no tombstones are needed.
+    int mask = pair_table_size - 1;
+    int hole = slot;
+    int next = (hole + 1) & mask;
+    while (pair_table[next] != 0) {
+        int home = hash_pair_key(pair_keys[pair_table[next] - 1]) & mask;
+        // Move the entry into the hole if its home slot is not cyclically in (hole, next].
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            pair_table[hole] = pair_table[next];
+            hole = next;
+        }
+        next = (next + 1) & mask;
+    }
+    pair_table[hole] = 0;
+    free(collision_pairs[index].child_pairs);
+
+    // Swap the last pair into the removed pair's place in the dense list.
+    int last = --num_collision_pairs;
+    if (index != last) {
+        collision_pairs[index] = collision_pairs[last];
+        pair_keys[index] = pair_keys[last];
+        pair_table[find_pair_slot(pair_keys[index])] = index + 1;
+    }
+}
+
+// Whether the colliders of two proxies can be a pair. This is checked before their boxes.
+static bool proxies_can_pair(int a, int b)
+{
+    return proxies[a].entity != proxies[b].entity && colliders_can_collide(proxies[a].collider, proxies[b].collider);
+}
+
+static bool proxies_overlap(int a, int b)
+{
+    for (int i = 0; i < 3; i++) {
+        if (proxies[a].min[i] > proxies[b].max[i] || proxies[a].max[i] < proxies[b].min[i]) return false;
+    }
+    return true;
+}
+
+// Swap the endpoint at the given position of an axis's list with the one after it, which moves to its left.
+static void swap_endpoints(int axis, int position)
+{
+    SAPEndpoint *list = endpoints[axis];
+    SAPEndpoint e = list[position + 1];
+    SAPEndpoint f = list[position];
+    // e moves to the left of f.
+    if (!e.is_max && f.is_max) {
+        // A minimum has passed a maximum, so the boxes might now overlap.
+        if (proxies_can_pair(e.proxy, f.proxy) && proxies_overlap(e.proxy, f.proxy)) add_pair(e.proxy, f.proxy);
+    } else if (e.is_max && !f.is_max) {
+        // A maximum has passed a minimum, so the boxes are now separated on this axis.
+        remove_pair(e.proxy, f.proxy);
+    }
+    list[position] = e;
+    list[position + 1] = f;
+    proxies[e.proxy].sap_positions[axis][e.is_max] = position;
+    proxies[f.proxy].sap_positions[axis][f.is_max] = position + 1;
+}
+
+// Move the endpoint at the given position of an axis's list to its place, when the rest of the list is in order.
+static void sift_endpoint(int axis, int position)
+{
+    SAPEndpoint *list = endpoints[axis];
+    int n = 2*num_proxies;
+    while (position > 0 && list[position - 1].value > list[position].value) swap_endpoints(axis, --position);
+    while (position < n - 1 && list[position + 1].value < list[position].value) swap_endpoints(axis, position++);
+}
+
+static void sort_axis(int axis)
+{
+    SAPEndpoint *list = endpoints[axis];
+    int n = 2*num_proxies;
+    // Refresh the endpoint values from the (possibly moved) boxes.
+    for (int i = 0; i < n; i++) {
+        BroadphaseProxy *proxy = &proxies[list[i].proxy];
+        list[i].value = list[i].is_max ? proxy->max[axis] : proxy->min[axis];
+    }
+    // Insertion sort, starting from the order of the last update.
+    for (int i = 1; i < n; i++) {
+        for (int j = i; j > 0 && list[j - 1].value > list[j].value; j--) swap_endpoints(axis, j - 1);
+    }
+}
+
+static void update_proxy_bounds(int index)
+{
+    BroadphaseProxy *proxy = &proxies[index];
+    collider_world_aabb(proxy->collider, proxy->entity, proxy->min, proxy->max);
+}
+
+//--------------------------------------------------------------------------------
+// Dynamic AABB tree.
+//--------------------------------------------------------------------------------
+// The margin the boxes in the tree are grown by.
+#define AABB_TREE_MARGIN 0.2
+
+typedef struct AABBTreeNode_s {
+    float min[3];
+    float max[3];
+    int parent; // If this node is free, this is the next node in the free list.
+    int children[2];
+    int height; // Leaves are at height 0.
+    int proxy; // Only leaves have a proxy.
+} AABBTreeNode;
+#define is_leaf(NODE) ( tree_nodes[( NODE )].children[0] == -1 )
+
+static AABBTreeNode *tree_nodes = NULL;
+static int tree_nodes_size = 0;
+static int tree_root = -1;
+static int tree_free_list = -1;
+// The proxies which were reinserted in this update, whose new pairs need to be found.
+static int *moved_proxies = NULL;
+static int num_moved_proxies = 0;
+
+static int allocate_tree_node(void)
+{
+    if (tree_free_list == -1) {
+        int old_size = tree_nodes_size;
+        tree_nodes_size = tree_nodes_size == 0 ? 512 : 2*tree_nodes_size;
+        tree_nodes = realloc(tree_nodes, sizeof(AABBTreeNode) * tree_nodes_size);
+        mem_check(tree_nodes);
+        for (int i = old_size; i < tree_nodes_size; i++) {
+            tree_nodes[i].parent = i == tree_nodes_size - 1 ? -1 : i + 1;
+        }
+        tree_free_list = old_size;
+    }
+    int node = tree_free_list;
+    tree_free_list = tree_nodes[node].parent;
+    tree_nodes[node].parent = -1;
+    tree_nodes[node].children[0] = -1;
+    tree_nodes[node].children[1] = -1;
+    tree_nodes[node].height = 0;
+    tree_nodes[node].proxy = -1;
+    return node;
+}
+static void free_tree_node(int node)
+{
+    tree_nodes[node].parent = tree_free_list;
+    tree_nodes[node].height = -1;
+    tree_free_list = node;
+}
+
+static float box_area(float min[3], float max[3])
+{
+    float dx = max[0] - min[0];
+    float dy = max[1] - min[1];
+    float dz = max[2] - min[2];
+    return 2*(dx*dy + dy*dz + dz*dx);
+}
+static float union_area(int node_a, int node_b)
+{
+    float min[3], max[3];
+    for (int i = 0; i < 3; i++) {
+        min[i] = MIN(tree_nodes[node_a].min[i], tree_nodes[node_b].min[i]);
+        max[i] = MAX(tree_nodes[node_a].max[i], tree_nodes[node_b].max[i]);
+    }
+    return box_area(min, max);
+}
+// Recompute the box and height of an internal node from its children.
+static void refit_tree_node(int node)
+{
+    AABBTreeNode *n = &tree_nodes[node];
+    AABBTreeNode *c1 = &tree_nodes[n->children[0]];
+    AABBTreeNode *c2 = &tree_nodes[n->children[1]];
+    for (int i = 0; i < 3; i++) {
+        n->min[i] = MIN(c1->min[i], c2->min[i]);
+        n->max[i] = MAX(c1->max[i], c2->max[i]);
+    }
+    n->height = 1 + MAX(c1->height, c2->height);
+}
+
+// If one child of the node is more than one level taller than the other, rotate the taller child up into the node's place.
+// Returns the node now in this place in the tree.
+static int balance_tree_node(int a)
+{
+    if (is_leaf(a) || tree_nodes[a].height < 2) return a;
+    int b = tree_nodes[a].children[0];
+    int c = tree_nodes[a].children[1];
+    int balance = tree_nodes[c].height - tree_nodes[b].height;
+    if (balance >= -1 && balance <= 1) return a;
+
+    // up: The taller child, which is rotated up. side: Which child of a it is.
+    int side = balance > 1 ? 1 : 0;
+    int up = tree_nodes[a].children[side];
+    int f = tree_nodes[up].children[0];
+    int g = tree_nodes[up].children[1];
+
+    // Swap a and up.
+    tree_nodes[up].children[0] = a;
+    tree_nodes[up].parent = tree_nodes[a].parent;
+    tree_nodes[a].parent = up;
+    int parent = tree_nodes[up].parent;
+    if (parent == -1) {
+        tree_root = up;
+    } else if (tree_nodes[parent].children[0] == a) {
+        tree_nodes[parent].children[0] = up;
+    } else {
+        tree_nodes[parent].children[1] = up;
+    }
+    // The taller grandchild stays under up, and the shorter one is moved under a.
+    int keep = tree_nodes[f].height > tree_nodes[g].height ? f : g;
+    int move = keep == f ? g : f;
+    tree_nodes[up].children[1] = keep;
+    tree_nodes[a].children[side] = move;
+    tree_nodes[move].parent = a;
+    refit_tree_node(a);
+    refit_tree_node(up);
+    return up;
+}
+
+// Walk up the tree from a node, rebalancing and refitting the boxes of its ancestors.
+static void refit_tree_ancestors(int node)
+{
+    while (node != -1) {
+        node = balance_tree_node(node);
+        refit_tree_node(node);
+        node = tree_nodes[node].parent;
+    }
+}
+
+static void insert_tree_leaf(int leaf)
+{
+    if (tree_root == -1) {
+        tree_root = leaf;
+        tree_nodes[leaf].parent = -1;
+        return;
+    }
+    // Find the best sibling for the new leaf, descending the tree by the increase in surface area caused by the insertion.
+    int node = tree_root;
+    while (!is_leaf(node)) {
+        float area = box_area(tree_nodes[node].min, tree_nodes[node].max);
+        float combined_area = union_area(node, leaf);
+        // The cost of making the leaf a sibling of this node.
+        float cost = 2*combined_area;
+        // The minimum cost of pushing the leaf further down the tree, as this node's box will grow.
+        float inheritance_cost = 2*(combined_area - area);
+        float child_costs[2];
+        for (int i = 0; i < 2; i++) {
+            int child = tree_nodes[node].children[i];
+            child_costs[i] = union_area(child, leaf) + inheritance_cost;
+            if (!is_leaf(child)) child_costs[i] -= box_area(tree_nodes[child].min, tree_nodes[child].max);
+        }
+        if (cost < child_costs[0] && cost < child_costs[1]) break;
+        node = tree_nodes[node].children[child_costs[0] < child_costs[1] ? 0 : 1];
+    }
+    int sibling = node;
+
+    // Create a new parent for the leaf and its sibling.
+    int old_parent = tree_nodes[sibling].parent;
+    int new_parent = allocate_tree_node();
+    tree_nodes[new_parent].parent = old_parent;
+    tree_nodes[new_parent].children[0] = sibling;
+    tree_nodes[new_parent].children[1] = leaf;
+    tree_nodes[sibling].parent = new_parent;
+    tree_nodes[leaf].parent = new_parent;
+    if (old_parent == -1) {
+        tree_root = new_parent;
+    } else if (tree_nodes[old_parent].children[0] == sibling) {
+        tree_nodes[old_parent].children[0] = new_parent;
+    } else {
+        tree_nodes[old_parent].children[1] = new_parent;
+    }
+    refit_tree_ancestors(new_parent);
+}
+
+static void remove_tree_leaf(int leaf)
+{
+    if (leaf == tree_root) {
+        tree_root = -1;
+        return;
+    }
+    // The leaf's parent is removed, and the leaf's sibling takes its place.
+    int parent = tree_nodes[leaf].parent;
+    int grandparent = tree_nodes[parent].parent;
+    int sibling = tree_nodes[parent].children[0] == leaf ? tree_nodes[parent].children[1] : tree_nodes[parent].children[0];
+    free_tree_node(parent);
+    tree_nodes[sibling].parent = grandparent;
+    tree_nodes[leaf].parent = -1;
+    if (grandparent == -1) {
+        tree_root = sibling;
+        return;
+    }
+    if (tree_nodes[grandparent].children[0] == parent) tree_nodes[grandparent].children[0] = sibling;
+    else tree_nodes[grandparent].children[1] = sibling;
+    refit_tree_ancestors(grandparent);
+}
+
+static bool boxes_overlap(float min_a[3], float max_a[3], float min_b[3], float max_b[3])
+{
+    for (int i = 0; i < 3; i++) {
+        if (min_a[i] > max_b[i] || max_a[i] < min_b[i]) return false;
+    }
+    return true;
+}
+
+// Add a pair for each leaf in the subtree whose box overlaps the given proxy's box.
+static void find_tree_pairs(int node, int proxy)
+{
+    if (is_leaf(node)) {
+        int other = tree_nodes[node].proxy;
+        if (other != proxy && proxies_can_pair(proxy, other)
+                && boxes_overlap(tree_nodes[node].min, tree_nodes[node].max, proxies[proxy].min, proxies[proxy].max)) add_pair(proxy, other);
+        return;
+    }
+    if (!boxes_overlap(tree_nodes[node].min, tree_nodes[node].max, proxies[proxy].min, proxies[proxy].max)) return;
+    find_tree_pairs(tree_nodes[node].children[0], proxy);
+    find_tree_pairs(tree_nodes[node].children[1], proxy);
+}
+
+// Set the proxy's fat box around its collider and put it in the tree.
+static void insert_tree_proxy(int index)
+{
+    BroadphaseProxy *proxy = &proxies[index];
+    update_proxy_bounds(index);
+    for (int i = 0; i < 3; i++) {
+        proxy->min[i] -= AABB_TREE_MARGIN;
+        proxy->max[i] += AABB_TREE_MARGIN;
+    }
+    int leaf = proxy->leaf == -1 ? allocate_tree_node() : proxy->leaf;
+    proxy->leaf = leaf;
+    memcpy(tree_nodes[leaf].min, proxy->min, sizeof(float) * 3);
+    memcpy(tree_nodes[leaf].max, proxy->max, sizeof(float) * 3);
+    tree_nodes[leaf].proxy = index;
+    insert_tree_leaf(leaf);
+    moved_proxies[num_moved_proxies++] = index;
+}
+
+// Reinsert the proxy if its collider has left its fat box.
+static void update_tree_proxy(int index, float min[3], float max[3])
+{
+    BroadphaseProxy *proxy = &proxies[index];
+    for (int i = 0; i < 3; i++) {
+        if (min[i] < proxy->min[i] || max[i] > proxy->max[i]) {
+            remove_tree_leaf(proxy->leaf);
+            insert_tree_proxy(index);
+            return;
+        }
+    }
+}
+
+// Remove the pairs of the proxy with the leaves overlapping the given box which no longer overlap the proxy's fat box.
+static void remove_tree_pairs(int node, int proxy, float min[3], float max[3])
+{
+    if (!boxes_overlap(tree_nodes[node].min, tree_nodes[node].max, min, max)) return;
+    if (is_leaf(node)) {
+        int other = tree_nodes[node].proxy;
+        if (other != proxy && !boxes_overlap(proxies[other].min, proxies[other].max, proxies[proxy].min, proxies[proxy].max)) remove_pair(proxy, other);
+        return;
+    }
+    remove_tree_pairs(tree_nodes[node].children[0], proxy, min, max);
+    remove_tree_pairs(tree_nodes[node].children[1], proxy, min, max);
+}
+
+static void update_tree_pairs(void)
+{
+    // Find the new pairs of the reinserted proxies.
+    for (int i = 0; i < num_moved_proxies; i++) {
+        find_tree_pairs(tree_root, moved_proxies[i]);
+    }
+    // Remove the pairs whose fat boxes no longer overlap. Iterating backwards, as removal swaps the last pair into the removed place.
+    if (num_moved_proxies > 0) {
+        for (int i = num_collision_pairs - 1; i >= 0; --i) {
+            int a = pair_keys[i] >> 32;
+            int b = pair_keys[i] & 0xFFFFFFFF;
+            if (!boxes_overlap(proxies[a].min, proxies[a].max, proxies[b].min, proxies[b].max)) remove_pair(a, b);
+        }
+    }
+    num_moved_proxies = 0;
+}
+
+//--------------------------------------------------------------------------------
+
+void broadphase_add_collider(Collider *collider, Entity *e)
+{
+    if (num_proxies == proxies_size) {
+        proxies_size = proxies_size == 0 ? 256 : 2*proxies_size;
+        proxies = realloc(proxies, sizeof(BroadphaseProxy) * proxies_size);
+        mem_check(proxies);
+        for (int i = 0; i < 3; i++) {
+            endpoints[i] = realloc(endpoints[i], sizeof(SAPEndpoint) * 2*proxies_size);
+            mem_check(endpoints[i]);
+        }
+        moved_proxies = realloc(moved_proxies, sizeof(int) * proxies_size);
+        mem_check(moved_proxies);
+    }
+    int index = num_proxies ++;
+    collider->broadphase_proxy = index;
+    proxies[index].collider = collider;
+    proxies[index].entity = e;
+    proxies[index].leaf = -1;
+    proxies[index].moved = true;
+    collider_world_aabb(collider, e, proxies[index].last_min, proxies[index].last_max);
+    if (broadphase_method == DynamicAABBTree) {
+        // The new proxy has no pairs to remove, so only its own pairs are found.
+        insert_tree_proxy(index);
+        num_moved_proxies = 0;
+        find_tree_pairs(tree_root, index);
+        return;
+    }
+    update_proxy_bounds(index);
+    // Append the endpoints, and sift them into place, adding the pairs this collider is in.
+    for (int i = 0; i < 3; i++) {
+        endpoints[i][2*index] = (SAPEndpoint) { proxies[index].min[i], index, false };
+        endpoints[i][2*index + 1] = (SAPEndpoint) { proxies[index].max[i], index, true };
+        proxies[index].sap_positions[i][0] = 2*index;
+        proxies[index].sap_positions[i][1] = 2*index + 1;
+        sift_endpoint(i, proxies[index].sap_positions[i][0]);
+        sift_endpoint(i, proxies[index].sap_positions[i][1]);
+    }
+}
+
+// Compare the collider's box with its box at the last update.
+static void update_proxy_motion(int index, float min[3], float max[3])
+{
+    BroadphaseProxy *proxy = &proxies[index];
+    proxy->moved = false;
+    for (int i = 0; i < 3; i++) {
+        if (min[i] != proxy->last_min[i] || max[i] != proxy->last_max[i]) proxy->moved = true;
+        proxy->last_min[i] = min[i];
+        proxy->last_max[i] = max[i];
+    }
+}
+
+// The boxes of the colliders are found in parallel, and the tree or the endpoint lists are then updated in proxy order.
+static void update_proxy_box(int index, void *data)
+{
+    BroadphaseProxy *proxy = &proxies[index];
+    float min[3], max[3];
+    collider_world_aabb(proxy->collider, proxy->entity, min, max);
+    update_proxy_motion(index, min, max);
+    if (broadphase_method == SweepAndPrune) {
+        memcpy(proxy->min, min, sizeof(float) * 3);
+        memcpy(proxy->max, max, sizeof(float) * 3);
+    }
+}
+
+void broadphase_update(void)
+{
+    parallel_for(num_proxies, update_proxy_box, NULL);
+    if (broadphase_method == DynamicAABBTree) {
+        for (int i = 0; i < num_proxies; i++) {
+            update_tree_proxy(i, proxies[i].last_min, proxies[i].last_max);
+        }
+        update_tree_pairs();
+        return;
+    }
+    for (int i = 0; i < 3; i++) {
+        sort_axis(i);
+    }
+}
+
+// Only the pairs of this collider can change, so rather than updating every proxy, its own proxy is moved into place.
+void broadphase_update_collider(Collider *collider)
+{
+    int index = collider->broadphase_proxy;
+    BroadphaseProxy *proxy = &proxies[index];
+    if (broadphase_method == DynamicAABBTree) {
+        float min[3], max[3], old_min[3], old_max[3];
+        collider_world_aabb(proxy->collider, proxy->entity, min, max);
+        memcpy(old_min, proxy->min, sizeof(float) * 3);
+        memcpy(old_max, proxy->max, sizeof(float) * 3);
+        update_tree_proxy(index, min, max);
+        if (num_moved_proxies == 0) return;
+        num_moved_proxies = 0;
+        // The proxy's pairs are with the leaves its old fat box overlapped, so only those are checked.
+        remove_tree_pairs(tree_root, index, old_min, old_max);
+        find_tree_pairs(tree_root, index);
+        return;
+    }
+    update_proxy_bounds(index);
+    for (int i = 0; i < 3; i++) {
+        int *positions = proxy->sap_positions[i];
+        // The endpoint leading the motion is sifted first, so that it is not held back by the other endpoint.
+        int lead = proxy->min[i] < endpoints[i][positions[0]].value ? 0 : 1;
+        endpoints[i][positions[0]].value = proxy->min[i];
+        endpoints[i][positions[1]].value = proxy->max[i];
+        sift_endpoint(i, positions[lead]);
+        sift_endpoint(i, positions[1 - lead]);
+    }
+}
+
+void broadphase_refilter_collider(Collider *collider)
+{
+    int index = collider->broadphase_proxy;
+    // Remove the pairs which are now filtered. Iterating backwards, as removal swaps the last pair into the removed place.
+    for (int i = num_collision_pairs - 1; i >= 0; --i) {
+        int a = pair_keys[i] >> 32;
+        int b = pair_keys[i] & 0xFFFFFFFF;
+        if ((a == index || b == index) && !proxies_can_pair(a, b)) remove_pair(a, b);
+    }
+    // Add the overlapping pairs which are now allowed.
+    if (broadphase_method == DynamicAABBTree) {
+        if (tree_root != -1) find_tree_pairs(tree_root, index);
+        return;
+    }
+    for (int i = 0; i < num_proxies; i++) {
+        if (i != index && proxies_can_pair(index, i) && proxies_overlap(index, i)) add_pair(index, i);
+    }
+}
+
+bool broadphase_collider_moved(Collider *collider)
+{
+    return proxies[collider->broadphase_proxy].moved;
+}
+
+static int query_tree(int node, float min[3], float max[3], Collider **colliders, int num_found, int max_colliders)
+{
+    if (num_found == max_colliders || !boxes_overlap(tree_nodes[node].min, tree_nodes[node].max, min, max)) return num_found;
+    if (is_leaf(node)) {
+        colliders[num_found++] = proxies[tree_nodes[node].proxy].collider;
+        return num_found;
+    }
+    num_found = query_tree(tree_nodes[node].children[0], min, max, colliders, num_found, max_colliders);
+    return query_tree(tree_nodes[node].children[1], min, max, colliders, num_found, max_colliders);
+}
+
+int broadphase_query_aabb(float min[3], float max[3], Collider **colliders, int max_colliders)
+{
+    if (broadphase_method == DynamicAABBTree) {
+        if (tree_root == -1) return 0;
+        return query_tree(tree_root, min, max, colliders, 0, max_colliders);
+    }
+    int num_found = 0;
+    for (int i = 0; i < num_proxies && num_found < max_colliders; i++) {
+        if (boxes_overlap(proxies[i].min, proxies[i].max, min, max)) colliders[num_found++] = proxies[i].collider;
+    }
+    return num_found;
+}
@@ -146,6 +146,7 @@ void generate_marching_cubes_table(void)
                 tri_index ++;
                 tri = tri->next;
             }
+            polyhedron_destroy(&hull);
         }
     }
     printf("#define max_marching_cube_triangles %d\n", max_triangles);
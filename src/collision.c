@@ -1,124 +1,702 @@
 #include "museum.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <time.h>
 
-#define MIN(X,Y) ((X) < (Y) ? (X) : (Y))
+bool physics_profiling = false;
+PhysicsProfile physics_profile = {0};
 
-static mat3x3 brute_force_polyhedron_inertia_tensor(Polyhedron poly, vec3 center, float mass)
+// The profiling clock, in nanoseconds. Nothing is timed unless physics_profiling is set.
+static int64_t profile_clock(void)
 {
-    float integrals[6] = {0}; // x^2, y^2, z^2, xy, xz, yz
-    float volume = 0;
+    if (!physics_profiling) return 0;
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (int64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+}
+// Add the time since start to a total of the profile, and count the test. This may be called from the worker threads.
+static void profile_add(int64_t *total, int64_t *count, int64_t start)
+{
+    if (!physics_profiling) return;
+    __atomic_fetch_add(total, profile_clock() - start, __ATOMIC_RELAXED);
+    if (count != NULL) __atomic_fetch_add(count, 1, __ATOMIC_RELAXED);
+}
 
-    PolyhedronPoint *point = poly.points.first;
-    vec3 min = point->position;
-    vec3 max = point->position;
-    while (point != NULL) {
-        for (int i = 0; i < 3; i++) {
-            if (point->position.vals[i] < min.vals[i]) min.vals[i] = point->position.vals[i];
-            if (point->position.vals[i] > max.vals[i]) max.vals[i] = point->position.vals[i];
+//================================================================================
+// Collider component. Colliders are all convex polyhedra.
+// Colliders with more points than this hill-climb for support points rather than testing every point.
+#define HILL_CLIMBING_MIN_POINTS 32
+
+// Build the vertex adjacency of the collider from its convex hull. The print marks of the hull points must be their collider point indices.
+static void collider_build_hull_adjacency(Collider *collider, Polyhedron hull)
+{
+    int *offsets = calloc(collider->num_points + 1, sizeof(int));
+    mem_check(offsets);
+    int *neighbours = malloc(sizeof(int) * 2 * polyhedron_num_edges(&hull));
+    mem_check(neighbours);
+    // Count the degree of each point, then take the prefix sums to get the offsets.
+    PolyhedronEdge *e = hull.edges.first;
+    while (e != NULL) {
+        offsets[e->a->print_mark + 1] ++;
+        offsets[e->b->print_mark + 1] ++;
+        e = e->next;
+    }
+    for (int i = 0; i < collider->num_points; i++) {
+        offsets[i + 1] += offsets[i];
+    }
+    int *fill = calloc(collider->num_points, sizeof(int));
+    mem_check(fill);
+    e = hull.edges.first;
+    while (e != NULL) {
+        int a = e->a->print_mark;
+        int b = e->b->print_mark;
+        neighbours[offsets[a] + fill[a]++] = b;
+        neighbours[offsets[b] + fill[b]++] = a;
+        e = e->next;
+    }
+    free(fill);
+    collider->hull_neighbour_offsets = offsets;
+    collider->hull_neighbours = neighbours;
+    collider->hull_start = hull.points.first->print_mark;
+}
+
+// Set the faces of a collider, given the point indices of each face and its outward normal. The points of each face are put in order around it.
+static void collider_set_faces(Collider *collider, int num_faces, vec3 *normals, int *offsets, int *vertices)
+{
+    for (int i = 0; i < num_faces; i++) {
+        int *face = &vertices[offsets[i]];
+        int n = offsets[i + 1] - offsets[i];
+        vec3 centroid = vec3_zero();
+        for (int j = 0; j < n; j++) centroid = vec3_add(centroid, collider->points[face[j]]);
+        centroid = vec3_mul(centroid, 1.0 / n);
+        vec3 u = vec3_sub(collider->points[face[0]], centroid);
+        vec3 v = vec3_cross(normals[i], u);
+        float angles[n];
+        for (int j = 0; j < n; j++) {
+            vec3 r = vec3_sub(collider->points[face[j]], centroid);
+            angles[j] = atan2(vec3_dot(r, v), vec3_dot(r, u));
+        }
+        for (int j = 1; j < n; j++) {
+            for (int k = j; k > 0 && angles[k - 1] > angles[k]; k--) {
+                float temp_angle = angles[k]; angles[k] = angles[k - 1]; angles[k - 1] = temp_angle;
+                int temp = face[k]; face[k] = face[k - 1]; face[k - 1] = temp;
+            }
         }
-        point = point->next;
     }
-    float min_extent = MIN(max.vals[0] - min.vals[0], max.vals[1] - min.vals[1]);
-    min_extent = MIN(min_extent, max.vals[2] - min.vals[2]);
-    float d = 0.05 * min_extent;
-    float dcubed = d*d*d;
+    collider->num_faces = num_faces;
+    collider->face_normals = normals;
+    collider->face_offsets = offsets;
+    collider->face_vertices = vertices;
+}
+
+// Build the faces of the collider from its convex hull, merging the triangles which lie in the same plane.
+// The print marks of the hull points must be their collider point indices.
+static void collider_build_hull_faces(Collider *collider, Polyhedron hull)
+{
+    int num_triangles = polyhedron_num_triangles(&hull);
+    vec3 centroid = vec3_zero();
+    for (int i = 0; i < collider->num_points; i++) centroid = vec3_add(centroid, collider->points[i]);
+    centroid = vec3_mul(centroid, 1.0 / collider->num_points);
+    float size = 0;
+    for (int i = 0; i < collider->num_points; i++) size = MAX(size, vec3_length(vec3_sub(collider->points[i], centroid)));
 
-    for (float x = min.vals[0]; x <= max.vals[0]; x += d) {
-        for (float y = min.vals[1]; y <= max.vals[1]; y += d) {
-            for (float z = min.vals[2]; z <= max.vals[2]; z += d) {
-                if (!point_in_convex_polyhedron(new_vec3(x,y,z), poly)) continue;
-                volume += dcubed;
+    vec3 *normals = malloc(sizeof(vec3) * num_triangles);
+    mem_check(normals);
+    float *plane_distances = malloc(sizeof(float) * num_triangles);
+    mem_check(plane_distances);
+    int *triangle_faces = malloc(sizeof(int) * num_triangles);
+    mem_check(triangle_faces);
+    int num_faces = 0;
+    int t = 0;
+    for (PolyhedronTriangle *triangle = hull.triangles.first; triangle != NULL; triangle = triangle->next, t++) {
+        vec3 a = triangle->points[0]->position;
+        vec3 normal = vec3_normalize(vec3_cross(vec3_sub(triangle->points[1]->position, a), vec3_sub(triangle->points[2]->position, a)));
+        if (vec3_dot(normal, vec3_sub(a, centroid)) < 0) normal = vec3_neg(normal);
+        float distance = vec3_dot(normal, a);
+        int face;
+        for (face = 0; face < num_faces; face++) {
+            if (vec3_dot(normals[face], normal) > 1 - 1e-5 && fabs(plane_distances[face] - distance) < 1e-4 * size) break;
+        }
+        if (face == num_faces) {
+            normals[num_faces] = normal;
+            plane_distances[num_faces++] = distance;
+        }
+        triangle_faces[t] = face;
+    }
+    // Gather the points of each face's triangles, each point once.
+    int *offsets = calloc(num_faces + 1, sizeof(int));
+    mem_check(offsets);
+    int *vertices = malloc(sizeof(int) * 3 * num_triangles);
+    mem_check(vertices);
+    int *point_faces = malloc(sizeof(int) * collider->num_points);
+    mem_check(point_faces);
+    for (int i = 0; i < collider->num_points; i++) point_faces[i] = -1;
+    int num_vertices = 0;
+    for (int face = 0; face < num_faces; face++) {
+        offsets[face] = num_vertices;
+        t = 0;
+        for (PolyhedronTriangle *triangle = hull.triangles.first; triangle != NULL; triangle = triangle->next, t++) {
+            if (triangle_faces[t] != face) continue;
+            for (int i = 0; i < 3; i++) {
+                int index = triangle->points[i]->print_mark;
+                if (point_faces[index] == face) continue;
+                point_faces[index] = face;
+                vertices[num_vertices++] = index;
             }
         }
     }
-    float inverse_volume = volume == 0 ? 0 : 1.0 / volume;
-    float element = dcubed * inverse_volume;
-    for (float x = min.vals[0]; x <= max.vals[0]; x += d) {
-        for (float y = min.vals[1]; y <= max.vals[1]; y += d) {
-            for (float z = min.vals[2]; z <= max.vals[2]; z += d) {
-                if (!point_in_convex_polyhedron(new_vec3(x,y,z), poly)) continue;
-                float xc = x - center.vals[0];
-                float yc = y - center.vals[1];
-                float zc = z - center.vals[2];
-                integrals[0] += xc*xc * dcubed;
-                integrals[1] += yc*yc * dcubed;
-                integrals[2] += zc*zc * dcubed;
-                integrals[3] += xc*yc * dcubed;
-                integrals[4] += xc*zc * dcubed;
-                integrals[5] += yc*zc * dcubed;
+    offsets[num_faces] = num_vertices;
+    free(point_faces);
+    free(triangle_faces);
+    free(plane_distances);
+    collider_set_faces(collider, num_faces, normals, offsets, vertices);
+}
+
+// Replace the points of a polyhedron collider with a new array of only the vertices of their convex hull. Points which are inside the hull can
+// never be support points, and duplicates (such as the shared vertices of a triangle mesh) make the hull algorithm fail, so neither is kept.
+// The faces of the hull are kept, and large colliders also get their hull adjacency here. If the points are flat they can't be hulled, and only the duplicates are removed.
+static void collider_reduce_points(Collider *collider)
+{
+    vec3 *points = collider->points;
+    int n = collider->num_points;
+    // Points closer than a small fraction of the size of the collider are welded together.
+    float size = 0;
+    for (int i = 1; i < n; i++) {
+        vec3 d = vec3_sub(points[i], points[0]);
+        size = MAX(size, vec3_dot(d, d));
+    }
+    float weld_distance = 1e-5 * sqrt(size);
+    vec3 *welded = malloc(sizeof(vec3) * n);
+    mem_check(welded);
+    int num_welded = 0;
+    for (int i = 0; i < n; i++) {
+        bool duplicate = false;
+        for (int j = 0; j < num_welded; j++) {
+            vec3 d = vec3_sub(points[i], welded[j]);
+            if (vec3_dot(d, d) <= weld_distance * weld_distance) {
+                duplicate = true;
+                break;
             }
         }
+        if (!duplicate) welded[num_welded++] = points[i];
     }
-    mat3x3 inertia_tensor;
-    fill_mat3x3_rmaj(inertia_tensor, integrals[1]+integrals[2], -integrals[3], -integrals[4],
-                                 -integrals[3], integrals[0]+integrals[2], -integrals[5],
-                                 -integrals[4], -integrals[5], integrals[0]+integrals[1]);
-    for (int i = 0; i < 9; i++) {
-        inertia_tensor.vals[i] *= inverse_volume * mass;
+    collider->points = welded;
+    collider->num_points = num_welded;
+    if (num_welded < 4) return;
+
+    Polyhedron hull = convex_hull(welded, num_welded);
+    // The hull of flat points is a polygon, whose boundary edges have only one triangle.
+    PolyhedronEdge *edge = hull.edges.first;
+    while (edge != NULL) {
+        if (edge->triangles[0] == NULL || edge->triangles[1] == NULL) {
+            polyhedron_destroy(&hull);
+            return;
+        }
+        edge = edge->next;
+    }
+    int num_hull_points = polyhedron_num_points(&hull);
+    if (num_hull_points < 4) {
+        polyhedron_destroy(&hull);
+        return;
+    }
+    vec3 *hull_points = malloc(sizeof(vec3) * num_hull_points);
+    mem_check(hull_points);
+    // Renumber the hull points in their order in the point array.
+    int *new_indices = malloc(sizeof(int) * num_welded);
+    mem_check(new_indices);
+    for (int i = 0; i < num_welded; i++) new_indices[i] = -1;
+    PolyhedronPoint *p = hull.points.first;
+    while (p != NULL) {
+        new_indices[p->print_mark] = 0;
+        p = p->next;
+    }
+    int num_kept = 0;
+    for (int i = 0; i < num_welded; i++) {
+        if (new_indices[i] < 0) continue;
+        new_indices[i] = num_kept;
+        hull_points[num_kept++] = welded[i];
+    }
+    p = hull.points.first;
+    while (p != NULL) {
+        p->print_mark = new_indices[p->print_mark];
+        p = p->next;
     }
-    return inertia_tensor;
+    free(new_indices);
+    free(welded);
+    collider->points = hull_points;
+    collider->num_points = num_hull_points;
+    collider_build_hull_faces(collider, hull);
+    if (num_hull_points > HILL_CLIMBING_MIN_POINTS) collider_build_hull_adjacency(collider, hull);
+    polyhedron_destroy(&hull);
 }
 
+// The compound collider whose children are being added, between begin_compound_collider and end_compound_collider.
+static Collider *current_compound = NULL;
 
-//================================================================================
-// Collider component. Colliders are all convex polyhedra.
-Collider *add_collider(Entity *e, vec3 *points, int num_points, bool can_rotate)
+// The analytic shapes set their parameters after this, then the collider is registered.
+static Collider *new_collider(Entity *e, vec3 *points, int num_points, ColliderShape shape, float margin)
 {
     if (num_points < 1) {
         fprintf(stderr, "ERROR: A collider must have at least one point.\n");
         exit(EXIT_FAILURE);
     }
-    Collider *collider = (Collider *) add_behaviour(e, NULL, sizeof(Collider), ColliderID)->data;
+    Collider *collider;
+    if (current_compound != NULL && current_compound->entity == e) {
+        if (current_compound->num_children == MAX_COMPOUND_CHILDREN) {
+            fprintf(stderr, "ERROR: A compound collider can have at most %d children.\n", MAX_COMPOUND_CHILDREN);
+            exit(EXIT_FAILURE);
+        }
+        collider = calloc(1, sizeof(Collider));
+        mem_check(collider);
+        collider->compound = current_compound;
+        current_compound->children[current_compound->num_children++] = collider;
+    } else {
+        collider = (Collider *) add_behaviour(e, NULL, sizeof(Collider), ColliderID)->data;
+        collider->compound = NULL;
+    }
+    collider->local_matrix = identity_mat4x4();
+    collider->children = NULL;
+    collider->num_children = 0;
+    collider->nodes = NULL;
+    collider->layer = CollisionLayerDefault;
+    collider->mask = COLLISION_LAYERS_ALL;
+    collider->motion = ColliderStatic;
+    collider->broadphase_proxy = -1;
+    collider->entity = e;
     collider->points = points;
     collider->num_points = num_points;
-    // Compute a bounding sphere by finding the maximum distance from the collider origin.
-    float d = 0;
-    for (int i = 0; i < num_points; i++) {
-        float new_d = vec3_dot(points[i], points[i]);
-        if (new_d > d) {
-            d = new_d;
+    collider->shape = shape;
+    collider->margin = margin;
+    collider->shape_center = vec3_zero();
+    collider->half_extents = vec3_zero();
+    collider->sides = 0;
+    // Only polyhedra are reduced to their hull and get hull adjacency, as the other shapes have direct support functions.
+    collider->hull_neighbour_offsets = NULL;
+    collider->hull_neighbours = NULL;
+    collider->hull_start = 0;
+    collider->num_faces = 0;
+    collider->face_normals = NULL;
+    collider->face_offsets = NULL;
+    collider->face_vertices = NULL;
+    if (shape == ColliderPolyhedron) collider_reduce_points(collider);
+    // Copy the points into the padded structure-of-arrays layout.
+    collider->num_padded_points = (collider->num_points + 3) & ~3;
+    collider->xs = malloc(sizeof(float) * 3 * collider->num_padded_points);
+    mem_check(collider->xs);
+    collider->ys = collider->xs + collider->num_padded_points;
+    collider->zs = collider->ys + collider->num_padded_points;
+    for (int i = 0; i < collider->num_padded_points; i++) {
+        vec3 p = collider->points[i < collider->num_points ? i : 0];
+        collider->xs[i] = X(p);
+        collider->ys[i] = Y(p);
+        collider->zs[i] = Z(p);
+    }
+    return collider;
+}
+
+// Compute the bounding volumes and add the collider to the broadphase. The children of compounds are added with their compound.
+static void register_collider(Collider *collider)
+{
+    vec3 c = collider->shape_center;
+    vec3 h = collider->half_extents;
+    collider->box_axes = identity_mat3x3();
+    collider->bounding_center = c;
+    collider->box_center = c;
+    switch (collider->shape) {
+    case ColliderSphere:
+        collider->bounding_radius = collider->margin;
+        collider->box_half_extents = new_vec3(collider->margin, collider->margin, collider->margin);
+        break;
+    case ColliderCapsule:
+        collider->bounding_radius = Y(h) + collider->margin;
+        collider->box_half_extents = new_vec3(collider->margin, Y(h) + collider->margin, collider->margin);
+        break;
+    case ColliderBox:
+        collider->bounding_radius = vec3_length(h);
+        collider->box_half_extents = h;
+        break;
+    case ColliderCylinder:
+        collider->bounding_radius = sqrt(X(h)*X(h) + Y(h)*Y(h));
+        collider->box_half_extents = h;
+        break;
+    default:
+        polytope_bounding_sphere(collider->points, collider->num_points, &collider->bounding_center, &collider->bounding_radius);
+        polytope_bounding_box(collider->points, collider->num_points, &collider->box_center, &collider->box_axes, &collider->box_half_extents);
+        break;
+    }
+    if (collider->compound == NULL) broadphase_add_collider(collider, collider->entity);
+}
+
+Collider *add_collider(Entity *e, vec3 *points, int num_points)
+{
+    Collider *collider = new_collider(e, points, num_points, ColliderPolyhedron, 0);
+    register_collider(collider);
+    return collider;
+}
+
+Collider *add_sphere_collider(Entity *e, vec3 center, float radius)
+{
+    vec3 *points = malloc(sizeof(vec3));
+    mem_check(points);
+    points[0] = center;
+    Collider *collider = new_collider(e, points, 1, ColliderSphere, radius);
+    collider->shape_center = center;
+    collider->half_extents = new_vec3(radius, 0, radius);
+    register_collider(collider);
+    return collider;
+}
+
+Collider *add_capsule_collider(Entity *e, vec3 center, float radius, float height)
+{
+    if (height < 2*radius) height = 2*radius; // Make sure the capsule is at least a sphere.
+    float half_length = height/2.0 - radius;
+    // The core segment goes from point 0 at the bottom to point 1 at the top.
+    vec3 *points = malloc(sizeof(vec3) * 2);
+    mem_check(points);
+    points[0] = vec3_add(center, new_vec3(0,-half_length,0));
+    points[1] = vec3_add(center, new_vec3(0,half_length,0));
+    Collider *collider = new_collider(e, points, 2, ColliderCapsule, radius);
+    collider->shape_center = center;
+    collider->half_extents = new_vec3(radius, half_length, radius);
+    register_collider(collider);
+    return collider;
+}
+
+Collider *add_box_collider(Entity *e, vec3 center, float width, float height, float depth)
+{
+    // Bits 0, 1 and 2 of the index of a corner are set if it is on the positive side in x, y and z.
+    vec3 half_extents = new_vec3(width/2.0, height/2.0, depth/2.0);
+    vec3 *points = malloc(sizeof(vec3) * 8);
+    mem_check(points);
+    for (int i = 0; i < 8; i++) {
+        for (int j = 0; j < 3; j++) {
+            points[i].vals[j] = center.vals[j] + ((i >> j) & 1 ? 1 : -1) * half_extents.vals[j];
+        }
+    }
+    Collider *collider = new_collider(e, points, 8, ColliderBox, 0);
+    collider->shape_center = center;
+    collider->half_extents = half_extents;
+    // Face 2j is on the negative side in axis j and face 2j + 1 on the positive side, with the four corners on that side.
+    vec3 *normals = malloc(sizeof(vec3) * 6);
+    mem_check(normals);
+    int *offsets = malloc(sizeof(int) * 7);
+    mem_check(offsets);
+    int *vertices = malloc(sizeof(int) * 24);
+    mem_check(vertices);
+    for (int i = 0; i < 6; i++) {
+        int axis = i / 2;
+        int side = i % 2;
+        normals[i] = vec3_zero();
+        normals[i].vals[axis] = side ? 1 : -1;
+        offsets[i] = 4*i;
+        int n = 0;
+        for (int j = 0; j < 8; j++) {
+            if (((j >> axis) & 1) == side) vertices[4*i + n++] = j;
+        }
+    }
+    offsets[6] = 24;
+    collider_set_faces(collider, 6, normals, offsets, vertices);
+    register_collider(collider);
+    return collider;
+}
+
+Collider *add_cylinder_collider(Entity *e, vec3 center, float radius, float height, int sides)
+{
+    if (sides < 3) sides = 3;
+    // The bottom ring is points 0 to sides - 1, and the top ring follows. Point j of a ring is at the angle 2pi j/sides around the axis,
+    // from the x axis toward the z axis, as in make_surface_of_revolution.
+    vec3 *points = malloc(sizeof(vec3) * 2*sides);
+    mem_check(points);
+    for (int i = 0; i < 2; i++) {
+        for (int j = 0; j < sides; j++) {
+            float theta = 2*M_PI * j * 1.0 / sides;
+            points[i*sides + j] = vec3_add(center, new_vec3(radius * cos(theta), (i == 0 ? -1 : 1) * height/2.0, radius * sin(theta)));
+        }
+    }
+    Collider *collider = new_collider(e, points, 2*sides, ColliderCylinder, 0);
+    collider->shape_center = center;
+    collider->half_extents = new_vec3(radius, height/2.0, radius);
+    collider->sides = sides;
+    // The faces are the bottom and top rings, then the side between points j and j + 1 of each ring.
+    vec3 *normals = malloc(sizeof(vec3) * (sides + 2));
+    mem_check(normals);
+    int *offsets = malloc(sizeof(int) * (sides + 3));
+    mem_check(offsets);
+    int *vertices = malloc(sizeof(int) * 6*sides);
+    mem_check(vertices);
+    for (int i = 0; i < 2; i++) {
+        normals[i] = new_vec3(0, i == 0 ? -1 : 1, 0);
+        offsets[i] = i*sides;
+        for (int j = 0; j < sides; j++) vertices[i*sides + j] = i*sides + j;
+    }
+    for (int j = 0; j < sides; j++) {
+        float theta = 2*M_PI * (j + 0.5) / sides;
+        normals[2 + j] = new_vec3(cos(theta), 0, sin(theta));
+        offsets[2 + j] = 2*sides + 4*j;
+        int *side = &vertices[2*sides + 4*j];
+        side[0] = j;
+        side[1] = (j + 1) % sides;
+        side[2] = sides + (j + 1) % sides;
+        side[3] = sides + j;
+    }
+    offsets[sides + 2] = 6*sides;
+    collider_set_faces(collider, sides + 2, normals, offsets, vertices);
+    register_collider(collider);
+    return collider;
+}
+
+Collider *begin_compound_collider(Entity *e)
+{
+    if (current_compound != NULL) {
+        fprintf(stderr, "ERROR: Compound colliders can not be nested.\n");
+        exit(EXIT_FAILURE);
+    }
+    Collider *compound = (Collider *) add_behaviour(e, NULL, sizeof(Collider), ColliderID)->data;
+    memset(compound, 0, sizeof(Collider));
+    compound->entity = e;
+    compound->shape = ColliderCompound;
+    compound->local_matrix = identity_mat4x4();
+    compound->layer = CollisionLayerDefault;
+    compound->mask = COLLISION_LAYERS_ALL;
+    compound->motion = ColliderStatic;
+    compound->broadphase_proxy = -1;
+    compound->children = malloc(sizeof(Collider *) * MAX_COMPOUND_CHILDREN);
+    mem_check(compound->children);
+    current_compound = compound;
+    return compound;
+}
+
+void set_collider_local_transform(Collider *child, vec3 position, vec3 euler_angles)
+{
+    if (child->compound == NULL || child->compound != current_compound) {
+        fprintf(stderr, "ERROR: Only the children of a compound collider which has not been ended can be given a local transform.\n");
+        exit(EXIT_FAILURE);
+    }
+    mat3x3 orientation = euler_rotation_mat3x3(X(euler_angles), Y(euler_angles), Z(euler_angles));
+    child->local_matrix = identity_mat4x4();
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) child->local_matrix.vals[4*i + j] = orientation.vals[3*i + j];
+        child->local_matrix.vals[4*3 + i] = position.vals[i];
+    }
+}
+
+// The box around a child in the space of its compound, from the child's oriented box.
+static void compound_child_box(Collider *child, float min[3], float max[3])
+{
+    vec3 center = rigid_matrix_vec3(child->local_matrix, child->box_center);
+    for (int i = 0; i < 3; i++) {
+        float extent = 0;
+        for (int k = 0; k < 3; k++) {
+            float axis_component = 0;
+            for (int j = 0; j < 3; j++) axis_component += child->local_matrix.vals[4*j + i] * child->box_axes.vals[3*k + j];
+            extent += ABS(axis_component) * child->box_half_extents.vals[k];
         }
+        min[i] = center.vals[i] - extent;
+        max[i] = center.vals[i] + extent;
+    }
+}
+
+// Build the hierarchy over the given children top-down, splitting them at the median of their box centers along the longest axis.
+// Returns the index of the subtree's root.
+static int build_compound_nodes(Collider *compound, int *indices, int n, float (*child_boxes)[6], int *num_nodes)
+{
+    int node_index = (*num_nodes)++;
+    CompoundNode *node = &compound->nodes[node_index];
+    for (int i = 0; i < 3; i++) {
+        node->min[i] = INFINITY;
+        node->max[i] = -INFINITY;
     }
-    collider->radius = sqrt(d);
-    // Compute an axis-aligned bounding box.
-    // If the entity can rotate, a non-optimal box is computed that still bounds the collider after rotations.
-    if (can_rotate) {
-        collider->use_aabb = false; // If both of these flags are false for bounds checks, just use the sphere test, as this is these AABBs are worse.
+    for (int k = 0; k < n; k++) {
         for (int i = 0; i < 3; i++) {
-            collider->aabb_min[i] = -collider->radius;
-            collider->aabb_max[i] = collider->radius;
+            node->min[i] = MIN(node->min[i], child_boxes[indices[k]][i]);
+            node->max[i] = MAX(node->max[i], child_boxes[indices[k]][3 + i]);
         }
-    } else {
-        collider->use_aabb = true;
-        float min_vals[3] = { UNPACK_VEC3(points[0]) };
-        float max_vals[3] = { UNPACK_VEC3(points[0]) };
-        for (int i = 1; i < num_points; i++) {
-            for (int j = 0; j < 3; j++) {
-                if (points[i].vals[j] < min_vals[j]) min_vals[j] = points[i].vals[j];
-                else if (points[i].vals[j] > max_vals[j]) max_vals[j] = points[i].vals[j];
-            }
+    }
+    if (n == 1) {
+        node->child = indices[0];
+        node->right = -1;
+        return node_index;
+    }
+    int axis = 0;
+    for (int i = 1; i < 3; i++) {
+        if (node->max[i] - node->min[i] > node->max[axis] - node->min[axis]) axis = i;
+    }
+    // Sort the children by their centers along the axis. There are few children, so an insertion sort is fine.
+    for (int k = 1; k < n; k++) {
+        int index = indices[k];
+        float center = child_boxes[index][axis] + child_boxes[index][3 + axis];
+        int j = k - 1;
+        while (j >= 0 && child_boxes[indices[j]][axis] + child_boxes[indices[j]][3 + axis] > center) {
+            indices[j + 1] = indices[j];
+            j--;
         }
-        memcpy(collider->aabb_min, min_vals, sizeof(float)*3);
-        memcpy(collider->aabb_max, max_vals, sizeof(float)*3);
+        indices[j + 1] = index;
     }
+    node->child = -1;
+    build_compound_nodes(compound, indices, n/2, child_boxes, num_nodes);
+    // The nodes are allocated for the whole tree up front, so node is still valid here.
+    node->right = build_compound_nodes(compound, indices + n/2, n - n/2, child_boxes, num_nodes);
+    return node_index;
+}
 
-    return collider;
+void end_compound_collider(Collider *compound)
+{
+    if (compound != current_compound) {
+        fprintf(stderr, "ERROR: end_compound_collider: This is not the compound collider being made.\n");
+        exit(EXIT_FAILURE);
+    }
+    current_compound = NULL;
+    int n = compound->num_children;
+    if (n == 0) {
+        fprintf(stderr, "ERROR: A compound collider must have at least one child.\n");
+        exit(EXIT_FAILURE);
+    }
+    float child_boxes[MAX_COMPOUND_CHILDREN][6];
+    int indices[MAX_COMPOUND_CHILDREN];
+    for (int i = 0; i < n; i++) {
+        compound_child_box(compound->children[i], child_boxes[i], child_boxes[i] + 3);
+        indices[i] = i;
+    }
+    compound->nodes = malloc(sizeof(CompoundNode) * (2*n - 1));
+    mem_check(compound->nodes);
+    int num_nodes = 0;
+    build_compound_nodes(compound, indices, n, child_boxes, &num_nodes);
+
+    // The compound is bounded by the box at the root of the hierarchy, and by a sphere around that box's center which contains
+    // the bounding sphere of every child.
+    CompoundNode *root = &compound->nodes[0];
+    compound->box_axes = identity_mat3x3();
+    compound->box_center = new_vec3(0.5*(root->min[0] + root->max[0]), 0.5*(root->min[1] + root->max[1]), 0.5*(root->min[2] + root->max[2]));
+    compound->box_half_extents = new_vec3(0.5*(root->max[0] - root->min[0]), 0.5*(root->max[1] - root->min[1]), 0.5*(root->max[2] - root->min[2]));
+    compound->bounding_center = compound->box_center;
+    compound->bounding_radius = 0;
+    for (int i = 0; i < n; i++) {
+        Collider *child = compound->children[i];
+        vec3 d = vec3_sub(rigid_matrix_vec3(child->local_matrix, child->bounding_center), compound->bounding_center);
+        compound->bounding_radius = MAX(compound->bounding_radius, vec3_length(d) + child->bounding_radius);
+    }
+    broadphase_add_collider(compound, compound->entity);
 }
 
-// Test the colliders with their basic bounding volumes.
-bool collider_bounding_test(Collider *A, Entity *A_entity, Collider *B, Entity *B_entity)
+bool colliders_can_collide(Collider *A, Collider *B)
+{
+    if (A->motion != ColliderDynamic && B->motion != ColliderDynamic) return false;
+    return (A->layer & B->mask) != 0 && (B->layer & A->mask) != 0;
+}
+
+void set_collider_filter(Collider *collider, uint32_t layer, uint32_t mask)
+{
+    collider->layer = layer;
+    collider->mask = mask;
+    if (collider->broadphase_proxy >= 0) broadphase_refilter_collider(collider);
+}
+
+void set_collider_motion(Collider *collider, ColliderMotion motion)
+{
+    collider->motion = motion;
+    if (collider->broadphase_proxy >= 0) broadphase_refilter_collider(collider);
+}
+
+// The matrix of a collider, given the matrix of its entity.
+static mat4x4 collider_matrix(Collider *collider, mat4x4 entity_matrix)
+{
+    if (collider->compound == NULL) return entity_matrix;
+    return mat4x4_multiply(entity_matrix, collider->local_matrix);
+}
+
+// The world-space box of the collider. The axes are scaled by the entity's scale, and half_extents are in model units.
+static void collider_world_box(Collider *collider, mat4x4 matrix, vec3 *center, vec3 axes[3])
+{
+    *center = rigid_matrix_vec3(matrix, collider->box_center);
+    for (int k = 0; k < 3; k++) {
+        for (int i = 0; i < 3; i++) {
+            axes[k].vals[i] = 0;
+            for (int j = 0; j < 3; j++) axes[k].vals[i] += matrix.vals[4*j + i] * collider->box_axes.vals[3*k + j];
+        }
+    }
+}
+
+// Test the colliders with their bounding volumes: first the bounding spheres, then the oriented boxes by the separating axis test.
+// The matrices are those of the colliders, with the given scales.
+static bool bounding_volumes_test(Collider *A, mat4x4 A_matrix, float A_scale, Collider *B, mat4x4 B_matrix, float B_scale)
 {
     // Bounding sphere test.
-    float r = A->radius*A_entity->scale + B->radius*B_entity->scale;
-    vec3 diff = vec3_sub(A_entity->position, B_entity->position);
+    float r = A->bounding_radius*A_scale + B->bounding_radius*B_scale;
+    vec3 diff = vec3_sub(rigid_matrix_vec3(A_matrix, A->bounding_center), rigid_matrix_vec3(B_matrix, B->bounding_center));
     if (vec3_dot(diff, diff) > r * r) return false;
-    if (A->use_aabb || B->use_aabb) {
-        for (int i = 0; i < 3; i++) {
-            if (A->aabb_min[i]*A_entity->scale + A_entity->position.vals[i] > B->aabb_max[i]*B_entity->scale + B_entity->position.vals[i]) return false;
-            if (A->aabb_max[i]*A_entity->scale + A_entity->position.vals[i] < B->aabb_min[i]*B_entity->scale + B_entity->position.vals[i]) return false;
+
+    // Oriented box test. The box axes are made unit length, and the half-extents scaled instead.
+    vec3 A_center, B_center, A_axes[3], B_axes[3];
+    collider_world_box(A, A_matrix, &A_center, A_axes);
+    collider_world_box(B, B_matrix, &B_center, B_axes);
+    vec3 a = vec3_mul(A->box_half_extents, A_scale);
+    vec3 b = vec3_mul(B->box_half_extents, B_scale);
+    for (int i = 0; i < 3; i++) {
+        A_axes[i] = vec3_mul(A_axes[i], 1.0 / A_scale);
+        B_axes[i] = vec3_mul(B_axes[i], 1.0 / B_scale);
+    }
+    // R expresses B's axes in A's frame, and t is the offset between the centers in A's frame.
+    // The absolute values are padded so that nearly parallel axes don't give a false separation along their cross product.
+    float R[3][3], abs_R[3][3];
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            R[i][j] = vec3_dot(A_axes[i], B_axes[j]);
+            abs_R[i][j] = ABS(R[i][j]) + 1e-5;
+        }
+    }
+    vec3 d = vec3_sub(B_center, A_center);
+    float t[3] = { vec3_dot(d, A_axes[0]), vec3_dot(d, A_axes[1]), vec3_dot(d, A_axes[2]) };
+    // The face axes of A and B.
+    for (int i = 0; i < 3; i++) {
+        float rb = b.vals[0]*abs_R[i][0] + b.vals[1]*abs_R[i][1] + b.vals[2]*abs_R[i][2];
+        if (ABS(t[i]) > a.vals[i] + rb) return false;
+    }
+    for (int j = 0; j < 3; j++) {
+        float ra = a.vals[0]*abs_R[0][j] + a.vals[1]*abs_R[1][j] + a.vals[2]*abs_R[2][j];
+        if (ABS(t[0]*R[0][j] + t[1]*R[1][j] + t[2]*R[2][j]) > ra + b.vals[j]) return false;
+    }
+    // The cross products of an axis of A and an axis of B.
+    for (int i = 0; i < 3; i++) {
+        int i1 = (i + 1) % 3, i2 = (i + 2) % 3;
+        for (int j = 0; j < 3; j++) {
+            int j1 = (j + 1) % 3, j2 = (j + 2) % 3;
+            float ra = a.vals[i1]*abs_R[i2][j] + a.vals[i2]*abs_R[i1][j];
+            float rb = b.vals[j1]*abs_R[i][j2] + b.vals[j2]*abs_R[i][j1];
+            if (ABS(t[i2]*R[i1][j] - t[i1]*R[i2][j]) > ra + rb) return false;
         }
     }
     return true;
 }
+static bool bounding_volumes_overlap(Collider *A, mat4x4 A_matrix, float A_scale, Collider *B, mat4x4 B_matrix, float B_scale)
+{
+    int64_t start = profile_clock();
+    bool overlap = bounding_volumes_test(A, A_matrix, A_scale, B, B_matrix, B_scale);
+    profile_add(&physics_profile.bounds_time, &physics_profile.num_bounds_tests, start);
+    return overlap;
+}
+
+bool collider_bounding_test(Collider *A, Entity *A_entity, Collider *B, Entity *B_entity)
+{
+    return bounding_volumes_overlap(A, collider_matrix(A, entity_matrix(A_entity)), A_entity->scale, B, collider_matrix(B, entity_matrix(B_entity)), B_entity->scale);
+}
+
+void collider_world_aabb(Collider *collider, Entity *e, float min[3], float max[3])
+{
+    mat4x4 matrix = collider_matrix(collider, entity_matrix(e));
+    // Transform the oriented box. The world-space half-extents are given by the absolute values of the axis components.
+    vec3 center, axes[3];
+    collider_world_box(collider, matrix, &center, axes);
+    // The box of the bounding sphere is also a bound, so take the intersection of the two.
+    vec3 sphere_center = rigid_matrix_vec3(matrix, collider->bounding_center);
+    float r = collider->bounding_radius * e->scale;
+    for (int i = 0; i < 3; i++) {
+        float extent = 0;
+        for (int k = 0; k < 3; k++) extent += ABS(axes[k].vals[i]) * collider->box_half_extents.vals[k];
+        min[i] = MAX(center.vals[i] - extent, sphere_center.vals[i] - r);
+        max[i] = MIN(center.vals[i] + extent, sphere_center.vals[i] + r);
+    }
+}
 
 //================================================================================
 // for testing and debugging.
@@ -163,470 +741,1924 @@ Polyhedron compute_minkowski_difference(Polyhedron A, Polyhedron B)
     whose negative is the separating vector, the minimal translation to move the CSO so that it does not
     bound the origin. This can be used to infer the contact normal and contact points on each polyhedron.
 ================================================================================*/
-static int support_index(vec3 *points, int num_points, mat4x4 matrix, vec3 direction)
+int collider_support_index(Collider *collider, vec3 direction, int start)
 {
-    //---Basic rearrangement can allow the avoidance of most matrix-vector multiplies here.
-    float d = vec3_dot(rigid_matrix_vec3(matrix, points[0]), direction); // At least one point must be given.
-    int index = 0;
-    for (int i = 1; i < num_points; i++) {
-        float new_d = vec3_dot(rigid_matrix_vec3(matrix, points[i]), direction);
+    float dx = X(direction);
+    float dy = Y(direction);
+    float dz = Z(direction);
+    switch (collider->shape) {
+    case ColliderSphere:
+        return 0;
+    case ColliderCapsule:
+        return dy > 0 ? 1 : 0;
+    case ColliderBox:
+        return (dx > 0 ? 1 : 0) | (dy > 0 ? 2 : 0) | (dz > 0 ? 4 : 0);
+    case ColliderCylinder: {
+        // The furthest point of a ring is the one whose angle is nearest to the angle of the direction around the axis.
+        int sides = collider->sides;
+        int j = (int) floor(atan2(dz, dx) * sides / (2*M_PI) + 0.5);
+        j = ((j % sides) + sides) % sides;
+        return dy > 0 ? sides + j : j;
+    }
+    case ColliderCompound:
+        fprintf(stderr, "ERROR: A compound collider has no support points of its own, so it must be queried through its children.\n");
+        exit(EXIT_FAILURE);
+    default:
+        break;
+    }
+    if (collider->hull_neighbours != NULL) {
+        // Walk to neighbours further in the direction until there are none. On a convex polyhedron, this local maximum is the global maximum.
+        int *offsets = collider->hull_neighbour_offsets;
+        int support = start;
+        if (support < 0 || offsets[support] == offsets[support + 1]) support = collider->hull_start;
+        float d = collider->xs[support]*dx + collider->ys[support]*dy + collider->zs[support]*dz;
+        bool climbing = true;
+        while (climbing) {
+            climbing = false;
+            for (int i = offsets[support]; i < offsets[support + 1]; i++) {
+                int neighbour = collider->hull_neighbours[i];
+                float new_d = collider->xs[neighbour]*dx + collider->ys[neighbour]*dy + collider->zs[neighbour]*dz;
+                if (new_d > d) {
+                    d = new_d;
+                    support = neighbour;
+                    climbing = true;
+                    break;
+                }
+            }
+        }
+        return support;
+    }
+#ifdef __SSE2__
+    // Keep the maximum dot product and its index in each of four lanes, then reduce across the lanes.
+    // Each lane only takes strictly greater values, so it keeps the lowest index of its maximum.
+    __m128 vdx = _mm_set1_ps(dx);
+    __m128 vdy = _mm_set1_ps(dy);
+    __m128 vdz = _mm_set1_ps(dz);
+    __m128 best = _mm_set1_ps(-INFINITY);
+    __m128i best_index = _mm_set1_epi32(0);
+    __m128i index = _mm_setr_epi32(0, 1, 2, 3);
+    __m128i four = _mm_set1_epi32(4);
+    for (int i = 0; i < collider->num_padded_points; i += 4) {
+        __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(&collider->xs[i]), vdx),
+                                         _mm_mul_ps(_mm_loadu_ps(&collider->ys[i]), vdy)),
+                                         _mm_mul_ps(_mm_loadu_ps(&collider->zs[i]), vdz));
+        __m128 greater = _mm_cmpgt_ps(d, best);
+        best = _mm_max_ps(d, best);
+        best_index = _mm_or_si128(_mm_and_si128(_mm_castps_si128(greater), index), _mm_andnot_si128(_mm_castps_si128(greater), best_index));
+        index = _mm_add_epi32(index, four);
+    }
+    float lane_best[4];
+    int lane_index[4];
+    _mm_storeu_ps(lane_best, best);
+    _mm_storeu_si128((__m128i *) lane_index, best_index);
+    float d = lane_best[0];
+    int support = lane_index[0];
+    for (int i = 1; i < 4; i++) {
+        if (lane_best[i] > d || (lane_best[i] == d && lane_index[i] < support)) {
+            d = lane_best[i];
+            support = lane_index[i];
+        }
+    }
+    return support;
+#else
+    float d = collider->xs[0]*dx + collider->ys[0]*dy + collider->zs[0]*dz; // At least one point must be given.
+    int support = 0;
+    for (int i = 1; i < collider->num_points; i++) {
+        float new_d = collider->xs[i]*dx + collider->ys[i]*dy + collider->zs[i]*dz;
         if (new_d > d) {
             d = new_d;
-            index = i;
+            support = i;
         }
     }
+    return support;
+#endif
+}
+void init_collision_cache(CollisionCache *cache)
+{
+    cache->A = NULL;
+    cache->B = NULL;
+    cache->support_A = -1;
+    cache->support_B = -1;
+    cache->simplex_n = 0;
+    cache->direction = new_vec3(1,1,1);
+}
+
+/*--------------------------------------------------------------------------------
+    Expanding polytope algorithm.
+    The polytope is a triangle mesh of points of the CSO, starting from the final GJK tetrahedron.
+    Each point is transformed into world space once, when it is found. The faces are kept in a min-heap
+    keyed by their distance from the origin, and each face knows the face across each of its edges, so
+    the horizon seen from a new point is found by walking from the closest face over the visible faces.
+    Faces which are removed are only marked as obsolete, and are skipped when they come off the heap.
+--------------------------------------------------------------------------------*/
+#define EPA_MAX_POINTS 128
+#define EPA_MAX_FACES 1024
+typedef struct EPAPoint_s {
+    vec3 position;
+    // The indices of the points of A and B whose difference is this point.
+    int A_index;
+    int B_index;
+} EPAPoint;
+typedef struct EPAFace_s {
+    // The points are in anti-clockwise winding order from outside. Edge i goes from point i to point i+1.
+    int points[3];
+    // The face across each edge, and the index of that edge in the adjacent face.
+    int adjacent[3];
+    int adjacent_edge[3];
+    vec3 normal;
+    float distance;
+    bool obsolete;
+} EPAFace;
+typedef struct EPAPolytope_s {
+    EPAPoint points[EPA_MAX_POINTS];
+    int num_points;
+    EPAFace faces[EPA_MAX_FACES];
+    int num_faces;
+    int heap[EPA_MAX_FACES];
+    int heap_len;
+    // The edges of the horizon, as faces which are not visible from the new point and the index of the edge in that face.
+    int horizon_faces[EPA_MAX_FACES];
+    int horizon_edges[EPA_MAX_FACES];
+    int horizon_len;
+} EPAPolytope;
+
+static void epa_heap_push(EPAPolytope *polytope, int face)
+{
+    int *heap = polytope->heap;
+    int i = polytope->heap_len ++;
+    while (i > 0 && polytope->faces[heap[(i - 1) / 2]].distance > polytope->faces[face].distance) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = face;
+}
+static int epa_heap_pop(EPAPolytope *polytope)
+{
+    int *heap = polytope->heap;
+    int top = heap[0];
+    int last = heap[-- polytope->heap_len];
+    int i = 0;
+    while (1) {
+        int child = 2*i + 1;
+        if (child >= polytope->heap_len) break;
+        if (child + 1 < polytope->heap_len && polytope->faces[heap[child + 1]].distance < polytope->faces[heap[child]].distance) child ++;
+        if (polytope->faces[heap[child]].distance >= polytope->faces[last].distance) break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+    return top;
+}
+
+// Returns the index of the new face, or -1 if there is no more space.
+static int epa_add_face(EPAPolytope *polytope, int a, int b, int c)
+{
+    if (polytope->num_faces == EPA_MAX_FACES) return -1;
+    int index = polytope->num_faces ++;
+    EPAFace *face = &polytope->faces[index];
+    face->points[0] = a;
+    face->points[1] = b;
+    face->points[2] = c;
+    face->obsolete = false;
+    vec3 pa = polytope->points[a].position;
+    vec3 pb = polytope->points[b].position;
+    vec3 pc = polytope->points[c].position;
+    vec3 normal = vec3_cross(vec3_sub(pb, pa), vec3_sub(pc, pa));
+    float length = sqrt(vec3_dot(normal, normal));
+    if (length <= 1e-12) {
+        // A degenerate face can't be expanded, so it goes to the back of the heap.
+        face->normal = vec3_zero();
+        face->distance = INFINITY;
+    } else {
+        face->normal = vec3_mul(normal, 1.0 / length);
+        face->distance = vec3_dot(face->normal, pa);
+    }
+    epa_heap_push(polytope, index);
     return index;
 }
-bool convex_hull_intersection(vec3 *A, int A_len, mat4x4 A_matrix, vec3 *B, int B_len, mat4x4 B_matrix, GJKManifold *manifold)
+static void epa_link_faces(EPAPolytope *polytope, int face_a, int edge_a, int face_b, int edge_b)
+{
+    polytope->faces[face_a].adjacent[edge_a] = face_b;
+    polytope->faces[face_a].adjacent_edge[edge_a] = edge_b;
+    polytope->faces[face_b].adjacent[edge_b] = face_a;
+    polytope->faces[face_b].adjacent_edge[edge_b] = edge_a;
+}
+
+// Entering a face over one of its edges, remove it if it is visible from the new point and carry on over its other two edges,
+// otherwise the edge is on the horizon. The horizon edges are found in order around the horizon.
+static void epa_find_horizon(EPAPolytope *polytope, int face_index, int edge, vec3 new_point)
+{
+    EPAFace *face = &polytope->faces[face_index];
+    if (face->obsolete) return;
+    if (vec3_dot(face->normal, new_point) - face->distance <= 0) {
+        polytope->horizon_faces[polytope->horizon_len] = face_index;
+        polytope->horizon_edges[polytope->horizon_len] = edge;
+        polytope->horizon_len ++;
+        return;
+    }
+    face->obsolete = true;
+    for (int i = 1; i <= 2; i++) {
+        int e = (edge + i) % 3;
+        epa_find_horizon(polytope, face->adjacent[e], face->adjacent_edge[e], new_point);
+    }
+}
+
+// The simplex must be a tetrahedron containing the origin. Returns false if the polytope is degenerate, or if it runs out of
+// space before converging, as the closest face found so far need not be the penetration.
+static bool expanding_polytope(Collider *A_collider, mat4x4 A_matrix, Collider *B_collider, mat4x4 B_matrix, int *support_A, int *support_B,
+                               vec3 simplex[], int indices_A[], int indices_B[], GJKManifold *manifold)
+{
+    vec3 *A = A_collider->points;
+    vec3 *B = B_collider->points;
+    EPAPolytope polytope;
+    polytope.num_points = 0;
+    polytope.num_faces = 0;
+    polytope.heap_len = 0;
+    float size = 0;
+    for (int i = 0; i < 4; i++) {
+        polytope.points[i].position = simplex[i];
+        polytope.points[i].A_index = indices_A[i];
+        polytope.points[i].B_index = indices_B[i];
+        if (vec3_dot(simplex[i], simplex[i]) > size) size = vec3_dot(simplex[i], simplex[i]);
+    }
+    polytope.num_points = 4;
+    if (tetrahedron_6_times_volume(simplex[0],simplex[1],simplex[2],simplex[3]) < 0) {
+        // If the tetrahedron has negative volume, swap two entries, forcing the winding order to be anti-clockwise from outside.
+        EPAPoint temp = polytope.points[0];
+        polytope.points[0] = polytope.points[1];
+        polytope.points[1] = temp;
+    }
+    epa_add_face(&polytope, 0,1,2);
+    epa_add_face(&polytope, 1,0,3);
+    epa_add_face(&polytope, 2,1,3);
+    epa_add_face(&polytope, 0,2,3);
+    epa_link_faces(&polytope, 0,0, 1,0);
+    epa_link_faces(&polytope, 0,1, 2,0);
+    epa_link_faces(&polytope, 0,2, 3,0);
+    epa_link_faces(&polytope, 1,1, 3,2);
+    epa_link_faces(&polytope, 1,2, 2,1);
+    epa_link_faces(&polytope, 2,2, 3,1);
+    // The tolerance accounts for rounding error, which is relative to the size of the points.
+    float tolerance = 1e-6 * sqrt(size);
+
+    EPAFace *closest;
+    while (1) {
+        int closest_index = epa_heap_pop(&polytope);
+        closest = &polytope.faces[closest_index];
+        if (closest->obsolete) continue;
+        if (closest->distance == INFINITY) return false;
+
+        // Find an extreme point in the direction of the face normal. If it is no further than the face, this face is on the boundary of the CSO.
+        int A_index = *support_A = collider_support_index(A_collider, rigid_matrix_transpose_vec3(A_matrix, closest->normal), *support_A);
+        int B_index = *support_B = collider_support_index(B_collider, vec3_neg(rigid_matrix_transpose_vec3(B_matrix, closest->normal)), *support_B);
+        vec3 new_point = vec3_sub(rigid_matrix_vec3(A_matrix, A[A_index]), rigid_matrix_vec3(B_matrix, B[B_index]));
+        if (vec3_dot(closest->normal, new_point) - closest->distance <= tolerance) break;
+        bool on_polytope = false;
+        for (int i = 0; i < polytope.num_points; i++) {
+            if (polytope.points[i].A_index == A_index && polytope.points[i].B_index == B_index) {
+                on_polytope = true;
+                break;
+            }
+        }
+        if (on_polytope) break;
+        if (polytope.num_points == EPA_MAX_POINTS) return false;
+        int new_point_index = polytope.num_points ++;
+        polytope.points[new_point_index].position = new_point;
+        polytope.points[new_point_index].A_index = A_index;
+        polytope.points[new_point_index].B_index = B_index;
+
+        // Remove the faces visible from the new point, and replace them with a cone from the horizon to the new point.
+        polytope.horizon_len = 0;
+        closest->obsolete = true;
+        for (int i = 0; i < 3; i++) {
+            epa_find_horizon(&polytope, closest->adjacent[i], closest->adjacent_edge[i], new_point);
+        }
+        if (polytope.num_faces + polytope.horizon_len > EPA_MAX_FACES) return false;
+        int first_face = polytope.num_faces;
+        for (int i = 0; i < polytope.horizon_len; i++) {
+            EPAFace *outside = &polytope.faces[polytope.horizon_faces[i]];
+            int edge = polytope.horizon_edges[i];
+            int face = epa_add_face(&polytope, outside->points[(edge + 1) % 3], outside->points[edge], new_point_index);
+            epa_link_faces(&polytope, face,0, polytope.horizon_faces[i],edge);
+            if (i > 0) epa_link_faces(&polytope, face - 1,1, face,2);
+        }
+        epa_link_faces(&polytope, polytope.num_faces - 1,1, first_face,2);
+    }
+
+    // The separating vector is the minimal translation B must make to separate from A.
+    manifold->separating_vector = vec3_mul(closest->normal, closest->distance);
+    // Compute the barycentric coordinates of the closest point in terms of the triangle on the boundary of the CSO.
+    // This triangle is the Minkowski difference between a triangle on A and a triangle on B. Use the same barycentric weights
+    // to calculate the corresponding points on the boundaries of A and B.
+    EPAPoint *a = &polytope.points[closest->points[0]];
+    EPAPoint *b = &polytope.points[closest->points[1]];
+    EPAPoint *c = &polytope.points[closest->points[2]];
+    vec3 barycentric_coords = point_to_triangle_plane_barycentric(a->position, b->position, c->position, vec3_zero());
+    manifold->A_closest = barycentric_triangle_v(rigid_matrix_vec3(A_matrix, A[a->A_index]),
+                                                 rigid_matrix_vec3(A_matrix, A[b->A_index]),
+                                                 rigid_matrix_vec3(A_matrix, A[c->A_index]), barycentric_coords);
+    manifold->B_closest = barycentric_triangle_v(rigid_matrix_vec3(B_matrix, B[a->B_index]),
+                                                 rigid_matrix_vec3(B_matrix, B[b->B_index]),
+                                                 rigid_matrix_vec3(B_matrix, B[c->B_index]), barycentric_coords);
+    return true;
+}
+
+// When the colliders are separated, the point c of the final GJK simplex closest to the origin is in the relative interior of the simplex.
+// The closest points on A and B are given by weighting the points of A and B which make up the simplex by the barycentric coordinates of c.
+static void simplex_closest_points(int n, vec3 simplex[], int indices_A[], int indices_B[], vec3 c,
+                                   Collider *A_collider, mat4x4 A_matrix, Collider *B_collider, mat4x4 B_matrix, GJKManifold *manifold)
+{
+    float weights[3] = {1, 0, 0};
+    if (n == 2) {
+        vec3 d = vec3_sub(simplex[1], simplex[0]);
+        float t = vec3_dot(d, d) == 0 ? 0 : vec3_dot(vec3_sub(c, simplex[0]), d) / vec3_dot(d, d);
+        weights[0] = 1 - t;
+        weights[1] = t;
+    } else if (n == 3) {
+        vec3 w = point_to_triangle_plane_barycentric(simplex[0], simplex[1], simplex[2], c);
+        // A degenerate triangle gives no coordinates, so fall back to its first point.
+        if (!isnan(w.vals[0]) && !isnan(w.vals[1]) && !isnan(w.vals[2])) {
+            for (int i = 0; i < 3; i++) weights[i] = w.vals[i];
+        }
+    }
+    manifold->separating_vector = c;
+    manifold->A_closest = vec3_zero();
+    manifold->B_closest = vec3_zero();
+    for (int i = 0; i < n; i++) {
+        manifold->A_closest = vec3_add(manifold->A_closest, vec3_mul(rigid_matrix_vec3(A_matrix, A_collider->points[indices_A[i]]), weights[i]));
+        manifold->B_closest = vec3_add(manifold->B_closest, vec3_mul(rigid_matrix_vec3(B_matrix, B_collider->points[indices_B[i]]), weights[i]));
+    }
+}
+
+// The GJK query behind convex_hull_intersection and convex_hull_distance. If find_penetration is false, EPA is not run when the
+// colliders intersect. The query stops as soon as the distance is known to be greater than max_distance.
+// Rounding error can keep the search from converging, so it gives up after GJK_MAX_ITERATIONS, and the query has failed. It also
+// fails if EPA can't find the penetration, because the polytope is degenerate or runs out of space. A failed query leaves the
+// manifold zeroed.
+#define GJK_MAX_ITERATIONS 2000
+typedef enum GJKResult_e {
+    GJKSeparated,
+    GJKIntersecting,
+    GJKFailed,
+} GJKResult;
+static GJKResult gjk_search(Collider *A_collider, mat4x4 A_matrix, Collider *B_collider, mat4x4 B_matrix, CollisionCache *cache,
+                       float max_distance, bool find_penetration, GJKManifold *manifold)
 {
 #define DEBUG 0 // Turn this flag on to visualize some things.
-    // Initialize the simplex as a line segment.
     vec3 simplex[4];
     int indices_A[4];
     int indices_B[4];
-    int n = 2;
+    int n = 0;
     // cso: Configuration space obstacle, another name for the Minkowski difference of two sets.
     // This macro gives the support vector in the Minkowski difference, and also gives the indices of the points in A and B whose difference is that support vector.
+    // The support point of a transformed collider is found by transforming the direction into model space once, by the transpose of the matrix.
+    vec3 *A = A_collider->points;
+    vec3 *B = B_collider->points;
+    // Each support query starts from the last support point found, which is kept in the cache between queries.
+    int no_cache[2] = {-1, -1};
+    int *support_A = &no_cache[0];
+    int *support_B = &no_cache[1];
+    bool swapped = false;
+    if (cache != NULL) {
+        if (!((cache->A == A_collider && cache->B == B_collider) || (cache->A == B_collider && cache->B == A_collider))) {
+            // The cache is new, or was being used for a different pair.
+            init_collision_cache(cache);
+            cache->A = A_collider;
+            cache->B = B_collider;
+        }
+        swapped = cache->A != A_collider;
+        support_A = swapped ? &cache->support_B : &cache->support_A;
+        support_B = swapped ? &cache->support_A : &cache->support_B;
+    }
     #define cso_support(DIRECTION,SUPPORT,INDEX_A,INDEX_B)\
     {\
-        ( INDEX_A ) = support_index(A, A_len, A_matrix, ( DIRECTION ));\
-        ( INDEX_B ) = support_index(B, B_len, B_matrix, vec3_neg(( DIRECTION )));\
+        ( INDEX_A ) = *support_A = collider_support_index(A_collider, rigid_matrix_transpose_vec3(A_matrix, ( DIRECTION )), *support_A);\
+        ( INDEX_B ) = *support_B = collider_support_index(B_collider, vec3_neg(rigid_matrix_transpose_vec3(B_matrix, ( DIRECTION ))), *support_B);\
         ( SUPPORT ) = vec3_sub(rigid_matrix_vec3(A_matrix, A[( INDEX_A )]), rigid_matrix_vec3(B_matrix, B[( INDEX_B )]));\
     }
-    cso_support(new_vec3(1,1,1), simplex[0], indices_A[0], indices_B[0]);
-    cso_support(vec3_neg(simplex[0]), simplex[1], indices_A[1], indices_B[1]);
     vec3 origin = vec3_zero();
+    // Save the final simplex and search direction for the next query of this pair. This is done before every return.
+    #define cache_simplex(DIRECTION)\
+    {\
+        if (cache != NULL) {\
+            cache->simplex_n = n;\
+            for (int i = 0; i < n; i++) {\
+                cache->simplex_A[i] = swapped ? indices_B[i] : indices_A[i];\
+                cache->simplex_B[i] = swapped ? indices_A[i] : indices_B[i];\
+            }\
+            cache->direction = swapped ? vec3_neg(( DIRECTION )) : ( DIRECTION );\
+        }\
+    }
+
+    // Warm-start from the simplex of the last query of this pair. The colliders have usually barely moved, so this is close to the final simplex.
+    vec3 start_direction = new_vec3(1,1,1);
+    if (cache != NULL && cache->simplex_n > 0) {
+        n = cache->simplex_n;
+        for (int i = 0; i < n; i++) {
+            indices_A[i] = swapped ? cache->simplex_B[i] : cache->simplex_A[i];
+            indices_B[i] = swapped ? cache->simplex_A[i] : cache->simplex_B[i];
+            simplex[i] = vec3_sub(rigid_matrix_vec3(A_matrix, A[indices_A[i]]), rigid_matrix_vec3(B_matrix, B[indices_B[i]]));
+        }
+        start_direction = swapped ? vec3_neg(cache->direction) : cache->direction;
+        // If the motion has made the simplex degenerate, restart from the last search direction instead.
+        bool degenerate;
+        if (n == 4) {
+            degenerate = ABS(tetrahedron_6_times_volume(simplex[0], simplex[1], simplex[2], simplex[3])) < 1e-9;
+        } else if (n == 3) {
+            vec3 normal = vec3_cross(vec3_sub(simplex[1], simplex[0]), vec3_sub(simplex[2], simplex[0]));
+            degenerate = vec3_dot(normal, normal) < 1e-12;
+        } else if (n == 2) {
+            vec3 d = vec3_sub(simplex[1], simplex[0]);
+            degenerate = vec3_dot(d, d) < 1e-12;
+        } else degenerate = false;
+        if (degenerate) n = 0;
+    }
+    if (n == 0) {
+        // Initialize the simplex as a line segment.
+        cso_support(start_direction, simplex[0], indices_A[0], indices_B[0]);
+        cso_support(vec3_neg(simplex[0]), simplex[1], indices_A[1], indices_B[1]);
+        n = 2;
+        // If the same point is found twice, it is the closest point, and the simplex is just that point.
+        if (indices_A[1] == indices_A[0] && indices_B[1] == indices_B[0]) n = 1;
+    }
 
     // Go into a loop, computing the closest point on the simplex and expanding it in the opposite direction (from the origin),
     // and removing simplex points to maintain n <= 4.
-    int COUNTER2 = 0;
-    while (1) {
-        if (++COUNTER2 == 2000) return false; /////////---preventing infinite loops before making this more robust. Infinite loops will probably happen anyway unless very careful, so prevent them.
+    // The distance to the closest point on the simplex decreases every iteration, unless rounding error is preventing progress.
+    float last_distance = -1;
+    for (int iteration = 0; ; iteration++) {
+        if (iteration == GJK_MAX_ITERATIONS) {
+            n = 0;
+            cache_simplex(start_direction);
+            memset(manifold, 0, sizeof(GJKManifold));
+            return GJKFailed;
+        }
         vec3 c = closest_point_on_simplex(n, simplex, origin);
         vec3 dir = vec3_neg(c);
+        // If the closest point is the origin up to rounding error, the origin is on the boundary of the simplex.
+        float simplex_size = 0;
+        for (int i = 0; i < n; i++) {
+            if (vec3_dot(simplex[i], simplex[i]) > simplex_size) simplex_size = vec3_dot(simplex[i], simplex[i]);
+        }
+        bool on_boundary = vec3_dot(c, c) <= 1e-12 * simplex_size;
 
         // If the simplex is a tetrahedron and contains the origin, the CSO contains the origin.
-        if (n == 4 && point_in_tetrahedron(simplex[0],simplex[1],simplex[2],simplex[3], origin)) {
+        if (n == 4 && (on_boundary || point_in_tetrahedron(simplex[0],simplex[1],simplex[2],simplex[3], origin))) {
+            if (!find_penetration) {
+                memset(manifold, 0, sizeof(GJKManifold));
+                cache_simplex(start_direction);
+                return GJKIntersecting;
+            }
 
             // Perform the expanding polytope algorithm.
-            // Instead of using a fancy data-structure, the polytope is maintained by keeping
-            // a pool. Entries can be nullified, and entries re-added in those empty spaces, but linear iterations still need to
-            // check up to *_len features. If the arrays are not long enough, then this fails.
-            int16_t points[1024 * 2] = {-1};
-            const int points_n = 2;
-            int points_len = 0;
-            int16_t triangles[1024 * 6] = {-1};
-            const int triangles_n = 6;
-            int triangles_len = 0;
-            int16_t edges[1024 * 2] = {-1};
-            const int edges_n = 2;
-            int edges_len = 0;
-
-            // For efficiency, features are added by this simple macro'd routine. e.g.,
-            //     int new_tri_index;
-            //     new_feature_index(triangles, new_tri_index);
-            // will get the index of an available triangle slot.
-            static const char *EPA_error_string = "ERROR: Expanding polytope algorithm: Fixed-length feature lists failed to be sufficient.\n";
-            #define new_feature_index(TYPE,INDEX)\
-            {\
-                bool found = false;\
-                for (int i = 0; i < TYPE ## _len; i++) {\
-                    if (TYPE [TYPE ## _n * i] == -1) {\
-                        ( INDEX ) = i;\
-                        found = true;\
-                        break;\
-                    }\
-                }\
-                if (!found) {\
-                    if (TYPE ## _len == 1024) {\
-                        fprintf(stderr, EPA_error_string);\
-                        exit(EXIT_FAILURE);\
-                    }\
-                    ( INDEX ) = TYPE ## _len ++;\
-                }\
-            }
-            // Point: References the indices of the points of A and B for which the difference is this point.
-            #define add_point(POINT_INDEX_A,POINT_INDEX_B,INDEX) {\
-                new_feature_index(points, ( INDEX ));\
-                points[points_n * ( INDEX )] = ( POINT_INDEX_A );\
-                points[points_n * ( INDEX ) + 1] = ( POINT_INDEX_B );\
-            }
-            // Edge: References its end points.
-            #define add_edge(AI,BI,INDEX) {\
-                new_feature_index(edges, ( INDEX ));\
-                edges[edges_n * ( INDEX )] = ( AI );\
-                edges[edges_n * ( INDEX ) + 1] = ( BI );\
-            }
-            // Triangle: References its points in anti-clockwise winding order, abc, and references its edges, ab, bc, ca.
-            #define add_triangle(AI,BI,CI) {\
-                int index;\
-                new_feature_index(triangles, index);\
-                triangles[triangles_n * index] = ( AI );\
-                triangles[triangles_n * index + 1] = ( BI );\
-                triangles[triangles_n * index + 2] = ( CI );\
-                add_edge(( AI ),( BI ),triangles[triangles_n * index + 3]);\
-                add_edge(( BI ),( CI ),triangles[triangles_n * index + 4]);\
-                add_edge(( CI ),( AI ),triangles[triangles_n * index + 5]);\
-            }
-            float v = tetrahedron_6_times_volume(simplex[0],simplex[1],simplex[2],simplex[3]);
-            if (v < 0) {
-                // If the tetrahedron has negative volume, swap two entries, forcing the winding order to be anti-clockwise from outside.
-                vec3 temp = simplex[0];
-                int tempA = indices_A[0];
-                int tempB = indices_B[0];
-                simplex[0] = simplex[1];
-                indices_A[0] = indices_A[1];
-                indices_B[0] = indices_B[1];
-                simplex[1] = temp;
-                indices_A[1] = tempA;
-                indices_B[1] = tempB;
+            int64_t epa_start = profile_clock();
+            bool found = expanding_polytope(A_collider, A_matrix, B_collider, B_matrix, support_A, support_B, simplex, indices_A, indices_B, manifold);
+            profile_add(&physics_profile.epa_time, &physics_profile.num_epa_queries, epa_start);
+            if (!found) {
+                n = 0;
+                cache_simplex(start_direction);
+                memset(manifold, 0, sizeof(GJKManifold));
+                return GJKFailed;
             }
-            //---since it is known that everything is empty, it would be more efficient to just hardcode the initial tetrahedron.
-            int dummy; // since the macro saves the index.
-            for (int i = 0; i < 4; i++) {
-                add_point(indices_A[i], indices_B[i], dummy);
-            }
-            add_triangle(0,1,2);
-            add_triangle(1,0,3);
-            add_triangle(2,1,3);
-            add_triangle(0,2,3);
-
-            // The initial tetrahedron has been set up. Proceed with EPA.
-	    int COUNTER = 0; // for debugging.
-            while (1) {
-                COUNTER ++;
-                if (COUNTER == 500) return false; //------///////////////Preventing an infinite loop.
-                // Find the closest triangle to the origin.
-                float min_d = -1;
-                int closest_triangle_index = -1;
-                vec3 closest_point;
-                for (int i = 0; i < triangles_len; i++) {
-                    if (triangles[triangles_n*i] == -1) continue;
-
-                    vec3 a = vec3_sub(rigid_matrix_vec3(A_matrix, A[points[points_n*triangles[triangles_n*i+0]]]), rigid_matrix_vec3(B_matrix, B[points[points_n*triangles[triangles_n*i+0] + 1]]));
-                    vec3 b = vec3_sub(rigid_matrix_vec3(A_matrix, A[points[points_n*triangles[triangles_n*i+1]]]), rigid_matrix_vec3(B_matrix, B[points[points_n*triangles[triangles_n*i+1] + 1]]));
-                    vec3 c = vec3_sub(rigid_matrix_vec3(A_matrix, A[points[points_n*triangles[triangles_n*i+2]]]), rigid_matrix_vec3(B_matrix, B[points[points_n*triangles[triangles_n*i+2] + 1]]));
-                    vec3 p = point_to_triangle_plane(a,b,c, origin);
-                    float new_d = vec3_dot(p, p);
-                    if (min_d == -1 || new_d < min_d) {
-                        min_d = new_d;
-                        closest_triangle_index = i;
-                        closest_point = p;
-                    }
-                }
-                vec3 a = vec3_sub(rigid_matrix_vec3(A_matrix, A[points[points_n*triangles[triangles_n*closest_triangle_index+0]]]), rigid_matrix_vec3(B_matrix, B[points[points_n*triangles[triangles_n*closest_triangle_index+0] + 1]]));
-                vec3 b = vec3_sub(rigid_matrix_vec3(A_matrix, A[points[points_n*triangles[triangles_n*closest_triangle_index+1]]]), rigid_matrix_vec3(B_matrix, B[points[points_n*triangles[triangles_n*closest_triangle_index+1] + 1]]));
-                vec3 c = vec3_sub(rigid_matrix_vec3(A_matrix, A[points[points_n*triangles[triangles_n*closest_triangle_index+2]]]), rigid_matrix_vec3(B_matrix, B[points[points_n*triangles[triangles_n*closest_triangle_index+2] + 1]]));
-
-                // Find an extreme point in the direction from the origin to the closest point on the polytope boundary.
-                // The convex hull of the points of the polytope adjoined with this new point will be computed.
-                // vec3 expand_to = vec3_cross(vec3_sub(b, a), vec3_sub(c, a));
-                vec3 expand_to = closest_point;
-                int new_point_A_index, new_point_B_index;
+            cache_simplex(manifold->separating_vector);
+            return GJKIntersecting;
+        }
+
+        if (on_boundary) {
+            // The origin is on a face of the simplex. Extend a triangle to a tetrahedron to find out which side the CSO is on, otherwise
+            // the polyhedra are only touching.
+            if (n == 3) {
+                vec3 normal = vec3_cross(vec3_sub(simplex[1], simplex[0]), vec3_sub(simplex[2], simplex[0]));
+                int A_index, B_index;
                 vec3 new_point;
-                cso_support(expand_to, new_point, new_point_A_index, new_point_B_index);
-                bool new_point_on_polytope = false;
-                for (int i = 0; i < points_len; i++) {
-                    // Unreferenced but non-nullified points can't be on the convex hull, so they can be checked against without problems.
-                    if (points[points_n*i] == -1) continue;
-                    if (points[points_n*i] == new_point_A_index && points[points_n*i+1] == new_point_B_index) {
-                        new_point_on_polytope = true;
-                        break;
-                    }
+                cso_support(normal, new_point, A_index, B_index);
+                if (vec3_dot(vec3_sub(new_point, simplex[0]), normal) <= 1e-6 * vec3_dot(normal, normal)) {
+                    cso_support(vec3_neg(normal), new_point, A_index, B_index);
                 }
-                if (new_point_on_polytope) {
-                    // The closest triangle is on the border of the polyhedron, so the closest point on this triangle is the closest point
-                    // to the border of the polyhedron.
-
-                    // The separating vector is the minimal translation B must make to separate from A.
-                    manifold->separating_vector = closest_point;
-
-                    // Compute the barycentric coordinates of the closest point in terms of the triangle on the boundary of the CSO.
-                    // This triangle is the Minkowski difference between a triangle on A and a triangle on B. Use the same barycentric weights
-                    // to calculate the corresponding points on the boundaries of A and B.
-                    //---need a better way to get these points.
-                    vec3 Aa = rigid_matrix_vec3(A_matrix, A[points[points_n*triangles[triangles_n*closest_triangle_index+0]]]);
-                    vec3 Ab = rigid_matrix_vec3(A_matrix, A[points[points_n*triangles[triangles_n*closest_triangle_index+1]]]);
-                    vec3 Ac = rigid_matrix_vec3(A_matrix, A[points[points_n*triangles[triangles_n*closest_triangle_index+2]]]);
-                    vec3 Ba = rigid_matrix_vec3(B_matrix, B[points[points_n*triangles[triangles_n*closest_triangle_index+0]+1]]);
-                    vec3 Bb = rigid_matrix_vec3(B_matrix, B[points[points_n*triangles[triangles_n*closest_triangle_index+1]+1]]);
-                    vec3 Bc = rigid_matrix_vec3(B_matrix, B[points[points_n*triangles[triangles_n*closest_triangle_index+2]+1]]);
-                    vec3 a = vec3_sub(Aa, Ba);
-                    vec3 b = vec3_sub(Ab, Bb);
-                    vec3 c = vec3_sub(Ac, Bc);
-                    vec3 barycentric_coords = point_to_triangle_plane_barycentric(a,b,c,  origin);
-                    manifold->A_closest = barycentric_triangle_v(Aa,Ab,Ac,  barycentric_coords);
-                    manifold->B_closest = barycentric_triangle_v(Ba,Bb,Bc,  barycentric_coords);
-                    return true;
+                if (ABS(vec3_dot(vec3_sub(new_point, simplex[0]), normal)) > 1e-6 * vec3_dot(normal, normal)) {
+                    simplex[3] = new_point;
+                    indices_A[3] = A_index;
+                    indices_B[3] = B_index;
+                    n = 4;
+                    continue;
                 }
+            }
+            simplex_closest_points(n, simplex, indices_A, indices_B, c, A_collider, A_matrix, B_collider, B_matrix, manifold);
+            cache_simplex(start_direction);
+            return GJKSeparated;
+        }
 
-                // Remove the visible triangles and their directed edges. Points do not need to be nullified.
-                for (int i = 0; i < triangles_len; i++) {
-                    if (triangles[triangles_n*i] == -1) continue;
-                    vec3 ap = vec3_sub(rigid_matrix_vec3(A_matrix, A[points[points_n*triangles[triangles_n*i+0]]]), rigid_matrix_vec3(B_matrix, B[points[points_n*triangles[triangles_n*i+0] + 1]]));
-                    vec3 bp = vec3_sub(rigid_matrix_vec3(A_matrix, A[points[points_n*triangles[triangles_n*i+1]]]), rigid_matrix_vec3(B_matrix, B[points[points_n*triangles[triangles_n*i+1] + 1]]));
-                    vec3 cp = vec3_sub(rigid_matrix_vec3(A_matrix, A[points[points_n*triangles[triangles_n*i+2]]]), rigid_matrix_vec3(B_matrix, B[points[points_n*triangles[triangles_n*i+2] + 1]]));
-
-                    vec3 n = vec3_cross(vec3_sub(bp, ap), vec3_sub(cp, ap));
-                    float v = tetrahedron_6_times_volume(ap,bp,cp, new_point);
-                    if (v < 0) {
-                        // Remove this triangle, as it is visible from the new point.
-                        edges[edges_n*triangles[triangles_n*i+3]] = -1;
-                        edges[edges_n*triangles[triangles_n*i+4]] = -1;
-                        edges[edges_n*triangles[triangles_n*i+5]] = -1;
-                        triangles[triangles_n*i] = -1;
-                    }
-                }
-                int new_point_index;
-                add_point(new_point_A_index, new_point_B_index, new_point_index);
-
-                // Search for boundary edges and save them in an array.
-                int boundary_len = 0;
-                int16_t boundary_edges[1024];
-                for (int i = 0; i < edges_len; i++) {
-                    if (edges[edges_n*i] == -1) continue;
-                    // Search for an incident triangle, by looking for the opposite edge (with reversed direction).
-                    bool boundary = true;
-                    for (int j = 0; j < edges_len; j++) {
-                        if (edges[edges_n*j] == -1) continue;
-                        if (   points[points_n*edges[edges_n*i]] == points[points_n*edges[edges_n*j+1]]
-                            && points[points_n*edges[edges_n*i]+1] == points[points_n*edges[edges_n*j+1]+1]
-                            && points[points_n*edges[edges_n*i+1]] == points[points_n*edges[edges_n*j]]
-                            && points[points_n*edges[edges_n*i+1]+1] == points[points_n*edges[edges_n*j]+1]) {
-                            // This is the opposite edge, so a boundary edge has not been found.
-                            boundary = false;
-                            break;
-                        }
-                    }
-                    if (boundary) {
-                        // Instead of adding the triangle straight away, save the boundary edge of the new triangle in the array.
-                        // This is because the edges are still being iterated, and if new ones are added, they could be registered as boundary edges.
-                        boundary_edges[2*boundary_len] = edges[edges_n*i+1];
-                        boundary_edges[2*boundary_len+1] = edges[edges_n*i];
-                        boundary_len ++; //--- not checking out-of-space.
-                    }
-                }
-                // Add the triangles of the extending cone.
-                for (int i = 0; i < boundary_len; i++) {
-                    add_triangle(boundary_edges[2*i], boundary_edges[2*i+1], new_point_index);
+        // The polyhedra are not intersecting so far. Reduce the simplex to the smallest face which contains the closest point.
+        // A point is not needed if the closest point on the rest of the simplex is the same.
+        for (int i = n - 1; i >= 0 && n > 1; --i) {
+            vec3 face[3];
+            int face_n = 0;
+            for (int j = 0; j < n; j++) {
+                if (j != i) face[face_n++] = simplex[j];
+            }
+            vec3 face_c = closest_point_on_simplex(face_n, face, origin);
+            vec3 d = vec3_sub(face_c, c);
+            if (vec3_dot(d, d) <= 1e-10 * simplex_size) {
+                for (int j = i; j < n - 1; j++) {
+                    simplex[j] = simplex[j + 1];
+                    indices_A[j] = indices_A[j + 1];
+                    indices_B[j] = indices_B[j + 1];
                 }
+                n--;
             }
-            fprintf(stderr, "ERROR: Code should not reach this.\n");
-            exit(EXIT_FAILURE);
+        }
+        if (n == 4) {
+            // Rounding error kept every point, so drop the one furthest from the origin.
+            int remove = simplex_extreme_index(n, simplex, c);
+            simplex[remove] = simplex[3];
+            indices_A[remove] = indices_A[3];
+            indices_B[remove] = indices_B[3];
+            n = 3;
         }
 
-        // The polyhedra are not intersecting. Descend the simplex and compute the closest point on the CSO.
+        if (last_distance != -1 && vec3_dot(c, c) >= last_distance) {
+            simplex_closest_points(n, simplex, indices_A, indices_B, c, A_collider, A_matrix, B_collider, B_matrix, manifold);
+            cache_simplex(dir);
+            return GJKSeparated;
+        }
+        last_distance = vec3_dot(c, c);
+
+        // Descend the simplex toward the origin.
         int A_index, B_index;
         vec3 new_point;
         cso_support(dir, new_point, A_index, B_index);
+        // If the new support point is no further in the search direction than the closest point on the simplex, then that is the closest point
+        // on the CSO (up to the tolerance), so the polyhedra are separated. This is also the case if the new point is already on the simplex.
+        // The tolerance accounts for rounding error, which is relative to the size of the points, which can be much larger than the distance.
+        // The CSO is on the far side of the plane through the new point orthogonal to the search direction, which bounds the distance from below.
+        if (-vec3_dot(new_point, dir) > max_distance * sqrt(vec3_dot(dir, dir))) {
+            simplex_closest_points(n, simplex, indices_A, indices_B, c, A_collider, A_matrix, B_collider, B_matrix, manifold);
+            cache_simplex(dir);
+            return GJKSeparated;
+        }
         bool on_simplex = false;
         for (int i = 0; i < n; i++) {
-            if (A_index == indices_A[i] && B_index == indices_B[i]) {
-                on_simplex = true;
-                break;
-            }
+            if (indices_A[i] == A_index && indices_B[i] == B_index) on_simplex = true;
         }
-        if (n == 4 && !on_simplex) {
-            int replace = simplex_extreme_index(n, simplex, c);
-            simplex[replace] = new_point;
-            indices_A[replace] = A_index;
-            indices_B[replace] = B_index;
-            ///////////////////////////////////////////////////////////////////////////////////////////////////////
-            //----This check seems to fix an infinite loop bug here, but I am not sure if the reasoning is correct.
-            ///////////////////////////////////////////////////////////////////////////////////////////////////////
-            if (vec3_dot(new_point, dir) <= 0) {
-                vec3 closest_on_poly = closest_point_on_tetrahedron_to_point(simplex[0], simplex[1], simplex[2], simplex[3], origin);
-                return false;
-            }
-        } else if (n == 3 && on_simplex) {
-            vec3 closest_on_poly = closest_point_on_triangle_to_point(simplex[0], simplex[1], simplex[2], origin);
-            return false;
-        } else if (n == 2 && on_simplex) {
-            vec3 closest_on_poly = closest_point_on_line_segment_to_point(simplex[0], simplex[1], origin);
-            return false;
-        } else if (n == 1 && on_simplex) {
-            return false;
-        } else if (!on_simplex) {
-            simplex[n] = new_point;
-            indices_A[n] = A_index;
-            indices_B[n] = B_index;
-            n++;
-        } else {
-            int remove = simplex_extreme_index(n, simplex, c);
-            for (int j = remove; j < n - 1; j++) {
-                simplex[j] = simplex[j + 1];
-                indices_A[j] = indices_A[j + 1];
-                indices_B[j] = indices_B[j + 1];
-            }
-            n--;
+        float size = MAX(simplex_size, vec3_dot(new_point, new_point));
+        if (on_simplex || vec3_dot(vec3_sub(new_point, c), dir) <= 1e-6 * vec3_dot(dir, dir) + 1e-5 * sqrt(vec3_dot(dir, dir) * size)) {
+            simplex_closest_points(n, simplex, indices_A, indices_B, c, A_collider, A_matrix, B_collider, B_matrix, manifold);
+            cache_simplex(dir);
+            return GJKSeparated;
         }
+        simplex[n] = new_point;
+        indices_A[n] = A_index;
+        indices_B[n] = B_index;
+        n++;
     }
 #undef DEBUG
 }
+static GJKResult gjk(Collider *A_collider, mat4x4 A_matrix, Collider *B_collider, mat4x4 B_matrix, CollisionCache *cache,
+                     float max_distance, bool find_penetration, GJKManifold *manifold)
+{
+    int64_t start = profile_clock();
+    GJKResult result = gjk_search(A_collider, A_matrix, B_collider, B_matrix, cache, max_distance, find_penetration, manifold);
+    profile_add(&physics_profile.gjk_time, &physics_profile.num_gjk_queries, start);
+    return result;
+}
 
-static void resolve_rigid_body_collisions(void)
+bool convex_hull_intersection(Collider *A, mat4x4 A_matrix, Collider *B, mat4x4 B_matrix, CollisionCache *cache, GJKManifold *manifold)
 {
-    for_behaviour(RigidBody, A, A_entity)
-        mat4x4 A_matrix = entity_matrix(A_entity);
-
-        // for_behaviour(RigidBody, B, B_entity)
-        for_behaviour(Collider, B, B_entity)
-            if (A_entity == B_entity) continue;
-            if (!collider_bounding_test(A->collider, A_entity, B, B_entity)) continue;
-
-            // If the bodies are colliding, manifold will contain contact information.
-            mat4x4 B_matrix = entity_matrix(B_entity);
-            GJKManifold manifold;
-            bool colliding = convex_hull_intersection(A->collider->points, A->collider->num_points, A_matrix,
-                                                      B->points, B->num_points, B_matrix, &manifold);
-            if (!colliding) continue;
-            // Try to find a rigidbody on the other entity. If there isn't one, the other collider is treated like an immovable rigidbody with infinite mass.
-            RigidBody B_rigid_body = {0};
-            bool found_rigid_body = false;
-            for (int i = 0; i < MAX_NUM_ENTITY_BEHAVIOURS; i++) {
-                if (B_entity->behaviours[i] != NULL && B_entity->behaviours[i]->type == RigidBodyID) {
-                    B_rigid_body = *((RigidBody *) B_entity->behaviours[i]->data); // Copy the rigid body over.
-                    found_rigid_body = true;
-                    break;
-                }
+    return gjk(A, A_matrix, B, B_matrix, cache, INFINITY, true, manifold) == GJKIntersecting;
+}
+
+float convex_hull_distance(Collider *A, mat4x4 A_matrix, Collider *B, mat4x4 B_matrix, CollisionCache *cache, float max_distance, GJKManifold *manifold)
+{
+    GJKResult result = gjk(A, A_matrix, B, B_matrix, cache, max_distance, false, manifold);
+    if (result == GJKFailed) return INFINITY;
+    if (result == GJKIntersecting) return 0;
+    return sqrt(vec3_dot(manifold->separating_vector, manifold->separating_vector));
+}
+
+/*--------------------------------------------------------------------------------
+    Collider queries.
+    Spheres and capsules are a core point or segment rounded by a margin, so their collisions are found from the closest points of
+    the cores. For pairs of spheres, capsules and boxes, the closest points of the cores are found in closed form, which covers the
+    player capsule against most of the world. Other pairs, and cores which intersect when there is no closed form for their penetration,
+    go through GJK on the core points, whose support points are still found directly for the analytic shapes.
+    Everything is computed in world space. Entity matrices have a uniform scale, which scales the margins.
+--------------------------------------------------------------------------------*/
+typedef enum CoreResult_e {
+    NoClosedForm,
+    CoresSeparated,
+    CoresIntersecting,
+} CoreResult;
+
+static float matrix_scale(mat4x4 matrix)
+{
+    return sqrt(matrix.vals[0]*matrix.vals[0] + matrix.vals[1]*matrix.vals[1] + matrix.vals[2]*matrix.vals[2]);
+}
+
+// Transform a direction by the rotation and scale of the matrix.
+static vec3 matrix_direction(mat4x4 matrix, vec3 v)
+{
+    return vec3_sub(rigid_matrix_vec3(matrix, v), translation_vector_rigid_mat4x4(matrix));
+}
+
+// Transform a world-space point into the model space of the matrix. The matrix is a rotation scaled by s, so its inverse is its transpose over s^2.
+static vec3 matrix_inverse_point(mat4x4 matrix, vec3 p)
+{
+    float scale = matrix_scale(matrix);
+    return vec3_mul(rigid_matrix_transpose_vec3(matrix, vec3_sub(p, translation_vector_rigid_mat4x4(matrix))), 1.0 / (scale*scale));
+}
+
+// Find the closest points of a segment (or a single point, if a == b) to a box. The box is given by its center, unit axes and half extents.
+// The squared distance from the box is convex along the segment, and is quadratic between the points where the segment crosses the planes
+// of the box's faces, so it is minimized in closed form on each of these pieces.
+static float segment_box_closest_points(vec3 a, vec3 b, vec3 center, vec3 axes[3], float half_extents[3], vec3 *segment_closest, vec3 *box_closest)
+{
+    float p[3], d[3];
+    for (int k = 0; k < 3; k++) {
+        p[k] = vec3_dot(vec3_sub(a, center), axes[k]);
+        d[k] = vec3_dot(vec3_sub(b, a), axes[k]);
+    }
+    float breaks[8];
+    int num_breaks = 0;
+    breaks[num_breaks++] = 0;
+    for (int k = 0; k < 3; k++) {
+        if (d[k] == 0) continue;
+        for (int side = -1; side <= 1; side += 2) {
+            float t = (side*half_extents[k] - p[k]) / d[k];
+            if (t > 0 && t < 1) breaks[num_breaks++] = t;
+        }
+    }
+    breaks[num_breaks++] = 1;
+    // Sort the few break points by insertion.
+    for (int i = 1; i < num_breaks; i++) {
+        for (int j = i; j > 0 && breaks[j] < breaks[j - 1]; j--) {
+            float temp = breaks[j];
+            breaks[j] = breaks[j - 1];
+            breaks[j - 1] = temp;
+        }
+    }
+    float best_t = 0;
+    float best_f = INFINITY;
+    for (int i = 0; i < num_breaks - 1; i++) {
+        // On this piece, each coordinate is either always inside its slab or always outside on one side. Those outside contribute (p + dt - bound)^2.
+        float t0 = breaks[i];
+        float t1 = breaks[i + 1];
+        float mid = 0.5 * (t0 + t1);
+        float offsets[3];
+        float sum_ad = 0;
+        float sum_dd = 0;
+        for (int k = 0; k < 3; k++) {
+            float x = p[k] + d[k]*mid;
+            offsets[k] = x > half_extents[k] ? p[k] - half_extents[k] : x < -half_extents[k] ? p[k] + half_extents[k] : NAN;
+            if (isnan(offsets[k])) continue;
+            sum_ad += offsets[k] * d[k];
+            sum_dd += d[k] * d[k];
+        }
+        float t = sum_dd > 0 ? MAX(t0, MIN(t1, -sum_ad / sum_dd)) : t0;
+        float f = 0;
+        for (int k = 0; k < 3; k++) {
+            if (!isnan(offsets[k])) f += (offsets[k] + d[k]*t) * (offsets[k] + d[k]*t);
+        }
+        if (f < best_f) {
+            best_f = f;
+            best_t = t;
+        }
+    }
+    *segment_closest = vec3_add(a, vec3_mul(vec3_sub(b, a), best_t));
+    *box_closest = center;
+    for (int k = 0; k < 3; k++) {
+        float x = MAX(-half_extents[k], MIN(half_extents[k], p[k] + d[k]*best_t));
+        *box_closest = vec3_add(*box_closest, vec3_mul(axes[k], x));
+    }
+    return best_f;
+}
+
+// The core of a sphere or capsule in world space, as a segment which is a single point for a sphere.
+static void world_core_segment(Collider *collider, mat4x4 matrix, vec3 *a, vec3 *b)
+{
+    *a = rigid_matrix_vec3(matrix, collider->points[0]);
+    *b = rigid_matrix_vec3(matrix, collider->points[collider->shape == ColliderCapsule ? 1 : 0]);
+}
+
+// Find the closest points of the cores of the colliders in closed form, if there is a closed form for the pair. If the cores intersect,
+// the deepest points are given, with the unit normal pointing from A into B and the penetration depth of the cores.
+static CoreResult core_closest_points(Collider *A, mat4x4 A_matrix, Collider *B, mat4x4 B_matrix, vec3 *A_core, vec3 *B_core, vec3 *normal, float *depth)
+{
+    if (A->shape > B->shape) {
+        CoreResult result = core_closest_points(B, B_matrix, A, A_matrix, B_core, A_core, normal, depth);
+        *normal = vec3_neg(*normal);
+        return result;
+    }
+    if (A->shape != ColliderSphere && A->shape != ColliderCapsule) return NoClosedForm;
+    vec3 a, b;
+    world_core_segment(A, A_matrix, &a, &b);
+    if (B->shape == ColliderSphere || B->shape == ColliderCapsule) {
+        vec3 c, d;
+        world_core_segment(B, B_matrix, &c, &d);
+        closest_points_on_line_segments(a, b, c, d, A_core, B_core);
+        vec3 diff = vec3_sub(*B_core, *A_core);
+        if (vec3_dot(diff, diff) > 0) return CoresSeparated;
+        // The cores cross, so any direction orthogonal to them will do. Push along the world up axis, or else across both segments.
+        *normal = vec3_cross(vec3_sub(b, a), vec3_sub(d, c));
+        if (vec3_dot(*normal, *normal) < 1e-12) *normal = new_vec3(0,1,0);
+        *normal = vec3_normalize(*normal);
+        *depth = 0;
+        return CoresIntersecting;
+    }
+    if (B->shape == ColliderBox) {
+        vec3 center = rigid_matrix_vec3(B_matrix, B->shape_center);
+        vec3 axes[3];
+        float half_extents[3];
+        float scale = matrix_scale(B_matrix);
+        for (int k = 0; k < 3; k++) {
+            axes[k] = vec3_normalize(new_vec3(B_matrix.vals[4*k + 0], B_matrix.vals[4*k + 1], B_matrix.vals[4*k + 2]));
+            half_extents[k] = B->half_extents.vals[k] * scale;
+        }
+        if (segment_box_closest_points(a, b, center, axes, half_extents, A_core, B_core) > 0) return CoresSeparated;
+        if (A->shape == ColliderCapsule) return NoClosedForm;
+        // The center of the sphere is inside the box. It leaves through the nearest face.
+        vec3 p = vec3_sub(a, center);
+        int nearest = 0;
+        float nearest_depth = INFINITY;
+        for (int k = 0; k < 3; k++) {
+            float face_depth = half_extents[k] - ABS(vec3_dot(p, axes[k]));
+            if (face_depth < nearest_depth) {
+                nearest_depth = face_depth;
+                nearest = k;
             }
-            if (!found_rigid_body) {
-                // Create a rigid body for this collider. This collider has infinite mass and is not moving.
-                B_rigid_body.collider = B;
+        }
+        float side = vec3_dot(p, axes[nearest]) < 0 ? -1 : 1;
+        // The box is pushed away from the sphere, against the face's outward normal.
+        *normal = vec3_mul(axes[nearest], -side);
+        *depth = nearest_depth;
+        *A_core = a;
+        *B_core = vec3_add(a, vec3_mul(axes[nearest], side * nearest_depth));
+        return CoresIntersecting;
+    }
+    return NoClosedForm;
+}
+
+// Fill the manifold from the closest points of the cores, rounded by the margins. Returns the signed distance, which is negative if the colliders intersect.
+static float rounded_manifold(CoreResult result, vec3 A_core, vec3 B_core, vec3 normal, float depth, float A_margin, float B_margin, GJKManifold *manifold)
+{
+    float distance;
+    if (result == CoresSeparated) {
+        vec3 diff = vec3_sub(B_core, A_core);
+        float core_distance = sqrt(vec3_dot(diff, diff));
+        normal = vec3_mul(diff, 1.0 / core_distance);
+        distance = core_distance - A_margin - B_margin;
+    } else {
+        distance = -depth - A_margin - B_margin;
+    }
+    // Either way, the normal points from A to B, and the points are the furthest points of the rounded colliders along it.
+    manifold->A_closest = vec3_add(A_core, vec3_mul(normal, A_margin));
+    manifold->B_closest = vec3_sub(B_core, vec3_mul(normal, B_margin));
+    manifold->separating_vector = vec3_sub(manifold->A_closest, manifold->B_closest);
+    return distance;
+}
+
+// GJK on the cores. Returns the signed distance of the rounded colliders, or INFINITY if GJK failed. If the distance is greater than
+// max_distance, the manifold is left with the closest points of the cores found so far.
+static float gjk_rounded(Collider *A, mat4x4 A_matrix, Collider *B, mat4x4 B_matrix, CollisionCache *cache, float A_margin, float B_margin,
+                         float max_distance, bool find_penetration, GJKManifold *manifold)
+{
+    vec3 normal = new_vec3(0,1,0);
+    GJKResult result = gjk(A, A_matrix, B, B_matrix, cache, max_distance + A_margin + B_margin, find_penetration, manifold);
+    if (result == GJKFailed) return INFINITY;
+    if (result == GJKIntersecting) {
+        float depth = sqrt(vec3_dot(manifold->separating_vector, manifold->separating_vector));
+        if (depth > 0) normal = vec3_mul(manifold->separating_vector, 1.0 / depth);
+        return rounded_manifold(CoresIntersecting, manifold->A_closest, manifold->B_closest, normal, depth, A_margin, B_margin, manifold);
+    }
+    float core_distance = sqrt(vec3_dot(manifold->separating_vector, manifold->separating_vector));
+    if (core_distance - A_margin - B_margin > max_distance) return core_distance - A_margin - B_margin;
+    // Cores which are only touching have no normal, so they are pushed apart along the world up axis.
+    return rounded_manifold(core_distance > 0 ? CoresSeparated : CoresIntersecting, manifold->A_closest, manifold->B_closest, normal, 0,
+                            A_margin, B_margin, manifold);
+}
+
+// Compound colliders are queried through the pairs of their children. The hierarchy of a compound is descended with the bounding
+// sphere of the other collider, and the pairs found are then tested with their bounding volumes.
+#define MAX_CONVEX_PAIRS 256
+
+// Find the children of the compound whose boxes come within the radius of a world-space point. Returns the number found.
+static int compound_children_near(Collider *compound, mat4x4 matrix, vec3 point, float radius, Collider **children)
+{
+    // Bring the sphere into the compound's model space. The matrix is a rotation scaled by s, so its inverse is its transpose over s^2.
+    float scale = matrix_scale(matrix);
+    vec3 p = vec3_mul(rigid_matrix_transpose_vec3(matrix, vec3_sub(point, translation_vector_rigid_mat4x4(matrix))), 1.0 / (scale*scale));
+    float r = radius / scale;
+    int num_found = 0;
+    int stack[MAX_COMPOUND_CHILDREN];
+    int stack_size = 0;
+    stack[stack_size++] = 0;
+    while (stack_size > 0) {
+        CompoundNode *node = &compound->nodes[stack[--stack_size]];
+        float d = 0;
+        for (int i = 0; i < 3; i++) {
+            float outside = MAX(node->min[i] - p.vals[i], p.vals[i] - node->max[i]);
+            if (outside > 0) d += outside * outside;
+        }
+        if (d > r * r) continue;
+        if (node->child >= 0) {
+            children[num_found++] = compound->children[node->child];
+            continue;
+        }
+        // The second child is pushed first, so the children are found in order.
+        stack[stack_size++] = node->right;
+        stack[stack_size++] = node - compound->nodes + 1;
+    }
+    return num_found;
+}
+
+// Find the pairs of convex colliders to query for a pair of colliders where either can be a compound, with bounds within max_distance
+// of each other. A collider which is not a compound is its own only child. The matrices are the entity matrices. Returns the number of
+// pairs, which are written to A_children and B_children.
+static int convex_pairs(Collider *A, mat4x4 A_matrix, Collider *B, mat4x4 B_matrix, float max_distance, Collider **A_children, Collider **B_children)
+{
+    float A_scale = matrix_scale(A_matrix);
+    float B_scale = matrix_scale(B_matrix);
+    Collider *As[MAX_COMPOUND_CHILDREN];
+    int num_As = 1;
+    As[0] = A;
+    if (A->shape == ColliderCompound) {
+        vec3 B_center = rigid_matrix_vec3(B_matrix, B->bounding_center);
+        num_As = compound_children_near(A, A_matrix, B_center, B->bounding_radius*B_scale + max_distance, As);
+    }
+    int num_pairs = 0;
+    for (int i = 0; i < num_As; i++) {
+        mat4x4 a_matrix = collider_matrix(As[i], A_matrix);
+        Collider *Bs[MAX_COMPOUND_CHILDREN];
+        int num_Bs = 1;
+        Bs[0] = B;
+        if (B->shape == ColliderCompound) {
+            vec3 a_center = rigid_matrix_vec3(a_matrix, As[i]->bounding_center);
+            num_Bs = compound_children_near(B, B_matrix, a_center, As[i]->bounding_radius*A_scale + max_distance, Bs);
+        }
+        for (int j = 0; j < num_Bs; j++) {
+            // The boxes are only a test for overlap, so they can't cull pairs for a distance query.
+            if (max_distance == 0 && !bounding_volumes_overlap(As[i], a_matrix, A_scale, Bs[j], collider_matrix(Bs[j], B_matrix), B_scale)) continue;
+            if (num_pairs == MAX_CONVEX_PAIRS) return num_pairs;
+            A_children[num_pairs] = As[i];
+            B_children[num_pairs++] = Bs[j];
+        }
+    }
+    return num_pairs;
+}
+
+static bool compound_intersection(Collider *A, mat4x4 A_matrix, Collider *B, mat4x4 B_matrix, GJKManifold *manifold)
+{
+    Collider *A_children[MAX_CONVEX_PAIRS];
+    Collider *B_children[MAX_CONVEX_PAIRS];
+    int num_pairs = convex_pairs(A, A_matrix, B, B_matrix, 0, A_children, B_children);
+    memset(manifold, 0, sizeof(GJKManifold));
+    bool intersecting = false;
+    float deepest = 0;
+    for (int i = 0; i < num_pairs; i++) {
+        GJKManifold child_manifold;
+        if (!collider_intersection(A_children[i], collider_matrix(A_children[i], A_matrix), B_children[i], collider_matrix(B_children[i], B_matrix),
+                                   NULL, &child_manifold)) continue;
+        float depth = vec3_dot(child_manifold.separating_vector, child_manifold.separating_vector);
+        if (!intersecting || depth > deepest) {
+            intersecting = true;
+            deepest = depth;
+            *manifold = child_manifold;
+        }
+    }
+    return intersecting;
+}
+
+static float compound_distance(Collider *A, mat4x4 A_matrix, Collider *B, mat4x4 B_matrix, float max_distance, GJKManifold *manifold)
+{
+    Collider *A_children[MAX_CONVEX_PAIRS];
+    Collider *B_children[MAX_CONVEX_PAIRS];
+    int num_pairs = convex_pairs(A, A_matrix, B, B_matrix, max_distance, A_children, B_children);
+    memset(manifold, 0, sizeof(GJKManifold));
+    float nearest = INFINITY;
+    for (int i = 0; i < num_pairs && nearest > 0; i++) {
+        GJKManifold child_manifold;
+        // Only a nearer child matters, so the later queries can stop early.
+        float distance = collider_distance(A_children[i], collider_matrix(A_children[i], A_matrix), B_children[i], collider_matrix(B_children[i], B_matrix),
+                                           NULL, MIN(max_distance, nearest), &child_manifold);
+        if (distance < nearest) {
+            nearest = distance;
+            *manifold = child_manifold;
+        }
+    }
+    return nearest;
+}
+
+bool collider_intersection(Collider *A, mat4x4 A_matrix, Collider *B, mat4x4 B_matrix, CollisionCache *cache, GJKManifold *manifold)
+{
+    if (A->shape == ColliderCompound || B->shape == ColliderCompound) return compound_intersection(A, A_matrix, B, B_matrix, manifold);
+    float A_margin = A->margin * matrix_scale(A_matrix);
+    float B_margin = B->margin * matrix_scale(B_matrix);
+    vec3 A_core, B_core, normal;
+    float depth;
+    CoreResult result = core_closest_points(A, A_matrix, B, B_matrix, &A_core, &B_core, &normal, &depth);
+    if (result != NoClosedForm) return rounded_manifold(result, A_core, B_core, normal, depth, A_margin, B_margin, manifold) < 0;
+    if (A_margin == 0 && B_margin == 0) return gjk(A, A_matrix, B, B_matrix, cache, INFINITY, true, manifold) == GJKIntersecting;
+    return gjk_rounded(A, A_matrix, B, B_matrix, cache, A_margin, B_margin, 0, true, manifold) < 0;
+}
+
+float collider_distance(Collider *A, mat4x4 A_matrix, Collider *B, mat4x4 B_matrix, CollisionCache *cache, float max_distance, GJKManifold *manifold)
+{
+    if (A->shape == ColliderCompound || B->shape == ColliderCompound) return compound_distance(A, A_matrix, B, B_matrix, max_distance, manifold);
+    float A_margin = A->margin * matrix_scale(A_matrix);
+    float B_margin = B->margin * matrix_scale(B_matrix);
+    vec3 A_core, B_core, normal;
+    float depth;
+    CoreResult result = core_closest_points(A, A_matrix, B, B_matrix, &A_core, &B_core, &normal, &depth);
+    if (result != NoClosedForm) return MAX(0, rounded_manifold(result, A_core, B_core, normal, depth, A_margin, B_margin, manifold));
+    if (A_margin == 0 && B_margin == 0) return convex_hull_distance(A, A_matrix, B, B_matrix, cache, max_distance, manifold);
+    return MAX(0, gjk_rounded(A, A_matrix, B, B_matrix, cache, A_margin, B_margin, max_distance, false, manifold));
+}
+
+/*--------------------------------------------------------------------------------
+    Contact manifolds.
+    A single deepest point does not hold a resting body still, as the body rocks about it. Instead, the features (faces, edges or
+    vertices) which the colliders touch with are found from their faces which best face the normal given by the query. The incident
+    feature is clipped against the sides of the reference feature, the face or edge with more points, and the clipped points below
+    the reference plane become the contact points, keeping at most four of them which span the largest area.
+    The points are kept in the model space of each collider. In the next step, the points are moved with the colliders and their
+    depths measured along the moved normal. While the colliders have not turned much relative to each other, no point has slid away
+    from its partner or separated by more than the breaking distance, and some point still penetrates, the manifold is kept and the
+    query is not repeated.
+--------------------------------------------------------------------------------*/
+#define CONTACT_BREAKING_DISTANCE 0.02
+#define CONTACT_NORMAL_COSINE 0.9995 // The colliders can turn by about 2 degrees relative to each other before the manifold is dropped.
+#define CONTACT_FACE_COSINE 0.97 // A face within about 14 degrees of the contact normal touches as a face.
+#define CONTACT_FEATURE_SLOPE 0.2 // Points this far below the furthest point, relative to their distance from it, are in its edge.
+#define MAX_FEATURE_POINTS 32
+typedef struct ContactCandidate_s {
+    vec3 A_point;
+    vec3 B_point;
+    float depth;
+} ContactCandidate;
+
+// The world-space points of the feature which a collider touches with, when it is pushed along the world direction, in order around
+// the direction. This is the face of the collider which best faces the direction if it is within the feature angle, otherwise it is
+// the points of that face nearly level with its furthest point, giving an edge or a vertex. Colliders without faces use all of their points.
+// Returns the number of points, which is 1 for a vertex, 2 for an edge and more for a face, and sets how well the feature faces the direction.
+static int collider_feature(Collider *collider, mat4x4 matrix, vec3 direction, vec3 *feature, float *alignment)
+{
+    vec3 d = vec3_normalize(rigid_matrix_transpose_vec3(matrix, direction));
+    int *indices;
+    int num_indices;
+    int all_indices[MAX_FEATURE_POINTS];
+    *alignment = 0;
+    if (collider->num_faces > 0) {
+        int best_face = 0;
+        for (int i = 1; i < collider->num_faces; i++) {
+            if (vec3_dot(collider->face_normals[i], d) > vec3_dot(collider->face_normals[best_face], d)) best_face = i;
+        }
+        indices = &collider->face_vertices[collider->face_offsets[best_face]];
+        num_indices = collider->face_offsets[best_face + 1] - collider->face_offsets[best_face];
+        *alignment = vec3_dot(collider->face_normals[best_face], d);
+        if (*alignment >= CONTACT_FACE_COSINE) {
+            int n = MIN(num_indices, MAX_FEATURE_POINTS);
+            for (int i = 0; i < n; i++) feature[i] = rigid_matrix_vec3(matrix, collider->points[indices[i]]);
+            return n;
+        }
+    } else {
+        num_indices = MIN(collider->num_points, MAX_FEATURE_POINTS);
+        for (int i = 0; i < num_indices; i++) all_indices[i] = i;
+        indices = all_indices;
+    }
+    int support = 0;
+    for (int i = 1; i < num_indices; i++) {
+        if (vec3_dot(collider->points[indices[i]], d) > vec3_dot(collider->points[indices[support]], d)) support = i;
+    }
+    vec3 support_point = collider->points[indices[support]];
+    int n = 0;
+    for (int i = 0; i < num_indices; i++) {
+        vec3 r = vec3_sub(support_point, collider->points[indices[i]]);
+        if (vec3_dot(r, d) <= CONTACT_FEATURE_SLOPE * vec3_length(r)) feature[n++] = rigid_matrix_vec3(matrix, collider->points[indices[i]]);
+    }
+    if (n <= 2 || collider->num_faces > 0) return n;
+    // Order the points of a flat collider by their angle around the centroid in the plane perpendicular to the direction.
+    vec3 centroid = vec3_zero();
+    for (int i = 0; i < n; i++) centroid = vec3_add(centroid, feature[i]);
+    centroid = vec3_mul(centroid, 1.0 / n);
+    vec3 u = vec3_cross(direction, fabs(X(direction)) < 0.5 ? new_vec3(1,0,0) : new_vec3(0,1,0));
+    vec3 v = vec3_cross(direction, u);
+    float angles[MAX_FEATURE_POINTS];
+    for (int i = 0; i < n; i++) {
+        vec3 r = vec3_sub(feature[i], centroid);
+        angles[i] = atan2(vec3_dot(r, v), vec3_dot(r, u));
+    }
+    for (int i = 1; i < n; i++) {
+        for (int j = i; j > 0 && angles[j - 1] > angles[j]; j--) {
+            float temp_angle = angles[j]; angles[j] = angles[j - 1]; angles[j - 1] = temp_angle;
+            vec3 temp_point = feature[j]; feature[j] = feature[j - 1]; feature[j - 1] = temp_point;
+        }
+    }
+    return n;
+}
+
+// Clip a polygon (or a segment, if it has two points) to the half-space dot(plane_normal, p - plane_point) <= 0. Returns the number of points kept.
+static int clip_polygon(vec3 *points, int n, vec3 plane_normal, vec3 plane_point, vec3 *clipped)
+{
+    int num_clipped = 0;
+    int num_edges = n > 2 ? n : n - 1;
+    for (int i = 0; i < num_edges; i++) {
+        vec3 a = points[i];
+        vec3 b = points[(i + 1) % n];
+        float da = vec3_dot(plane_normal, vec3_sub(a, plane_point));
+        float db = vec3_dot(plane_normal, vec3_sub(b, plane_point));
+        if (da <= 0) clipped[num_clipped++] = a;
+        if ((da < 0) != (db < 0) && da != db) clipped[num_clipped++] = vec3_lerp(a, b, da / (da - db));
+    }
+    // A segment also keeps its end point.
+    if (n == 2 && vec3_dot(plane_normal, vec3_sub(points[1], plane_point)) <= 0) clipped[num_clipped++] = points[1];
+    return num_clipped;
+}
+
+// Keep at most MAX_CONTACT_POINTS of the candidates: the deepest, the furthest from it, the one making the largest triangle with these,
+// and then the one furthest outside of that triangle.
+static int reduce_contact_candidates(ContactCandidate *candidates, int n, vec3 normal)
+{
+    if (n <= MAX_CONTACT_POINTS) return n;
+    int chosen[MAX_CONTACT_POINTS];
+    chosen[0] = 0;
+    for (int i = 1; i < n; i++) if (candidates[i].depth > candidates[chosen[0]].depth) chosen[0] = i;
+    vec3 p0 = candidates[chosen[0]].A_point;
+    float best = -1;
+    for (int i = 0; i < n; i++) {
+        vec3 r = vec3_sub(candidates[i].A_point, p0);
+        if (vec3_dot(r, r) > best) { best = vec3_dot(r, r); chosen[1] = i; }
+    }
+    vec3 p1 = candidates[chosen[1]].A_point;
+    best = 0;
+    chosen[2] = chosen[0];
+    for (int i = 0; i < n; i++) {
+        float area = vec3_dot(vec3_cross(vec3_sub(p1, p0), vec3_sub(candidates[i].A_point, p0)), normal);
+        if (fabs(area) > fabs(best)) { best = area; chosen[2] = i; }
+    }
+    if (chosen[2] == chosen[0]) return 0; // The candidates are collinear, which the features can not give.
+    // Orient the triangle anticlockwise around the normal, so that points outside of an edge have a negative area with it.
+    if (best < 0) { int temp = chosen[1]; chosen[1] = chosen[2]; chosen[2] = temp; }
+    vec3 triangle[3] = { candidates[chosen[0]].A_point, candidates[chosen[1]].A_point, candidates[chosen[2]].A_point };
+    best = 0;
+    chosen[3] = chosen[0];
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < 3; j++) {
+            float area = vec3_dot(vec3_cross(vec3_sub(triangle[(j + 1) % 3], triangle[j]), vec3_sub(candidates[i].A_point, triangle[j])), normal);
+            if (area < best) { best = area; chosen[3] = i; }
+        }
+    }
+    ContactCandidate kept[MAX_CONTACT_POINTS];
+    int num_kept = chosen[3] == chosen[0] ? 3 : 4;
+    for (int i = 0; i < num_kept; i++) kept[i] = candidates[chosen[i]];
+    memcpy(candidates, kept, sizeof(ContactCandidate) * num_kept);
+    return num_kept;
+}
+
+// Find the contact points of a pair of intersecting convex colliders, given the result of their intersection query. The impulses of the old
+// contact points are carried over to the new points close to them.
+static void generate_contact_manifold(CollisionPair *pair, mat4x4 A_matrix, mat4x4 B_matrix, GJKManifold *manifold)
+{
+    float depth = vec3_length(manifold->separating_vector);
+    // Colliders which are only touching have no normal, so they are pushed apart along the world up axis.
+    vec3 normal = depth == 0 ? new_vec3(0,-1,0) : vec3_mul(manifold->separating_vector, 1.0 / depth);
+    vec3 A_feature[MAX_FEATURE_POINTS];
+    vec3 B_feature[MAX_FEATURE_POINTS];
+    float A_alignment, B_alignment;
+    int A_n = collider_feature(pair->A, A_matrix, normal, A_feature, &A_alignment);
+    int B_n = collider_feature(pair->B, B_matrix, vec3_neg(normal), B_feature, &B_alignment);
+    float A_margin = pair->A->margin * matrix_scale(A_matrix);
+    float B_margin = pair->B->margin * matrix_scale(B_matrix);
+
+    ContactCandidate candidates[4*MAX_FEATURE_POINTS];
+    int num_candidates = 0;
+    if (A_n >= 2 && B_n >= 2) {
+        // The reference is the face, or the better aligned of two faces.
+        bool A_reference = A_n > 2 && B_n > 2 ? A_alignment >= B_alignment : A_n >= B_n;
+        vec3 *reference = A_reference ? A_feature : B_feature;
+        int reference_n = A_reference ? A_n : B_n;
+        float reference_margin = A_reference ? A_margin : B_margin;
+        float incident_margin = A_reference ? B_margin : A_margin;
+        // The reference normal points from the reference collider into the incident one. A face uses its own normal, if it is close.
+        vec3 reference_normal = A_reference ? normal : vec3_neg(normal);
+        if (reference_n > 2) {
+            vec3 face_normal = vec3_zero();
+            for (int i = 1; i < reference_n - 1; i++) {
+                face_normal = vec3_add(face_normal, vec3_cross(vec3_sub(reference[i], reference[0]), vec3_sub(reference[i + 1], reference[0])));
+            }
+            float length = vec3_length(face_normal);
+            if (length > 0) {
+                face_normal = vec3_mul(face_normal, 1.0 / length);
+                if (vec3_dot(face_normal, reference_normal) < 0) face_normal = vec3_neg(face_normal);
+                if (vec3_dot(face_normal, reference_normal) > 0.7) reference_normal = face_normal;
+            }
+        }
+        vec3 clipped[2][4*MAX_FEATURE_POINTS];
+        int num_clipped = A_reference ? B_n : A_n;
+        memcpy(clipped[0], A_reference ? B_feature : A_feature, sizeof(vec3) * num_clipped);
+        int current = 0;
+        if (reference_n == 2) {
+            // Clip to the planes through the ends of the reference edge.
+            vec3 edge = vec3_sub(reference[1], reference[0]);
+            num_clipped = clip_polygon(clipped[current], num_clipped, vec3_neg(edge), reference[0], clipped[1 - current]);
+            current = 1 - current;
+            num_clipped = clip_polygon(clipped[current], num_clipped, edge, reference[1], clipped[1 - current]);
+            current = 1 - current;
+        } else {
+            // Clip to the planes through the sides of the reference face.
+            vec3 centroid = vec3_zero();
+            for (int i = 0; i < reference_n; i++) centroid = vec3_add(centroid, reference[i]);
+            centroid = vec3_mul(centroid, 1.0 / reference_n);
+            for (int i = 0; i < reference_n && num_clipped > 0; i++) {
+                vec3 side = vec3_cross(vec3_sub(reference[(i + 1) % reference_n], reference[i]), reference_normal);
+                if (vec3_dot(side, vec3_sub(centroid, reference[i])) > 0) side = vec3_neg(side);
+                num_clipped = clip_polygon(clipped[current], num_clipped, side, reference[i], clipped[1 - current]);
+                current = 1 - current;
+            }
+        }
+        for (int i = 0; i < num_clipped; i++) {
+            vec3 p = clipped[current][i];
+            float height = vec3_dot(vec3_sub(reference[0], p), reference_normal);
+            float point_depth = height + reference_margin + incident_margin;
+            if (point_depth < -CONTACT_BREAKING_DISTANCE) continue;
+            vec3 reference_point = vec3_add(p, vec3_mul(reference_normal, height + reference_margin));
+            vec3 incident_point = vec3_sub(p, vec3_mul(reference_normal, incident_margin));
+            candidates[num_candidates].A_point = A_reference ? reference_point : incident_point;
+            candidates[num_candidates].B_point = A_reference ? incident_point : reference_point;
+            candidates[num_candidates++].depth = point_depth;
+        }
+        normal = A_reference ? reference_normal : vec3_neg(reference_normal);
+        num_candidates = reduce_contact_candidates(candidates, num_candidates, normal);
+        // The query gives the smallest penetration, so no point can be much deeper. If one is, the normal of a shallow
+        // query was too inexact to find the features by.
+        for (int i = 0; i < num_candidates; i++) {
+            if (candidates[i].depth > depth + CONTACT_BREAKING_DISTANCE) num_candidates = 0;
+        }
+    }
+    if (num_candidates == 0) {
+        // A vertex touches with a single point, which is the deepest point given by the query.
+        normal = depth == 0 ? new_vec3(0,-1,0) : vec3_mul(manifold->separating_vector, 1.0 / depth);
+        candidates[0].A_point = manifold->A_closest;
+        candidates[0].B_point = manifold->B_closest;
+        candidates[0].depth = depth;
+        num_candidates = 1;
+    }
+
+    ContactPoint old_points[MAX_CONTACT_POINTS];
+    int num_old_points = pair->num_contact_points;
+    memcpy(old_points, pair->contact_points, sizeof(ContactPoint) * num_old_points);
+    pair->contact_normal = normal;
+    pair->A_contact_normal = vec3_normalize(rigid_matrix_transpose_vec3(A_matrix, normal));
+    pair->B_contact_normal = vec3_normalize(rigid_matrix_transpose_vec3(B_matrix, normal));
+    pair->num_contact_points = num_candidates;
+    for (int i = 0; i < num_candidates; i++) {
+        ContactPoint *point = &pair->contact_points[i];
+        point->A_point = matrix_inverse_point(A_matrix, candidates[i].A_point);
+        point->B_point = matrix_inverse_point(B_matrix, candidates[i].B_point);
+        point->position = vec3_mul(vec3_add(candidates[i].A_point, candidates[i].B_point), 0.5);
+        point->depth = candidates[i].depth;
+        // Warm-start the point with the impulse of an old point which was in the same place.
+        point->normal_impulse = 0;
+        for (int j = 0; j < num_old_points; j++) {
+            vec3 r = vec3_sub(rigid_matrix_vec3(A_matrix, old_points[j].A_point), candidates[i].A_point);
+            if (vec3_dot(r, r) < CONTACT_BREAKING_DISTANCE * CONTACT_BREAKING_DISTANCE) {
+                point->normal_impulse = old_points[j].normal_impulse;
+                break;
             }
+        }
+    }
+}
 
-            // va,vb: The linear velocities of the rigid bodies.
-            vec3 va = vec3_mul(A->linear_momentum, A->inverse_mass);
-            vec3 vb = vec3_mul(B_rigid_body.linear_momentum, B_rigid_body.inverse_mass);
-            // Transform the inverse inertia tensors to world space via the rotation matrix and scale of this entity.
-            mat3x3 A_rotation_matrix = entity_orientation(A_entity);
-            mat3x3 A_worldspace_inverse_inertia_tensor = mat3x3_mul(mat3x3_multiply3(A_rotation_matrix, A->inverse_inertia_tensor, mat3x3_transpose(A_rotation_matrix)), A_entity->scale);
-            mat3x3 B_rotation_matrix = entity_orientation(B_entity);
-            mat3x3 B_worldspace_inverse_inertia_tensor = mat3x3_mul(mat3x3_multiply3(B_rotation_matrix, B_rigid_body.inverse_inertia_tensor, mat3x3_transpose(B_rotation_matrix)), B_entity->scale);
-
-            // wa,wb: The angular velocities of the rigid bodies.
-            vec3 wa = matrix_vec3(A_worldspace_inverse_inertia_tensor, A->angular_momentum);
-            vec3 wb = matrix_vec3(B_worldspace_inverse_inertia_tensor, B_rigid_body.angular_momentum);
-	    // Separate the objects.
-            vec3 p;
-            if (A->mass + B_rigid_body.mass == 0) {
-                // Two "immovable" objects are colliding. Just separate them in a simple way without taking masses into account.
-                //vec3 sep = vec3_mul(vec3_neg(manifold.separating_vector), 1.1); //
-                vec3 sep = vec3_neg(manifold.separating_vector);
-                A_entity->position = vec3_add(A_entity->position, sep);
-                p = vec3_add(manifold.A_closest, sep);
+// Move the contact points of a pair with the colliders. Returns whether the manifold can be kept, in which case the manifold is set to that
+// of the deepest point.
+static bool refresh_contact_manifold(CollisionPair *pair, mat4x4 A_matrix, mat4x4 B_matrix, GJKManifold *manifold)
+{
+    if (pair->num_contact_points == 0) return false;
+    // The points do not slide as the colliders turn about them, so the manifold is also dropped if they have turned too far.
+    vec3 normal = vec3_normalize(matrix_direction(A_matrix, pair->A_contact_normal));
+    if (vec3_dot(normal, vec3_normalize(matrix_direction(B_matrix, pair->B_contact_normal))) < CONTACT_NORMAL_COSINE) return false;
+    vec3 A_points[MAX_CONTACT_POINTS];
+    vec3 B_points[MAX_CONTACT_POINTS];
+    float depths[MAX_CONTACT_POINTS];
+    int deepest = 0;
+    for (int i = 0; i < pair->num_contact_points; i++) {
+        A_points[i] = rigid_matrix_vec3(A_matrix, pair->contact_points[i].A_point);
+        B_points[i] = rigid_matrix_vec3(B_matrix, pair->contact_points[i].B_point);
+        vec3 r = vec3_sub(A_points[i], B_points[i]);
+        depths[i] = vec3_dot(r, normal);
+        if (depths[i] < -CONTACT_BREAKING_DISTANCE) return false;
+        vec3 slide = vec3_sub(r, vec3_mul(normal, depths[i]));
+        if (vec3_dot(slide, slide) > CONTACT_BREAKING_DISTANCE * CONTACT_BREAKING_DISTANCE) return false;
+        if (depths[i] > depths[deepest]) deepest = i;
+    }
+    if (depths[deepest] <= 0) return false;
+    pair->contact_normal = normal;
+    for (int i = 0; i < pair->num_contact_points; i++) {
+        pair->contact_points[i].position = vec3_mul(vec3_add(A_points[i], B_points[i]), 0.5);
+        pair->contact_points[i].depth = depths[i];
+    }
+    manifold->separating_vector = vec3_mul(normal, depths[deepest]);
+    manifold->A_closest = A_points[deepest];
+    manifold->B_closest = B_points[deepest];
+    return true;
+}
+
+// Update the contact manifold of a pair of convex colliders. Returns whether they intersect, with the manifold of their deepest point.
+static bool update_contact_manifold(CollisionPair *pair, mat4x4 A_matrix, mat4x4 B_matrix, GJKManifold *manifold)
+{
+    if (refresh_contact_manifold(pair, A_matrix, B_matrix, manifold)) return true;
+    if (!collider_intersection(pair->A, A_matrix, pair->B, B_matrix, &pair->cache, manifold)) {
+        pair->num_contact_points = 0;
+        return false;
+    }
+    generate_contact_manifold(pair, A_matrix, B_matrix, manifold);
+    return true;
+}
+
+/*--------------------------------------------------------------------------------
+    The batched narrowphase.
+    The matrix of each entity in the batch is computed once and shared by all of its pairs. The pairs are then tested sorted by
+    their entities, so that consecutive tests (which are also handed to the same thread) reuse the same matrices and points.
+    Each test only writes to its own pair and results, so the results do not depend on the order or the number of threads.
+--------------------------------------------------------------------------------*/
+typedef struct BatchOrder_s {
+    int A_entity;
+    int B_entity;
+    int index;
+} BatchOrder;
+typedef struct IntersectionBatch_s {
+    CollisionPair **pairs;
+    BatchOrder *order;
+    GJKManifold *manifolds;
+    bool *hits;
+} IntersectionBatch;
+static mat4x4 *batch_matrices = NULL;   // Indexed by the entity's index in the entity list.
+static int *batch_matrix_stamps = NULL; // The batch in which each entity's matrix was last computed.
+static int batch_matrices_size = 0;
+static int batch_stamp = 0;
+static Entity **batch_entities = NULL;
+static BatchOrder *batch_order = NULL;
+static int batch_size = 0;
+
+// Run the narrowphase on the pairs of children of a pair with a compound collider. The child pairs of the last step which are still
+// near each other are kept, so that they keep their caches and contact points. Returns whether any of the children collide, with the manifold
+// of the deepest.
+static bool narrowphase_compound_pair(CollisionPair *pair, mat4x4 A_matrix, mat4x4 B_matrix, GJKManifold *manifold)
+{
+    Collider *A_children[MAX_CONVEX_PAIRS];
+    Collider *B_children[MAX_CONVEX_PAIRS];
+    int num_pairs = convex_pairs(pair->A, A_matrix, pair->B, B_matrix, 0, A_children, B_children);
+    // The child pairs found in this step are moved to the front of the list, and the ones left after them are dropped.
+    int num_found = 0;
+    bool colliding = false;
+    float deepest = 0;
+    for (int i = 0; i < num_pairs; i++) {
+        int k = num_found;
+        while (k < pair->num_child_pairs && !(pair->child_pairs[k].A == A_children[i] && pair->child_pairs[k].B == B_children[i])) k++;
+        if (k == pair->num_child_pairs) {
+            if (pair->num_child_pairs == pair->child_pairs_size) {
+                pair->child_pairs_size = pair->child_pairs_size == 0 ? 4 : 2*pair->child_pairs_size;
+                pair->child_pairs = realloc(pair->child_pairs, sizeof(CollisionPair) * pair->child_pairs_size);
+                mem_check(pair->child_pairs);
+            }
+            CollisionPair *new_pair = &pair->child_pairs[pair->num_child_pairs++];
+            memset(new_pair, 0, sizeof(CollisionPair));
+            new_pair->A = A_children[i];
+            new_pair->A_entity = pair->A_entity;
+            new_pair->B = B_children[i];
+            new_pair->B_entity = pair->B_entity;
+            init_collision_cache(&new_pair->cache);
+        }
+        CollisionPair temp = pair->child_pairs[k];
+        pair->child_pairs[k] = pair->child_pairs[num_found];
+        pair->child_pairs[num_found] = temp;
+        CollisionPair *child_pair = &pair->child_pairs[num_found++];
+        child_pair->colliding = update_contact_manifold(child_pair, collider_matrix(child_pair->A, A_matrix), collider_matrix(child_pair->B, B_matrix),
+                                                        &child_pair->manifold);
+        if (!child_pair->colliding) continue;
+        float depth = vec3_dot(child_pair->manifold.separating_vector, child_pair->manifold.separating_vector);
+        if (!colliding || depth > deepest) {
+            colliding = true;
+            deepest = depth;
+            *manifold = child_pair->manifold;
+        }
+    }
+    pair->num_child_pairs = num_found;
+    return colliding;
+}
+
+static int compare_batch_order(const void *a, const void *b)
+{
+    const BatchOrder *A = (const BatchOrder *) a;
+    const BatchOrder *B = (const BatchOrder *) b;
+    if (A->A_entity != B->A_entity) return A->A_entity - B->A_entity;
+    if (A->B_entity != B->B_entity) return A->B_entity - B->B_entity;
+    return A->index - B->index;
+}
+
+static void compute_batch_matrix(int index, void *data)
+{
+    Entity *e = batch_entities[index];
+    batch_matrices[e - entity_list] = entity_matrix(e);
+}
+
+static void batch_intersection(int index, void *data)
+{
+    IntersectionBatch *batch = (IntersectionBatch *) data;
+    int i = batch->order[index].index;
+    CollisionPair *pair = batch->pairs[i];
+    GJKManifold *manifold = &batch->manifolds[i];
+    bool *hit = &batch->hits[i];
+    *hit = false;
+    memset(manifold, 0, sizeof(GJKManifold));
+    if (colliders_can_collide(pair->A, pair->B)) {
+        mat4x4 A_matrix = batch_matrices[batch->order[index].A_entity];
+        mat4x4 B_matrix = batch_matrices[batch->order[index].B_entity];
+        if (bounding_volumes_overlap(pair->A, collider_matrix(pair->A, A_matrix), pair->A_entity->scale,
+                                     pair->B, collider_matrix(pair->B, B_matrix), pair->B_entity->scale)) {
+            if (pair->A->shape == ColliderCompound || pair->B->shape == ColliderCompound) {
+                *hit = narrowphase_compound_pair(pair, A_matrix, B_matrix, manifold);
             } else {
-                float inv_total_mass =  1.0 / (A->mass + B_rigid_body.mass);
-                float a_weighting = A->mass * inv_total_mass;
-                float b_weighting = B_rigid_body.mass * inv_total_mass;
-                vec3 a_sep = vec3_mul(manifold.separating_vector, -a_weighting);
-                vec3 b_sep = vec3_mul(manifold.separating_vector, b_weighting);
-                A_entity->position = vec3_add(A_entity->position, a_sep);
-                B_entity->position = vec3_add(B_entity->position, b_sep);
-                p = vec3_add(manifold.A_closest, a_sep);
+                *hit = update_contact_manifold(pair, A_matrix, B_matrix, manifold);
             }
+        }
+    }
+    if (!*hit) pair->num_contact_points = 0;
+}
 
-            // n: The normalized direction of separation.
-            vec3 n = vec3_normalize(manifold.separating_vector);
-            // a_pos,b_pos: The relative positions of the point of contact from A and B.
-            vec3 a_pos = vec3_sub(p, A_entity->position);
-            vec3 b_pos = vec3_sub(p, B_entity->position);
-            // dpa,dpb: The linear velocities at the points of contact.
-            vec3 dpa = vec3_add(va, vec3_cross(wa, a_pos));
-            vec3 dpb = vec3_add(vb, vec3_cross(wb, b_pos));
-            // relative_velocity: If the point of contact of A were hitting B in a frame where B is still, then this is A's velocity.
-            //                    This is needed to calculate the force required for "bouncing A off of B".
-            vec3 relative_velocity = vec3_sub(dpa, dpb);
-            if (vec3_dot(relative_velocity, n) > 0) {
-                // Colliding contact.
-
-                // Separate the objects.
-                // Move each object away from each other along the separating vector, taking into account the relative momentums at the points of contact.
-                // Calculate the linear momentums at the points of contact.
-                /*
-                vec3 momentum_pa = vec3_add(A->linear_momentum, vec3_cross(a_pos, A->angular_momentum));
-                vec3 momentum_pb = vec3_add(B->linear_momentum, vec3_cross(b_pos, B->angular_momentum));
-                float dpan = vec3_dot(dpa, n);
-                float dpbn = vec3_dot(dpb, n);
-                float momentum_pan = vec3_dot(momentum_pa, n);
-                float momentum_pbn = vec3_dot(momentum_pb, n);
-                if (momentum_pan - momentum_pbn < 0.001) {
-                    Transform_move(t, vec3_mul(vec3_neg(manifold.separating_vector), 1.1)); //---Offset because resting contact crashes. Seriously need to work on robustness.
-                } else {
-                    float a_sep = momentum_pan / (momentum_pan - momentum_pbn);
-                    float b_sep = momentum_pbn / (momentum_pan - momentum_pbn);
-                    Transform_move(t, vec3_mul(manifold.separating_vector, -a_sep * 1.1));
-                    Transform_move(t2, vec3_mul(manifold.separating_vector, b_sep * 1.1));
-                }*/
-
-
-                float coefficient_of_restitution = 0;
-                vec3 rel_A = a_pos;
-                vec3 rel_B = b_pos;
-                vec3 kA = vec3_cross(rel_A, n);
-                vec3 kB = vec3_cross(rel_B, n);
-                vec3 uA = matrix_vec3(A_worldspace_inverse_inertia_tensor, kA);
-                vec3 uB = matrix_vec3(B_worldspace_inverse_inertia_tensor, kB);
-                float impulse_magnitude = -(1 + coefficient_of_restitution) * (vec3_dot(n, vec3_sub(va, vb)) + vec3_dot(wa, kA) - vec3_dot(wb, kB))
-                                          / (A->inverse_mass + B_rigid_body.inverse_mass + vec3_dot(kA, uA) + vec3_dot(kB, uB));
-                vec3 impulse = vec3_mul(n, impulse_magnitude);
-                A->linear_momentum = vec3_add(A->linear_momentum, impulse);
-                B_rigid_body.linear_momentum = vec3_sub(B_rigid_body.linear_momentum, impulse);
-                A->angular_momentum = vec3_add(A->angular_momentum, vec3_mul(kA, impulse_magnitude));
-                B_rigid_body.angular_momentum = vec3_sub(B_rigid_body.angular_momentum, vec3_mul(kB, impulse_magnitude));
-
-/*
-                    float coefficient_of_restitution = 0.5;
-                    float numerator = -(1 + coefficient_of_restitution) * (vec3_dot(relative_velocity, n) + vec3_dot(wa, vec3_cross(a_pos, n)) - vec3_dot(wb, vec3_cross(b_pos, n)));
-                    float denominator = A->inverse_mass + B->inverse_mass + vec3_dot(vec3_cross(a_pos, n), matrix_vec3(A_worldspace_inverse_inertia_tensor, vec3_cross(a_pos, n)))
-                                                                          + vec3_dot(vec3_cross(b_pos, n), matrix_vec3(B_worldspace_inverse_inertia_tensor, vec3_cross(b_pos, n)));
-                    if (denominator == 0) {
-                        fprintf(stderr, ERROR_ALERT "Denominator in calculation of impulse magnitude between rigid bodies should never be zero.\n");
-                        exit(EXIT_FAILURE);
-                    }
-                    float impulse_magnitude = numerator / denominator;
-                    //printf("impulse_magnitude: %.6f\n", impulse_magnitude);
-                    //printf("A mass: %.6f\n", A->mass);
-                    //printf("B mass: %.6f\n", B->mass);
-                    //printf("A inertia tensor:\n");
-                    //print_matrix3x3f(&A->inertia_tensor);
-                    //printf("A inverse inertia tensor:\n");
-                    //print_matrix3x3f(&A->inverse_inertia_tensor);
-                    //printf("B inertia tensor:\n");
-                    //print_matrix3x3f(&B->inertia_tensor);
-                    //printf("B inverse inertia tensor:\n");
-                    //print_matrix3x3f(&B->inverse_inertia_tensor);
-                    //getchar();
-                    vec3 impulse_force = vec3_mul(n, impulse_magnitude);
-                    A->linear_momentum = vec3_add(A->linear_momentum, impulse_force);
-                    B->linear_momentum = vec3_sub(B->linear_momentum, impulse_force);
-                    A->angular_momentum = vec3_add(A->angular_momentum, vec3_mul(vec3_cross(a_pos, n), impulse_magnitude));
-                    B->angular_momentum = vec3_sub(B->angular_momentum, vec3_mul(vec3_cross(b_pos, n), impulse_magnitude));
-*/
+void collider_intersection_batch(CollisionPair **pairs, int n, GJKManifold *manifolds, bool *hits)
+{
+    if (entity_list_length > batch_matrices_size) {
+        batch_matrices_size = entity_list_size;
+        batch_matrices = realloc(batch_matrices, sizeof(mat4x4) * batch_matrices_size);
+        mem_check(batch_matrices);
+        batch_matrix_stamps = realloc(batch_matrix_stamps, sizeof(int) * batch_matrices_size);
+        mem_check(batch_matrix_stamps);
+        batch_entities = realloc(batch_entities, sizeof(Entity *) * batch_matrices_size);
+        mem_check(batch_entities);
+        // Invalidate every entity's matrix.
+        memset(batch_matrix_stamps, 0, sizeof(int) * batch_matrices_size);
+        batch_stamp = 0;
+    }
+    if (n > batch_size) {
+        batch_size = n;
+        batch_order = realloc(batch_order, sizeof(BatchOrder) * batch_size);
+        mem_check(batch_order);
+    }
+    // Gather the entities of the batch, and compute their matrices.
+    batch_stamp ++;
+    int num_entities = 0;
+    for (int i = 0; i < n; i++) {
+        Entity *entities[2] = { pairs[i]->A_entity, pairs[i]->B_entity };
+        for (int j = 0; j < 2; j++) {
+            int index = entities[j] - entity_list;
+            if (batch_matrix_stamps[index] != batch_stamp) {
+                batch_matrix_stamps[index] = batch_stamp;
+                batch_entities[num_entities++] = entities[j];
             }
-        end_for_behaviour()
+        }
+        batch_order[i] = (BatchOrder) { pairs[i]->A_entity - entity_list, pairs[i]->B_entity - entity_list, i };
+    }
+    parallel_for(num_entities, compute_batch_matrix, NULL);
+    qsort(batch_order, n, sizeof(BatchOrder), compare_batch_order);
+
+    IntersectionBatch batch = { pairs, batch_order, manifolds, hits };
+    parallel_for(n, batch_intersection, &batch);
+}
+
+// Find the rigid body which is simulating this collider, if there is one.
+static RigidBody *collider_rigid_body(Collider *collider, Entity *e)
+{
+    for (int i = 0; i < MAX_NUM_ENTITY_BEHAVIOURS; i++) {
+        if (e->behaviours[i] != NULL && e->behaviours[i]->type == RigidBodyID) {
+            RigidBody *rb = (RigidBody *) e->behaviours[i]->data;
+            if (rb->collider == collider) return rb;
+        }
+    }
+    return NULL;
+}
+
+// The inertia tensor is for the unscaled collider, so the inertia of the scaled body is larger by the square of the scale.
+static mat3x3 rigid_body_world_inverse_inertia_tensor(RigidBody *rb, Entity *e)
+{
+    mat3x3 rotation_matrix = entity_orientation(e);
+    return mat3x3_mul(mat3x3_multiply3(rotation_matrix, rb->inverse_inertia_tensor, mat3x3_transpose(rotation_matrix)), 1.0 / (e->scale * e->scale));
+}
+
+// The physics runs in fixed steps of 1/physics_rate seconds, whatever the frame rate is.
+float physics_rate = 60;
+int max_physics_substeps = 4;
+static float physics_time_step = 1.0 / 60;
+static float physics_accumulator = 0;
+
+/*--------------------------------------------------------------------------------
+    Sleeping and simulation islands.
+    The rigid bodies in contact during a physics step are joined into islands by a union-find over the bodies.
+    When every body of an island has been moving slower than the thresholds for long enough, the whole island falls
+    asleep, and its bodies remember the island they fell asleep in. A sleeping body is woken when an awake body or a moving
+    static collider touches it, and this wakes its whole island.
+    The thresholds allow for the small velocities of resting contact, which is resolved by an impulse every step.
+--------------------------------------------------------------------------------*/
+#define SLEEP_LINEAR_VELOCITY 0.4
+#define SLEEP_ANGULAR_VELOCITY 0.6
+#define SLEEP_TIME 1.0
+static int *island_parents = NULL;
+static float *island_still_times = NULL;
+static int island_parents_size = 0;
+static int num_sleeping_islands = 0;
+
+static int find_island(int index)
+{
+    while (island_parents[index] != index) {
+        // Path halving.
+        island_parents[index] = island_parents[island_parents[index]];
+        index = island_parents[index];
+    }
+    return index;
+}
+static void join_islands(RigidBody *A, RigidBody *B)
+{
+    // Immovable bodies do not join islands, otherwise everything resting on them would be one island.
+    if (A->mass == 0 || B->mass == 0) return;
+    island_parents[find_island(A->index)] = find_island(B->index);
+}
+
+void rigid_body_wake(RigidBody *rb)
+{
+    if (!rb->asleep) {
+        rb->still_time = 0;
+        return;
+    }
+    BehaviourList *list = &behaviour_lists[RigidBodyID];
+    for (int i = 0; i < list->length; i++) {
+        RigidBody *other = (RigidBody *) list->list[i].data;
+        if (other->asleep && other->island == rb->island) {
+            other->asleep = false;
+            other->still_time = 0;
+        }
+    }
+}
+
+static void update_sleeping(void)
+{
+    // Find the time the least still body of each island has been still for, at its root.
+    for (int i = 0; i < island_parents_size; i++) island_still_times[i] = SLEEP_TIME;
+    // Immovable bodies never sleep, as they can be moved from outside of the physics step, and they are in islands of their own.
+    for_behaviour(RigidBody, rb, e)
+        if (rb->asleep || rb->mass == 0) continue;
+        mat3x3 worldspace_inverse_inertia_tensor = rigid_body_world_inverse_inertia_tensor(rb, e);
+        vec3 velocity = vec3_mul(rb->linear_momentum, rb->inverse_mass);
+        vec3 angular_velocity = matrix_vec3(worldspace_inverse_inertia_tensor, rb->angular_momentum);
+        if (vec3_dot(velocity, velocity) < SLEEP_LINEAR_VELOCITY*SLEEP_LINEAR_VELOCITY
+                && vec3_dot(angular_velocity, angular_velocity) < SLEEP_ANGULAR_VELOCITY*SLEEP_ANGULAR_VELOCITY) {
+            rb->still_time += physics_time_step;
+        } else {
+            rb->still_time = 0;
+        }
+        int root = find_island(rb->index);
+        island_still_times[root] = MIN(island_still_times[root], rb->still_time);
     end_for_behaviour()
+    // Put the islands which have been still for long enough to sleep.
+    BehaviourList *list = &behaviour_lists[RigidBodyID];
+    for (int i = 0; i < list->length; i++) {
+        RigidBody *rb = (RigidBody *) list->list[i].data;
+        if (rb->asleep || rb->mass == 0) continue;
+        int root = find_island(rb->index);
+        if (island_still_times[root] < SLEEP_TIME) continue;
+        rb->asleep = true;
+        rb->island = num_sleeping_islands + root;
+        rb->linear_momentum = vec3_zero();
+        rb->angular_momentum = vec3_zero();
+    }
+    // Island numbers are given from a running count, so that islands which fall asleep in different steps are different.
+    num_sleeping_islands += island_parents_size;
+}
+
+/*--------------------------------------------------------------------------------
+    Contact solver.
+    The contacts found in a physics step are gathered into constraints, which are then solved together by sequential impulses.
+    There is a constraint for each point of each pair's contact manifold. Each constraint keeps the impulse accumulated over the
+    iterations, which is clamped so that contacts only push. The accumulated impulse is kept in the contact point, and is applied at
+    the start of the next step, so that resting contact converges over a few steps. Penetration is removed by a bias velocity
+    (Baumgarte stabilization) rather than by moving the bodies. A point which has separated lets the bodies approach until it touches.
+
+    The solver works on the velocities of the bodies, which are kept in an array indexed by the rigid body index, with one
+    extra immovable body at the end for static colliders. The contacts are grouped by island, and the islands share no movable
+    bodies, so each island is solved on its own, in parallel. The constraints of an island are put into batches of four which
+    share no movable bodies, laid out as structures of arrays, so that the four constraints of a batch can be solved at once.
+    Immovable bodies are shared between islands, so the solver never writes to them.
+--------------------------------------------------------------------------------*/
+#define CONTACT_SOLVER_ITERATIONS 10
+#define CONTACT_BIAS_FACTOR 0.2
+#define CONTACT_PENETRATION_SLOP 0.01
+typedef struct SolverBody_s {
+    vec3 velocity;
+    vec3 angular_velocity;
+    float inverse_mass;
+    mat3x3 inverse_inertia_tensor; // In world space.
+    bool prepared;
+} SolverBody;
+typedef struct Contact_s {
+    ContactPoint *point;
+    vec3 normal; // From A into B.
+    int A;
+    int B;
+    Entity *A_entity;
+    Entity *B_entity;
+    int island; // The movable body, until the contacts are grouped, and then the solver island.
+} Contact;
+typedef struct ContactBatch_s {
+    int num_contacts;
+    int A[4];
+    int B[4];
+    ContactPoint *points[4];
+    // The contact normal points from B to A.
+    float normal[3][4];
+    // The cross products of the contact point, relative to each body, with the normal, and the change in angular velocity per unit impulse.
+    float angular_A[3][4];
+    float angular_B[3][4];
+    float inertia_A[3][4];
+    float inertia_B[3][4];
+    float inverse_mass_A[4];
+    float inverse_mass_B[4];
+    float effective_mass[4];
+    float bias[4];
+    float impulse[4];
+} ContactBatch;
+typedef struct SolverIsland_s {
+    // The contacts of the island are contiguous in the sorted contact list. An island has at most one batch per contact,
+    // so its batches are given the same range of the batch array.
+    int first_contact;
+    int num_contacts;
+    int num_batches;
+    int first_open_batch;
+} SolverIsland;
+static SolverBody *solver_bodies = NULL;
+static int *body_solver_islands = NULL; // Parallel to solver_bodies, the solver island of each island root.
+static SolverIsland *solver_islands = NULL;
+static int solver_bodies_size = 0;
+static int num_solver_bodies = 0;
+static int num_solver_islands = 0;
+static Contact *contacts = NULL;
+static int *sorted_contacts = NULL; // The contact indices, sorted by island.
+static ContactBatch *contact_batches = NULL;
+static int contacts_size = 0;
+static int num_contacts = 0;
+
+static void prepare_solver_bodies(int num_bodies)
+{
+    if (num_bodies + 1 > solver_bodies_size) {
+        solver_bodies_size = num_bodies + 1;
+        solver_bodies = realloc(solver_bodies, sizeof(SolverBody) * solver_bodies_size);
+        mem_check(solver_bodies);
+        body_solver_islands = realloc(body_solver_islands, sizeof(int) * solver_bodies_size);
+        mem_check(body_solver_islands);
+        solver_islands = realloc(solver_islands, sizeof(SolverIsland) * solver_bodies_size);
+        mem_check(solver_islands);
+    }
+    for (int i = 0; i < num_bodies; i++) solver_bodies[i].prepared = false;
+    // The immovable body for static colliders.
+    memset(&solver_bodies[num_bodies], 0, sizeof(SolverBody));
+    num_solver_bodies = num_bodies;
+    num_contacts = 0;
+}
+
+// Returns the solver body index of the rigid body, or of the immovable body if it is NULL.
+static int solver_body(RigidBody *rb, Entity *e)
+{
+    if (rb == NULL) return num_solver_bodies;
+    SolverBody *body = &solver_bodies[rb->index];
+    if (!body->prepared) {
+        body->prepared = true;
+        body->inverse_mass = rb->inverse_mass;
+        body->inverse_inertia_tensor = rb->mass == 0 ? rb->inverse_inertia_tensor : rigid_body_world_inverse_inertia_tensor(rb, e);
+        body->velocity = vec3_mul(rb->linear_momentum, rb->inverse_mass);
+        body->angular_velocity = matrix_vec3(body->inverse_inertia_tensor, rb->angular_momentum);
+    }
+    return rb->index;
+}
+
+static void add_contact(CollisionPair *pair, ContactPoint *point, int a, Entity *A_entity, int b, Entity *B_entity, bool A_movable)
+{
+    if (num_contacts == contacts_size) {
+        contacts_size = contacts_size == 0 ? 256 : 2*contacts_size;
+        contacts = realloc(contacts, sizeof(Contact) * contacts_size);
+        mem_check(contacts);
+        sorted_contacts = realloc(sorted_contacts, sizeof(int) * contacts_size);
+        mem_check(sorted_contacts);
+        contact_batches = realloc(contact_batches, sizeof(ContactBatch) * contacts_size);
+        mem_check(contact_batches);
+    }
+    Contact *contact = &contacts[num_contacts++];
+    contact->point = point;
+    contact->normal = pair->contact_normal;
+    contact->A = a;
+    contact->B = b;
+    contact->A_entity = A_entity;
+    contact->B_entity = B_entity;
+    contact->island = A_movable ? a : b;
+}
+
+// Add a contact for each point of the pair's contact manifold.
+static void add_contacts(CollisionPair *pair, RigidBody *A, Entity *A_entity, RigidBody *B, Entity *B_entity)
+{
+    int a = solver_body(A, A_entity);
+    int b = solver_body(B, B_entity);
+    bool A_movable = solver_bodies[a].inverse_mass != 0;
+    bool B_movable = solver_bodies[b].inverse_mass != 0;
+    if (!A_movable && !B_movable) return;
+    for (int i = 0; i < pair->num_contact_points; i++) add_contact(pair, &pair->contact_points[i], a, A_entity, b, B_entity, A_movable);
+}
+
+// Sort the contacts by island with a counting sort, which keeps the contacts of each island in the order they were added.
+// This must be done after the islands have been joined for this step.
+static void group_contacts(void)
+{
+    for (int i = 0; i < num_solver_bodies; i++) body_solver_islands[i] = -1;
+    num_solver_islands = 0;
+    for (int i = 0; i < num_contacts; i++) {
+        int root = find_island(contacts[i].island);
+        if (body_solver_islands[root] == -1) {
+            body_solver_islands[root] = num_solver_islands;
+            memset(&solver_islands[num_solver_islands], 0, sizeof(SolverIsland));
+            num_solver_islands ++;
+        }
+        contacts[i].island = body_solver_islands[root];
+        solver_islands[contacts[i].island].num_contacts ++;
+    }
+    int first_contact = 0;
+    for (int i = 0; i < num_solver_islands; i++) {
+        solver_islands[i].first_contact = first_contact;
+        first_contact += solver_islands[i].num_contacts;
+        solver_islands[i].num_contacts = 0;
+    }
+    for (int i = 0; i < num_contacts; i++) {
+        SolverIsland *island = &solver_islands[contacts[i].island];
+        sorted_contacts[island->first_contact + island->num_contacts++] = i;
+    }
+}
+
+static void add_contact_to_batch(SolverIsland *island, Contact *contact)
+{
+    ContactBatch *batches = &contact_batches[island->first_contact];
+    int a = contact->A;
+    int b = contact->B;
+    SolverBody *body_A = &solver_bodies[a];
+    SolverBody *body_B = &solver_bodies[b];
+    // Only bodies which can be moved by the solver conflict with each other in a batch.
+    bool A_movable = body_A->inverse_mass != 0;
+    bool B_movable = body_B->inverse_mass != 0;
+
+    // Find the first batch with space which does not already contain either body.
+    int batch_index;
+    for (batch_index = island->first_open_batch; batch_index < island->num_batches; batch_index++) {
+        ContactBatch *batch = &batches[batch_index];
+        if (batch->num_contacts == 4) continue;
+        bool conflict = false;
+        for (int i = 0; i < batch->num_contacts; i++) {
+            if (A_movable && (batch->A[i] == a || batch->B[i] == a)) conflict = true;
+            if (B_movable && (batch->A[i] == b || batch->B[i] == b)) conflict = true;
+        }
+        if (!conflict) break;
+    }
+    if (batch_index == island->num_batches) {
+        // Unused lanes are contacts between the immovable body and itself, which do nothing.
+        ContactBatch *batch = &batches[island->num_batches++];
+        memset(batch, 0, sizeof(ContactBatch));
+        for (int i = 0; i < 4; i++) {
+            batch->A[i] = num_solver_bodies;
+            batch->B[i] = num_solver_bodies;
+        }
+    }
+    ContactBatch *batch = &batches[batch_index];
+    int lane = batch->num_contacts ++;
+    while (island->first_open_batch < island->num_batches && batches[island->first_open_batch].num_contacts == 4) island->first_open_batch ++;
+
+    // The solver's normal points from B to A.
+    vec3 n = vec3_neg(contact->normal);
+    vec3 p = contact->point->position;
+    float depth = contact->point->depth;
+    vec3 kA = vec3_cross(vec3_sub(p, contact->A_entity->position), n);
+    vec3 kB = vec3_cross(vec3_sub(p, contact->B_entity->position), n);
+    vec3 uA = matrix_vec3(body_A->inverse_inertia_tensor, kA);
+    vec3 uB = matrix_vec3(body_B->inverse_inertia_tensor, kB);
+    batch->A[lane] = a;
+    batch->B[lane] = b;
+    batch->points[lane] = contact->point;
+    for (int i = 0; i < 3; i++) {
+        batch->normal[i][lane] = n.vals[i];
+        batch->angular_A[i][lane] = kA.vals[i];
+        batch->angular_B[i][lane] = kB.vals[i];
+        batch->inertia_A[i][lane] = uA.vals[i];
+        batch->inertia_B[i][lane] = uB.vals[i];
+    }
+    batch->inverse_mass_A[lane] = body_A->inverse_mass;
+    batch->inverse_mass_B[lane] = body_B->inverse_mass;
+    batch->effective_mass[lane] = 1.0 / (body_A->inverse_mass + body_B->inverse_mass + vec3_dot(kA, uA) + vec3_dot(kB, uB));
+    if (depth >= 0) batch->bias[lane] = CONTACT_BIAS_FACTOR / physics_time_step * MAX(depth - CONTACT_PENETRATION_SLOP, 0);
+    else batch->bias[lane] = depth / physics_time_step;
+    batch->impulse[lane] = contact->point->normal_impulse;
+}
+
+// Apply the given impulses along the normals of the batch's contacts.
+static void apply_contact_batch_impulses(ContactBatch *batch, float impulses[4])
+{
+    for (int i = 0; i < 4; i++) {
+        SolverBody *A = &solver_bodies[batch->A[i]];
+        SolverBody *B = &solver_bodies[batch->B[i]];
+        if (batch->inverse_mass_A[i] != 0) {
+            for (int j = 0; j < 3; j++) {
+                A->velocity.vals[j] += batch->normal[j][i] * batch->inverse_mass_A[i] * impulses[i];
+                A->angular_velocity.vals[j] += batch->inertia_A[j][i] * impulses[i];
+            }
+        }
+        if (batch->inverse_mass_B[i] != 0) {
+            for (int j = 0; j < 3; j++) {
+                B->velocity.vals[j] -= batch->normal[j][i] * batch->inverse_mass_B[i] * impulses[i];
+                B->angular_velocity.vals[j] -= batch->inertia_B[j][i] * impulses[i];
+            }
+        }
+    }
+}
+
+static void solve_contact_batch(ContactBatch *batch)
+{
+    float delta[4];
+#ifdef __SSE2__
+    // Gather the velocities of the bodies of the four contacts into lanes.
+    #define gather(BODIES,MEMBER,COMPONENT)\
+        _mm_setr_ps(solver_bodies[batch-> BODIES [0]]. MEMBER .vals[( COMPONENT )], solver_bodies[batch-> BODIES [1]]. MEMBER .vals[( COMPONENT )],\
+                    solver_bodies[batch-> BODIES [2]]. MEMBER .vals[( COMPONENT )], solver_bodies[batch-> BODIES [3]]. MEMBER .vals[( COMPONENT )])
+    // The relative velocity along the normal, n.(vA + wA x rA - vB - wB x rB) = n.vA + (rA x n).wA - n.vB - (rB x n).wB.
+    __m128 normal_velocity = _mm_setzero_ps();
+    for (int j = 0; j < 3; j++) {
+        __m128 n = _mm_loadu_ps(batch->normal[j]);
+        normal_velocity = _mm_add_ps(normal_velocity, _mm_mul_ps(n, _mm_sub_ps(gather(A, velocity, j), gather(B, velocity, j))));
+        normal_velocity = _mm_add_ps(normal_velocity, _mm_mul_ps(_mm_loadu_ps(batch->angular_A[j]), gather(A, angular_velocity, j)));
+        normal_velocity = _mm_sub_ps(normal_velocity, _mm_mul_ps(_mm_loadu_ps(batch->angular_B[j]), gather(B, angular_velocity, j)));
+    }
+    #undef gather
+    __m128 impulse = _mm_loadu_ps(batch->impulse);
+    __m128 new_impulse = _mm_add_ps(impulse, _mm_mul_ps(_mm_loadu_ps(batch->effective_mass), _mm_sub_ps(_mm_loadu_ps(batch->bias), normal_velocity)));
+    new_impulse = _mm_max_ps(new_impulse, _mm_setzero_ps());
+    _mm_storeu_ps(delta, _mm_sub_ps(new_impulse, impulse));
+    _mm_storeu_ps(batch->impulse, new_impulse);
+#else
+    for (int i = 0; i < 4; i++) {
+        SolverBody *A = &solver_bodies[batch->A[i]];
+        SolverBody *B = &solver_bodies[batch->B[i]];
+        float normal_velocity = 0;
+        for (int j = 0; j < 3; j++) {
+            normal_velocity += batch->normal[j][i] * (A->velocity.vals[j] - B->velocity.vals[j])
+                             + batch->angular_A[j][i] * A->angular_velocity.vals[j] - batch->angular_B[j][i] * B->angular_velocity.vals[j];
+        }
+        float new_impulse = MAX(batch->impulse[i] + batch->effective_mass[i] * (batch->bias[i] - normal_velocity), 0);
+        delta[i] = new_impulse - batch->impulse[i];
+        batch->impulse[i] = new_impulse;
+    }
+#endif
+    // The contacts of a batch share no movable bodies, so the impulses can be applied in any order.
+    apply_contact_batch_impulses(batch, delta);
+}
+
+static void solve_island(int index, void *data)
+{
+    SolverIsland *island = &solver_islands[index];
+    for (int i = 0; i < island->num_contacts; i++) {
+        add_contact_to_batch(island, &contacts[sorted_contacts[island->first_contact + i]]);
+    }
+    ContactBatch *batches = &contact_batches[island->first_contact];
+    // Warm-start with the impulses of the last step.
+    for (int i = 0; i < island->num_batches; i++) {
+        apply_contact_batch_impulses(&batches[i], batches[i].impulse);
+    }
+    for (int iteration = 0; iteration < CONTACT_SOLVER_ITERATIONS; iteration++) {
+        for (int i = 0; i < island->num_batches; i++) {
+            solve_contact_batch(&batches[i]);
+        }
+    }
+    for (int i = 0; i < island->num_batches; i++) {
+        for (int j = 0; j < batches[i].num_contacts; j++) {
+            batches[i].points[j]->normal_impulse = batches[i].impulse[j];
+        }
+    }
+}
+
+// Convert the velocities back into momenta.
+static void update_solved_momentum(int index, void *data)
+{
+    RigidBody *rb = (RigidBody *) behaviour_lists[RigidBodyID].list[index].data;
+    Entity *e = behaviour_lists[RigidBodyID].list[index].entity;
+    SolverBody *body = &solver_bodies[index];
+    if (!body->prepared || rb->mass == 0) return;
+    rb->linear_momentum = vec3_mul(body->velocity, rb->mass);
+    mat3x3 rotation_matrix = entity_orientation(e);
+    mat3x3 inertia_tensor = mat3x3_mul(mat3x3_multiply3(rotation_matrix, rb->inertia_tensor, mat3x3_transpose(rotation_matrix)), e->scale * e->scale);
+    rb->angular_momentum = matrix_vec3(inertia_tensor, body->angular_velocity);
+}
+
+static void solve_contacts(void)
+{
+    group_contacts();
+    parallel_for(num_solver_islands, solve_island, NULL);
+    parallel_for(num_solver_bodies, update_solved_momentum, NULL);
+}
+
+/*--------------------------------------------------------------------------------
+    The physics step.
+    The step is split into phases which run on the thread pool: integration over the bodies, the narrowphase over the pairs
+    given by the broadphase, and the contact solver over the islands. Each parallel call only writes to its own body, pair
+    or island, and everything which depends on order (waking, joining islands and gathering the contacts) is done
+    between the phases in the order of the pairs, so a step gives the same result for any number of threads.
+--------------------------------------------------------------------------------*/
+typedef struct NarrowphasePair_s {
+    CollisionPair *pair;
+    RigidBody *A;
+    RigidBody *B;
+} NarrowphasePair;
+static NarrowphasePair *narrowphase_pairs = NULL;
+static CollisionPair **narrowphase_batch = NULL;
+static GJKManifold *narrowphase_manifolds = NULL;
+static bool *narrowphase_hits = NULL;
+static int narrowphase_pairs_size = 0;
+
+// Whether a collider can be left out of the narrowphase against another resting collider. Immovable bodies never sleep, so like
+// colliders without a rigid body they are resting if they have not moved.
+static bool collider_resting(RigidBody *rb, Collider *collider)
+{
+    return rb == NULL || rb->mass == 0 ? !broadphase_collider_moved(collider) : rb->asleep;
+}
+
+static void resolve_rigid_body_collisions(void)
+{
+    prepare_solver_bodies(behaviour_lists[RigidBodyID].length);
+    if (num_collision_pairs > narrowphase_pairs_size) {
+        narrowphase_pairs_size = num_collision_pairs;
+        narrowphase_pairs = realloc(narrowphase_pairs, sizeof(NarrowphasePair) * narrowphase_pairs_size);
+        mem_check(narrowphase_pairs);
+        narrowphase_batch = realloc(narrowphase_batch, sizeof(CollisionPair *) * narrowphase_pairs_size);
+        mem_check(narrowphase_batch);
+        narrowphase_manifolds = realloc(narrowphase_manifolds, sizeof(GJKManifold) * narrowphase_pairs_size);
+        mem_check(narrowphase_manifolds);
+        narrowphase_hits = realloc(narrowphase_hits, sizeof(bool) * narrowphase_pairs_size);
+        mem_check(narrowphase_hits);
+    }
+    // Only the pairs of colliders with overlapping bounding boxes, given by the broadphase, are tested. Of these, pairs without a rigid body
+    // are left to their own code (such as the player controller), and sleeping bodies are not collided with each other, or with static
+    // colliders which have not moved.
+    int num_pairs = 0;
+    for (int i = 0; i < num_collision_pairs; i++) {
+        CollisionPair *pair = &collision_pairs[i];
+        RigidBody *A = collider_rigid_body(pair->A, pair->A_entity);
+        RigidBody *B = collider_rigid_body(pair->B, pair->B_entity);
+        if (A == NULL && B == NULL) continue;
+        if (collider_resting(A, pair->A) && collider_resting(B, pair->B)) continue;
+        narrowphase_pairs[num_pairs] = (NarrowphasePair) { pair, A, B };
+        narrowphase_batch[num_pairs++] = pair;
+    }
+    int64_t start = profile_clock();
+    collider_intersection_batch(narrowphase_batch, num_pairs, narrowphase_manifolds, narrowphase_hits);
+    profile_add(&physics_profile.narrowphase_time, NULL, start);
+    if (physics_profiling) physics_profile.num_pairs += num_pairs;
+
+    start = profile_clock();
+    for (int i = 0; i < num_pairs; i++) {
+        if (!narrowphase_hits[i]) continue;
+        if (physics_profiling) physics_profile.num_contacts ++;
+        CollisionPair *pair = narrowphase_pairs[i].pair;
+        RigidBody *A = narrowphase_pairs[i].A;
+        RigidBody *B = narrowphase_pairs[i].B;
+        if (A != NULL && A->asleep) rigid_body_wake(A);
+        if (B != NULL && B->asleep) rigid_body_wake(B);
+        if (A != NULL && B != NULL) join_islands(A, B);
+        // If there isn't a rigid body on an entity, its collider is treated like an immovable rigidbody with infinite mass.
+        // A pair with a compound collider has a contact for each pair of colliding children.
+        if (pair->num_child_pairs == 0) add_contacts(pair, A, pair->A_entity, B, pair->B_entity);
+        for (int j = 0; j < pair->num_child_pairs; j++) {
+            CollisionPair *child_pair = &pair->child_pairs[j];
+            if (child_pair->colliding) add_contacts(child_pair, A, pair->A_entity, B, pair->B_entity);
+        }
+    }
+    solve_contacts();
+    profile_add(&physics_profile.impulse_time, NULL, start);
 }
 
 // This is not a behavioural update, since finer control over when rigid bodies are updated is wanted.
 static void rigid_body_update(RigidBody *rb, Entity *e)
 {
     // Euler's method updating for rigid body positions and orientations.
-    X(e->position) += rb->linear_momentum.vals[0] * rb->inverse_mass * dt;
-    Y(e->position) += rb->linear_momentum.vals[1] * rb->inverse_mass * dt;
-    Z(e->position) += rb->linear_momentum.vals[2] * rb->inverse_mass * dt;
+    X(e->position) += rb->linear_momentum.vals[0] * rb->inverse_mass * physics_time_step;
+    Y(e->position) += rb->linear_momentum.vals[1] * rb->inverse_mass * physics_time_step;
+    Z(e->position) += rb->linear_momentum.vals[2] * rb->inverse_mass * physics_time_step;
 
     // Transform the inverse inertia tensor to world space via the rotation matrix of this body.
-    mat3x3 rotation_matrix = entity_orientation(e);
-    mat3x3 worldspace_inverse_inertia_tensor = mat3x3_multiply3(rotation_matrix, rb->inverse_inertia_tensor, mat3x3_transpose(rotation_matrix));
+    mat3x3 worldspace_inverse_inertia_tensor = rigid_body_world_inverse_inertia_tensor(rb, e);
 
     // Calculate the angular velocity from angular momentum and the (inverse) inertia tensor.
     vec3 angular_velocity = matrix_vec3(worldspace_inverse_inertia_tensor, rb->angular_momentum);
 
     float dwx,dwy,dwz;
-    dwx = angular_velocity.vals[0] * dt;
-    dwy = angular_velocity.vals[1] * dt;
-    dwz = angular_velocity.vals[2] * dt;
+    dwx = angular_velocity.vals[0] * physics_time_step;
+    dwy = angular_velocity.vals[1] * physics_time_step;
+    dwz = angular_velocity.vals[2] * physics_time_step;
     mat3x3 skew;
     fill_mat3x3_cmaj(skew, 0,   -dwz,  dwy,
                            dwz,    0, -dwx,
@@ -637,14 +2669,327 @@ static void rigid_body_update(RigidBody *rb, Entity *e)
     mat3x3_orthonormalize(&e->orientation);
 }
 
-void rigid_body_dynamics(void)
+/*--------------------------------------------------------------------------------
+    Continuous collision detection.
+    A body which moves far in a step, compared to its size, could pass through thin colliders between the start and the end
+    of the step. The time of impact of these bodies is found by conservative advancement: the distance from the body to a
+    collider, found by GJK, divided by a bound on how fast any point of the body can approach the collider, is a time before
+    which they can not touch. The body is advanced by this time, and this is repeated until the distance is within a tolerance.
+    The body is then moved back to its time of impact, keeping its velocity, and the contact is resolved by the solver in the
+    same step. The other colliders are taken to be at their positions at the end of the step.
+--------------------------------------------------------------------------------*/
+// Bodies which move further than this fraction of their radius in a step are tested.
+#define CCD_MOTION_FRACTION 0.5
+#define CCD_TOLERANCE 0.005
+// The body is moved this far past its time of impact, so that the contact is found by the narrowphase.
+#define CCD_PENETRATION 0.02
+#define CCD_MAX_ITERATIONS 32
+// The colliders near the path of a body are gathered in an array of this size on the stack, or on the heap if there are more.
+#define CCD_CANDIDATES 64
+typedef struct RigidBodyMotion_s {
+    // The motion in the last step, as a translation of the center of mass and a rotation about it.
+    vec3 displacement;
+    vec3 axis;
+    float angle;
+    float radius; // The furthest distance of a point of the body from its center of mass.
+    bool fast;
+    float time_of_impact; // The fraction of the step at which the body first touches another collider.
+} RigidBodyMotion;
+static RigidBodyMotion *rigid_body_motions = NULL;
+
+static mat4x4 rigid_body_matrix_at(RigidBody *rb, Entity *e, RigidBodyMotion *motion, float t)
+{
+    vec3 position = vec3_add(rb->previous_position, vec3_mul(motion->displacement, t));
+    // axis_angle_rotate_mat3x3 turns clockwise about the axis, so the angle is negated.
+    mat3x3 orientation = motion->angle == 0 ? rb->previous_orientation : axis_angle_rotate_mat3x3(rb->previous_orientation, motion->axis, -motion->angle * t);
+    return entity_matrix_at(e, position, orientation);
+}
+
+// Find the distance from the body at the given time to the collider, and the normal pointing from the collider to the body.
+static bool body_collider_distance(RigidBody *rb, Entity *e, RigidBodyMotion *motion, float t, Collider *other, mat4x4 other_matrix,
+                                   CollisionCache *cache, float *distance, vec3 *normal)
+{
+    mat4x4 matrix = rigid_body_matrix_at(rb, e, motion, t);
+    GJKManifold manifold;
+    *distance = collider_distance(rb->collider, matrix, other, other_matrix, cache, INFINITY, &manifold);
+    if (*distance == INFINITY) {
+        // The query failed, so there is no normal.
+        *normal = vec3_zero();
+        return false;
+    }
+    if (*distance > 0) {
+        *normal = vec3_mul(manifold.separating_vector, 1.0 / *distance);
+        return false;
+    }
+    // The normal of intersecting colliders is given by the penetration, which B is separated by moving along.
+    collider_intersection(rb->collider, matrix, other, other_matrix, cache, &manifold);
+    *distance = sqrt(vec3_dot(manifold.separating_vector, manifold.separating_vector));
+    *normal = *distance == 0 ? vec3_zero() : vec3_mul(manifold.separating_vector, -1.0 / *distance);
+    return true;
+}
+
+// Returns the fraction of the step at which the body first touches the collider, or 1 if it does not.
+static float time_of_impact(RigidBody *rb, Entity *e, RigidBodyMotion *motion, Collider *other, Entity *other_entity)
+{
+    mat4x4 other_matrix = entity_matrix(other_entity);
+    // Each query starts from the simplex of the last.
+    CollisionCache cache;
+    init_collision_cache(&cache);
+    float t = 0;
+    for (int i = 0; i < CCD_MAX_ITERATIONS; i++) {
+        float distance;
+        vec3 normal;
+        bool intersecting = body_collider_distance(rb, e, motion, t, other, other_matrix, &cache, &distance, &normal);
+        // A failed query gives no answer, so the body is not held back by this collider.
+        if (distance == INFINITY) return 1;
+        // Bound how fast the distance can decrease, by the motion towards the collider plus the fastest a point moves by the rotation.
+        float approach_speed = motion->angle * motion->radius - vec3_dot(motion->displacement, normal);
+        if (intersecting || distance < CCD_TOLERANCE) {
+            if (t == 0) {
+                // The body already touches the collider at the start of the step. This contact is left to the contact solver, unless
+                // the body has passed through the collider by the end of the step, which is seen by the normal having flipped.
+                float end_distance;
+                vec3 end_normal;
+                if (approach_speed <= 0) return 1;
+                body_collider_distance(rb, e, motion, 1, other, other_matrix, &cache, &end_distance, &end_normal);
+                if (vec3_dot(normal, end_normal) >= 0) return 1;
+                // Don't let the body sink further than the allowed penetration.
+                if (intersecting) return MAX(0, CCD_PENETRATION - distance) / approach_speed;
+            }
+            // Move a little past the time of impact, so that the contact is found by the narrowphase.
+            return MIN(1, t + CCD_PENETRATION / approach_speed);
+        }
+        if (approach_speed <= 0) return 1;
+        t += distance / approach_speed;
+        if (t >= 1) return 1;
+    }
+    return t;
+}
+
+static void find_time_of_impact(int index, void *data)
 {
+    RigidBody *rb = (RigidBody *) behaviour_lists[RigidBodyID].list[index].data;
+    Entity *e = behaviour_lists[RigidBodyID].list[index].entity;
+    RigidBodyMotion *motion = &rigid_body_motions[index];
+    motion->time_of_impact = 1;
+    if (!motion->fast) return;
+    // Find the colliders near the path of the body, with a box around its boxes at the start and end of the step.
+    float min[3], max[3];
+    collider_world_aabb(rb->collider, e, min, max);
+    float rotation = motion->angle * motion->radius;
+    for (int i = 0; i < 3; i++) {
+        min[i] = MIN(min[i], min[i] - motion->displacement.vals[i]) - rotation;
+        max[i] = MAX(max[i], max[i] - motion->displacement.vals[i]) + rotation;
+    }
+    Collider *candidates[CCD_CANDIDATES];
+    Collider **colliders = candidates;
+    int max_colliders = CCD_CANDIDATES;
+    int num_colliders = broadphase_query_aabb(min, max, colliders, max_colliders);
+    // The query stops when the array is full, so then it is repeated with a larger array, until all of the colliders are found.
+    while (num_colliders == max_colliders) {
+        max_colliders *= 2;
+        if (colliders != candidates) free(colliders);
+        colliders = malloc(sizeof(Collider *) * max_colliders);
+        mem_check(colliders);
+        num_colliders = broadphase_query_aabb(min, max, colliders, max_colliders);
+    }
+    for (int i = 0; i < num_colliders; i++) {
+        if (colliders[i] == rb->collider || !colliders_can_collide(rb->collider, colliders[i])) continue;
+        motion->time_of_impact = MIN(motion->time_of_impact, time_of_impact(rb, e, motion, colliders[i], colliders[i]->entity));
+    }
+    if (colliders != candidates) free(colliders);
+}
+
+static void continuous_collision(void)
+{
+    int num_bodies = behaviour_lists[RigidBodyID].length;
+    parallel_for(num_bodies, find_time_of_impact, NULL);
+    // Move the bodies back to their times of impact, after every time has been found from the positions at the end of the step.
+    for (int i = 0; i < num_bodies; i++) {
+        RigidBodyMotion *motion = &rigid_body_motions[i];
+        if (motion->time_of_impact == 1) continue;
+        RigidBody *rb = (RigidBody *) behaviour_lists[RigidBodyID].list[i].data;
+        Entity *e = behaviour_lists[RigidBodyID].list[i].entity;
+        e->position = vec3_add(rb->previous_position, vec3_mul(motion->displacement, motion->time_of_impact));
+        if (motion->angle != 0) e->orientation = axis_angle_rotate_mat3x3(rb->previous_orientation, motion->axis, -motion->angle * motion->time_of_impact);
+        broadphase_update_collider(rb->collider);
+    }
+}
+
+static void integrate_rigid_body(int index, void *data)
+{
+    RigidBody *rb = (RigidBody *) behaviour_lists[RigidBodyID].list[index].data;
+    Entity *e = behaviour_lists[RigidBodyID].list[index].entity;
+    // Each body starts in its own island.
+    rb->index = index;
+    island_parents[index] = index;
+    rb->previous_position = e->position;
+    rb->previous_orientation = e->orientation;
+    RigidBodyMotion *motion = &rigid_body_motions[index];
+    motion->fast = false;
+    if (rb->asleep) return;
     // Gravity updates here for now for testing.
-    for_behaviour(RigidBody, rb, rb_entity)
-        rb->linear_momentum.vals[1] -= rb->mass * dt * gravity_constant;
-        rigid_body_update(rb, rb_entity);
-    end_for_behaviour()
+    rb->linear_momentum.vals[1] -= rb->mass * physics_time_step * gravity_constant;
+    rigid_body_update(rb, e);
+
+    motion->displacement = vec3_sub(e->position, rb->previous_position);
+    // Find the rotation taking the previous orientation to the new one, so that the path tested for collisions ends where the body is.
+    mat3x3 rotation = mat3x3_multiply(e->orientation, mat3x3_transpose(rb->previous_orientation));
+    float cos_angle = 0.5 * (rotation.vals[0] + rotation.vals[4] + rotation.vals[8] - 1);
+    motion->angle = acos(MAX(-1, MIN(1, cos_angle)));
+    motion->axis = new_vec3(rotation.vals[3*1 + 2] - rotation.vals[3*2 + 1],
+                            rotation.vals[3*2 + 0] - rotation.vals[3*0 + 2],
+                            rotation.vals[3*0 + 1] - rotation.vals[3*1 + 0]);
+    float axis_length = sqrt(vec3_dot(motion->axis, motion->axis));
+    if (axis_length < 1e-6) motion->angle = 0;
+    else motion->axis = vec3_mul(motion->axis, 1.0 / axis_length);
+    vec3 offset = vec3_sub(rb->collider->bounding_center, e->center);
+    motion->radius = (rb->collider->bounding_radius + sqrt(vec3_dot(offset, offset))) * e->scale;
+    motion->fast = sqrt(vec3_dot(motion->displacement, motion->displacement)) + motion->angle * motion->radius > CCD_MOTION_FRACTION * motion->radius;
+}
+
+void rigid_body_dynamics(void)
+{
+    physics_time_step = 1.0 / physics_rate;
+    int num_bodies = behaviour_lists[RigidBodyID].length;
+    if (num_bodies > island_parents_size) {
+        island_parents_size = num_bodies;
+        island_parents = realloc(island_parents, sizeof(int) * island_parents_size);
+        mem_check(island_parents);
+        island_still_times = realloc(island_still_times, sizeof(float) * island_parents_size);
+        mem_check(island_still_times);
+        rigid_body_motions = realloc(rigid_body_motions, sizeof(RigidBodyMotion) * island_parents_size);
+        mem_check(rigid_body_motions);
+    }
+    int64_t step_start = profile_clock();
+    int64_t start = step_start;
+    parallel_for(num_bodies, integrate_rigid_body, NULL);
+    profile_add(&physics_profile.integrate_time, NULL, start);
+    start = profile_clock();
+    broadphase_update();
+    profile_add(&physics_profile.broadphase_time, NULL, start);
+    start = profile_clock();
+    continuous_collision();
+    profile_add(&physics_profile.ccd_time, NULL, start);
     resolve_rigid_body_collisions();
+    update_sleeping();
+    profile_add(&physics_profile.step_time, &physics_profile.num_steps, step_start);
+}
+
+// Draw each body between its transforms at the last two steps, by the fraction of a step left in the accumulator.
+static void interpolate_rigid_body(int index, void *data)
+{
+    RigidBody *rb = (RigidBody *) behaviour_lists[RigidBodyID].list[index].data;
+    Entity *e = behaviour_lists[RigidBodyID].list[index].entity;
+    float t = physics_accumulator / physics_time_step;
+    e->interpolated = true;
+    e->render_position = vec3_lerp(rb->previous_position, e->position, t);
+    e->render_orientation = mat3x3_add(mat3x3_mul(rb->previous_orientation, 1 - t), mat3x3_mul(e->orientation, t));
+    mat3x3_orthonormalize(&e->render_orientation);
+}
+
+void physics_update(void)
+{
+    physics_time_step = 1.0 / physics_rate;
+    physics_accumulator += dt;
+    int num_steps = 0;
+    while (physics_accumulator >= physics_time_step) {
+        if (num_steps == max_physics_substeps) {
+            // After a long frame, drop the time which is left rather than trying to catch up, so the cost of a frame is bounded.
+            // The simulation runs slower than real time until the frame rate recovers.
+            physics_accumulator = fmod(physics_accumulator, physics_time_step);
+            break;
+        }
+        rigid_body_dynamics();
+        physics_accumulator -= physics_time_step;
+        num_steps ++;
+    }
+    parallel_for(behaviour_lists[RigidBodyID].length, interpolate_rigid_body, NULL);
+}
+
+
+void collider_mass_properties(Collider *collider, float mass, float *volume, vec3 *center_of_mass, mat3x3 *inertia_tensor)
+{
+    float r = collider->half_extents.vals[0];
+    float diagonal[3];
+    switch (collider->shape) {
+    case ColliderSphere:
+        *volume = 4.0/3.0 * M_PI * r*r*r;
+        diagonal[0] = diagonal[1] = diagonal[2] = 2.0/5.0 * mass * r*r;
+        break;
+    case ColliderCapsule: {
+        // A cylinder with a hemisphere on each end. Each hemisphere's inertia about the center is taken from its own center of mass,
+        // 3r/8 from the flat face, by the parallel axis theorem.
+        float length = 2*collider->half_extents.vals[1];
+        float cylinder_volume = M_PI * r*r * length;
+        float sphere_volume = 4.0/3.0 * M_PI * r*r*r;
+        *volume = cylinder_volume + sphere_volume;
+        float cylinder_mass = mass * cylinder_volume / *volume;
+        float sphere_mass = mass * sphere_volume / *volume;
+        diagonal[1] = cylinder_mass * r*r/2.0 + sphere_mass * 2.0/5.0 * r*r;
+        diagonal[0] = diagonal[2] = cylinder_mass * (length*length/12.0 + r*r/4.0)
+                                  + sphere_mass * (2.0/5.0 * r*r + length*length/4.0 + 3.0/8.0 * length*r);
+        break;
+    }
+    case ColliderBox: {
+        vec3 size = vec3_mul(collider->half_extents, 2);
+        *volume = X(size) * Y(size) * Z(size);
+        diagonal[0] = mass * (Y(size)*Y(size) + Z(size)*Z(size)) / 12.0;
+        diagonal[1] = mass * (X(size)*X(size) + Z(size)*Z(size)) / 12.0;
+        diagonal[2] = mass * (X(size)*X(size) + Y(size)*Y(size)) / 12.0;
+        break;
+    }
+    case ColliderCylinder: {
+        // A prism on a regular polygon, which is made of triangles from the axis. The polar moment of each triangle about the axis is
+        // m(|a|^2 + |b|^2 + a.b)/6 for its other two corners a and b, and by symmetry, half of this is about each axis in the polygon's plane.
+        float height = 2*collider->half_extents.vals[1];
+        float angle = 2*M_PI / collider->sides;
+        *volume = collider->sides * 0.5 * r*r * sin(angle) * height;
+        float polar = mass * r*r * (2 + cos(angle)) / 6.0;
+        diagonal[1] = polar;
+        diagonal[0] = diagonal[2] = polar / 2.0 + mass * height*height / 12.0;
+        break;
+    }
+    case ColliderCompound: {
+        // The mass is shared between the children by their volumes. Their inertia tensors are rotated into the compound's space, then moved
+        // from the children's centers of mass to the compound's by the parallel axis theorem.
+        int n = collider->num_children;
+        float child_volumes[MAX_COMPOUND_CHILDREN];
+        vec3 child_centers[MAX_COMPOUND_CHILDREN];
+        mat3x3 child_tensors[MAX_COMPOUND_CHILDREN];
+        *volume = 0;
+        *center_of_mass = vec3_zero();
+        for (int i = 0; i < n; i++) {
+            Collider *child = collider->children[i];
+            // The inertia tensor is found for a unit mass, and is scaled to the child's mass below.
+            collider_mass_properties(child, 1, &child_volumes[i], &child_centers[i], &child_tensors[i]);
+            mat3x3 rotation = rotation_part_rigid_mat4x4(child->local_matrix);
+            child_centers[i] = rigid_matrix_vec3(child->local_matrix, child_centers[i]);
+            child_tensors[i] = mat3x3_multiply3(rotation, child_tensors[i], mat3x3_transpose(rotation));
+            *volume += child_volumes[i];
+            *center_of_mass = vec3_add(*center_of_mass, vec3_mul(child_centers[i], child_volumes[i]));
+        }
+        *center_of_mass = vec3_mul(*center_of_mass, 1.0 / *volume);
+        memset(inertia_tensor, 0, sizeof(mat3x3));
+        for (int i = 0; i < n; i++) {
+            float child_mass = mass * child_volumes[i] / *volume;
+            vec3 r = vec3_sub(child_centers[i], *center_of_mass);
+            mat3x3 shift;
+            fill_mat3x3_rmaj(shift, Y(r)*Y(r) + Z(r)*Z(r), -X(r)*Y(r), -X(r)*Z(r),
+                                    -X(r)*Y(r), X(r)*X(r) + Z(r)*Z(r), -Y(r)*Z(r),
+                                    -X(r)*Z(r), -Y(r)*Z(r), X(r)*X(r) + Y(r)*Y(r));
+            *inertia_tensor = mat3x3_add(*inertia_tensor, mat3x3_mul(mat3x3_add(child_tensors[i], shift), child_mass));
+        }
+        return;
+    }
+    default:
+        // Polyhedra are the convex hulls of their points.
+        polytope_mass_properties(collider->points, collider->num_points, mass, volume, center_of_mass, inertia_tensor);
+        return;
+    }
+    *center_of_mass = collider->shape_center;
+    memset(inertia_tensor, 0, sizeof(mat3x3));
+    for (int i = 0; i < 3; i++) inertia_tensor->vals[4*i] = diagonal[i];
 }
 
 RigidBody *add_rigid_body(Entity *e, float mass)
@@ -663,17 +3008,23 @@ RigidBody *add_rigid_body(Entity *e, float mass)
     RigidBody *rb = (RigidBody *) add_behaviour(e, NULL, sizeof(RigidBody), RigidBodyID)->data;
     memset(rb, 0, sizeof(RigidBody));
     rb->collider = collider;
+    // An immovable body does not respond to collisions, though it may be moved by code.
+    set_collider_motion(collider, mass == 0 ? ColliderKinematic : ColliderDynamic);
     rb->mass = mass;
     rb->inverse_mass = mass == 0 ? 0 : 1.0 / mass;
 
-    vec3 center_of_mass = polytope_center_of_mass(rb->collider->points, rb->collider->num_points);
+    float volume;
+    vec3 center_of_mass;
+    mat3x3 inertia_tensor;
+    collider_mass_properties(rb->collider, mass, &volume, &center_of_mass, &inertia_tensor);
 
     rb->center_of_mass = center_of_mass;
     // Update the entity center. This is by default (0,0,0), but the center can be changed to make adjustments to the entity matrix.
     // This is useful because then geometry (in application or in vram) does not need to be changed for a change of center of rotation.
     e->center = center_of_mass;
+    rb->previous_position = e->position;
+    rb->previous_orientation = e->orientation;
 
-    mat3x3 inertia_tensor = brute_force_polyhedron_inertia_tensor(convex_hull(rb->collider->points, rb->collider->num_points), center_of_mass, mass);
     if (mass == 0) {
         memset(&rb->inertia_tensor, 0, sizeof(mat3x3));
         memset(&rb->inverse_inertia_tensor, 0, sizeof(mat3x3));
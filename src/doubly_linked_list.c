@@ -24,7 +24,7 @@ DLNode *___dl_add(DLList *list, DLNode *node)
     list->last = node;
     return node;
 }
-void ___dl_remove(DLList *list, DLNode *node)
+void ___dl_unlink(DLList *list, DLNode *node)
 {
     if (node == list->first && node == list->last) {
         list->first = NULL;
@@ -39,5 +39,9 @@ void ___dl_remove(DLList *list, DLNode *node)
         node->prev->next = node->next;
         node->next->prev = node->prev;
     }
+}
+void ___dl_remove(DLList *list, DLNode *node)
+{
+    ___dl_unlink(list, node);
     free(node);
 }
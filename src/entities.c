@@ -12,46 +12,42 @@ void init_entity_system(void)
     for (int i = 0; i < NUM_BEHAVIOUR_TYPES; i++) {
         BehaviourList *list = &behaviour_lists[i];
         list->type = i;
-        list->size = 128;
+        list->size = MAX_NUM_BEHAVIOURS;
         list->length = 0;
         list->list = calloc(1, sizeof(Behaviour) * list->size);
         mem_check(list->list);
     }
-    entity_list_size = 512;
+    entity_list_size = MAX_NUM_ENTITIES;
     entity_list_length = 0;
     entity_list = calloc(1, sizeof(Entity) * entity_list_size);
     mem_check(entity_list);
 }
 
-// Derive the matrix which transforms points in model/entity-space to world-space.
-mat4x4 entity_matrix(Entity *entity)
+// The matrix of the given transform, which maps entity-space points around the center to world-space.
+static mat4x4 transform_matrix(mat3x3 orientation, vec3 position, float scale, vec3 center)
 {
-    // For convenience, entities can be set as "euler-controlled". If their orientation is based off of euler angles, this avoids numerical problems
-    // by deriving the matrix from stored angles, rather than updating a 3x3 matrix based on time-stepped axis rotations.
-    mat3x3 orientation = entity_orientation(entity);
-
     mat4x4 matrix = {0};
     for (int i = 0; i < 3; i++) {
         for (int j = 0; j < 3; j++) {
             matrix.vals[4*i + j] = orientation.vals[3*i + j];
         }
     }
-    matrix.vals[4*3+0] = X(entity->position);
-    matrix.vals[4*3+1] = Y(entity->position);
-    matrix.vals[4*3+2] = Z(entity->position);
+    matrix.vals[4*3+0] = X(position);
+    matrix.vals[4*3+1] = Y(position);
+    matrix.vals[4*3+2] = Z(position);
     matrix.vals[4*3+3] = 1;
 
     mat4x4 scale_matrix;
-    fill_mat4x4_rmaj(scale_matrix, entity->scale,0,0,0,
-                                   0,entity->scale,0,0,
-                                   0,0,entity->scale,0,
+    fill_mat4x4_rmaj(scale_matrix, scale,0,0,0,
+                                   0,scale,0,0,
+                                   0,0,scale,0,
                                    0,0,0,1);
     right_multiply_mat4x4(&matrix, &scale_matrix);
     mat4x4 off_center_matrix;
     float cx,cy,cz;
-    cx = X(entity->center);
-    cy = Y(entity->center);
-    cz = Z(entity->center);
+    cx = X(center);
+    cy = Y(center);
+    cz = Z(center);
     fill_mat4x4_rmaj(off_center_matrix, 1,0,0,-cx,
                                         0,1,0,-cy,
                                         0,0,1,-cz,
@@ -60,6 +56,27 @@ mat4x4 entity_matrix(Entity *entity)
     return matrix;
 }
 
+// Derive the matrix which transforms points in model/entity-space to world-space.
+mat4x4 entity_matrix(Entity *entity)
+{
+    // For convenience, entities can be set as "euler-controlled". If their orientation is based off of euler angles, this avoids numerical problems
+    // by deriving the matrix from stored angles, rather than updating a 3x3 matrix based on time-stepped axis rotations.
+    return transform_matrix(entity_orientation(entity), entity->position, entity->scale, entity->center);
+}
+
+// The matrix the entity would have at the given position and orientation.
+mat4x4 entity_matrix_at(Entity *entity, vec3 position, mat3x3 orientation)
+{
+    return transform_matrix(orientation, position, entity->scale, entity->center);
+}
+
+// The matrix the entity is drawn with. This differs from entity_matrix for entities which are interpolated between physics steps.
+mat4x4 entity_render_matrix(Entity *entity)
+{
+    if (!entity->interpolated) return entity_matrix(entity);
+    return transform_matrix(entity->render_orientation, entity->render_position, entity->scale, entity->center);
+}
+
 mat3x3 entity_orientation(Entity *entity)
 {
     if (entity->euler_controlled) return euler_rotation_mat3x3(X(entity->euler_angles), Y(entity->euler_angles), Z(entity->euler_angles));
@@ -69,9 +86,8 @@ mat3x3 entity_orientation(Entity *entity)
 Entity *add_entity(vec3 position, vec3 euler_angles)
 {
     if (entity_list_length == entity_list_size) {
-        entity_list_size *= 2;
-        entity_list = realloc(entity_list, entity_list_size);
-        mem_check(entity_list);
+        fprintf(stderr, "ERROR: The maximum number of entities is %d.\n", MAX_NUM_ENTITIES);
+        exit(EXIT_FAILURE);
     }
     Entity *e = &entity_list[entity_list_length ++];
     memset(e, 0, sizeof(Entity));
@@ -91,9 +107,8 @@ Behaviour *add_behaviour(Entity *entity, EntityUpdate update, size_t data_size,
     }
     BehaviourList *list = &behaviour_lists[type];
     if (list->length == list->size) {
-        list->size *= 2;
-        list->list = realloc(list->list, list->size);
-        mem_check(list->list);
+        fprintf(stderr, "ERROR: The maximum number of behaviours of a type is %d.\n", MAX_NUM_BEHAVIOURS);
+        exit(EXIT_FAILURE);
     }
     Behaviour *b = &list->list[list->length ++];
     b->entity = entity;
@@ -112,7 +127,7 @@ Behaviour *add_behaviour(Entity *entity, EntityUpdate update, size_t data_size,
 
 void prepare_entity_matrix(Entity *entity)
 {
-    mat4x4 matrix = entity_matrix(entity);
+    mat4x4 matrix = entity_render_matrix(entity);
     glMatrixMode(GL_MODELVIEW);
     glLoadMatrixf(view_matrix.vals);
     glMultMatrixf(matrix.vals);
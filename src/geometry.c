@@ -1,4 +1,7 @@
 #include "museum.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 vec3 *random_points(float radius, int n)
 {
@@ -42,8 +45,7 @@ float tetrahedron_6_times_volume(vec3 a, vec3 b, vec3 c, vec3 d)
     b1 = a.vals[1]; b2 = b.vals[1]; b3 = c.vals[1]; b4 = d.vals[1];
     float c1,c2,c3,c4;
     c1 = a.vals[2]; c2 = b.vals[2]; c3 = c.vals[2]; c4 = d.vals[2];
-    float d1,d2,d3,d4;
-    d1 = a.vals[3]; d2 = b.vals[3]; d3 = c.vals[3]; d4 = d.vals[3];
+    // The fourth row of the determinant is all ones.
 
     return a1*(b2*(c3-c4) - b3*(c2-c4) + b4*(c2-c3))
          - a2*(b1*(c3-c4) - b3*(c1-c4) + b4*(c1-c3))
@@ -63,7 +65,7 @@ vec3 closest_point_on_line_to_point(vec3 a, vec3 b, vec3 p)
 }
 vec3 closest_point_on_line_segment_to_point(vec3 a, vec3 b, vec3 p)
 {
-    if (vec3_dot(vec3_sub(p, a), vec3_sub(b, a)) < 0) {
+    if (vec3_dot(vec3_sub(p, a), vec3_sub(b, a)) <= 0) {
         return a;
     }
     if (vec3_dot(vec3_sub(p, b), vec3_sub(a, b)) < 0) {
@@ -72,6 +74,45 @@ vec3 closest_point_on_line_segment_to_point(vec3 a, vec3 b, vec3 p)
     return closest_point_on_line_to_point(a, b, p);
 }
 
+// Find the closest pair of points on the line segments a1-b1 and a2-b2, either of which can be a single point.
+void closest_points_on_line_segments(vec3 a1, vec3 b1, vec3 a2, vec3 b2, vec3 *p1, vec3 *p2)
+{
+    vec3 d1 = vec3_sub(b1, a1);
+    vec3 d2 = vec3_sub(b2, a2);
+    vec3 r = vec3_sub(a1, a2);
+    float l1 = vec3_dot(d1, d1);
+    float l2 = vec3_dot(d2, d2);
+    float f = vec3_dot(d2, r);
+    float s, t;
+    if (l1 <= 1e-12 && l2 <= 1e-12) {
+        s = t = 0;
+    } else if (l1 <= 1e-12) {
+        s = 0;
+        t = MAX(0, MIN(1, f / l2));
+    } else {
+        float c = vec3_dot(d1, r);
+        if (l2 <= 1e-12) {
+            t = 0;
+            s = MAX(0, MIN(1, -c / l1));
+        } else {
+            // Minimize over the line of the first segment, clamp, then find the closest point on the second segment and clamp back if needed.
+            float b = vec3_dot(d1, d2);
+            float denom = l1*l2 - b*b;
+            s = denom > 1e-12 * l1*l2 ? MAX(0, MIN(1, (b*f - c*l2) / denom)) : 0;
+            t = (b*s + f) / l2;
+            if (t < 0) {
+                t = 0;
+                s = MAX(0, MIN(1, -c / l1));
+            } else if (t > 1) {
+                t = 1;
+                s = MAX(0, MIN(1, (b - c) / l1));
+            }
+        }
+    }
+    *p1 = vec3_add(a1, vec3_mul(d1, s));
+    *p2 = vec3_add(a2, vec3_mul(d2, t));
+}
+
 vec3 barycentric_triangle(vec3 a, vec3 b, vec3 c, float wa, float wb, float wc)
 {
     return vec3_mul(vec3_add(vec3_mul(a, wa), vec3_add(vec3_mul(b, wb), vec3_mul(c, wc))), 1.0/(wa + wb + wc));
@@ -109,20 +150,20 @@ vec3 closest_point_on_triangle_to_point(vec3 a, vec3 b, vec3 c, vec3 p)
     vec3 w = point_to_triangle_plane_barycentric(a, b, c, p);
     float wa,wb,wc;
     wa = w.vals[0]; wb = w.vals[1]; wc = w.vals[2];
-    if (wa < 0) {
-       if (vec3_dot(vec3_sub(p, b), vec3_sub(c, b)) < 0) return b;
-       if (vec3_dot(vec3_sub(p, c), vec3_sub(b, c)) < 0) return c;
-       return closest_point_on_line_to_point(b, c, p);
-    }
-    if (wb < 0) {
-       if (vec3_dot(vec3_sub(p, c), vec3_sub(a, c)) < 0) return c;
-       if (vec3_dot(vec3_sub(p, a), vec3_sub(c, a)) < 0) return a;
-       return closest_point_on_line_to_point(c, a, p);
-    }
-    if (wc < 0) {
-        if (vec3_dot(vec3_sub(p, a), vec3_sub(b, a)) < 0) return a;
-        if (vec3_dot(vec3_sub(p, b), vec3_sub(a, b)) < 0) return b;
-        return closest_point_on_line_to_point(a, b, p);
+    if (!isfinite(wa + wb + wc) || wa < 0 || wb < 0 || wc < 0) {
+        // The projection is outside of the triangle, so the closest point is on an edge opposite a negative coordinate. The projection can be
+        // outside of two edges, so both are tested. If the triangle is degenerate, it has no barycentric coordinates, so all edges are tested.
+        bool degenerate = !isfinite(wa + wb + wc);
+        vec3 edge_points[3];
+        int num_edge_points = 0;
+        if (degenerate || wa < 0) edge_points[num_edge_points++] = closest_point_on_line_segment_to_point(b, c, p);
+        if (degenerate || wb < 0) edge_points[num_edge_points++] = closest_point_on_line_segment_to_point(c, a, p);
+        if (degenerate || wc < 0) edge_points[num_edge_points++] = closest_point_on_line_segment_to_point(a, b, p);
+        int closest = 0;
+        for (int i = 1; i < num_edge_points; i++) {
+            if (vec3_dot(vec3_sub(edge_points[i], p), vec3_sub(edge_points[i], p)) < vec3_dot(vec3_sub(edge_points[closest], p), vec3_sub(edge_points[closest], p))) closest = i;
+        }
+        return edge_points[closest];
     }
     return barycentric_triangle(a,b,c, wa,wb,wc);
 }
@@ -328,29 +369,104 @@ Polyhedron new_polyhedron(void)
     return poly;
 }
 
+/*--------------------------------------------------------------------------------
+    Feature allocation.
+    Each feature type has a pool of slabs, which start small so that small polyhedra stay small, and grow geometrically up to
+    a limit. A removed feature is pushed onto the free list of its pool (reusing its prev pointer as the link, as it is no
+    longer in a list), and the next feature of that type is taken from there before the current slab.
+--------------------------------------------------------------------------------*/
+#define POLYHEDRON_SLAB_MIN_FEATURES 16
+#define POLYHEDRON_SLAB_MAX_FEATURES 4096
+typedef struct PolyhedronSlab_s {
+    struct PolyhedronSlab_s *next;
+    size_t num_features; // this also pads the header so that the features after it are aligned.
+} PolyhedronSlab;
+typedef struct PolyhedronPool_s {
+    PolyhedronSlab *slabs; // the first slab is the one currently being filled.
+    size_t num_used;
+    void *free_list;
+} PolyhedronPool;
+typedef struct PolyhedronArena_s {
+    PolyhedronPool points;
+    PolyhedronPool edges;
+    PolyhedronPool triangles;
+} PolyhedronArena;
+
+static PolyhedronArena *polyhedron_arena(Polyhedron *poly)
+{
+    if (poly->arena == NULL) {
+        poly->arena = calloc(1, sizeof(PolyhedronArena));
+        mem_check(poly->arena);
+    }
+    return poly->arena;
+}
+static void *pool_alloc(PolyhedronPool *pool, size_t feature_size)
+{
+    void *feature;
+    if (pool->free_list != NULL) {
+        feature = pool->free_list;
+        pool->free_list = *((void **) feature);
+    } else {
+        if (pool->slabs == NULL || pool->num_used == pool->slabs->num_features) {
+            size_t num_features = pool->slabs == NULL ? POLYHEDRON_SLAB_MIN_FEATURES : MIN(2 * pool->slabs->num_features, POLYHEDRON_SLAB_MAX_FEATURES);
+            PolyhedronSlab *slab = malloc(sizeof(PolyhedronSlab) + num_features * feature_size);
+            mem_check(slab);
+            slab->next = pool->slabs;
+            slab->num_features = num_features;
+            pool->slabs = slab;
+            pool->num_used = 0;
+        }
+        feature = ((uint8_t *) (pool->slabs + 1)) + feature_size * pool->num_used++;
+    }
+    memset(feature, 0, feature_size);
+    return feature;
+}
+static void pool_free(PolyhedronPool *pool, void *feature)
+{
+    *((void **) feature) = pool->free_list;
+    pool->free_list = feature;
+}
+static void pool_destroy(PolyhedronPool *pool)
+{
+    PolyhedronSlab *slab = pool->slabs;
+    while (slab != NULL) {
+        PolyhedronSlab *next = slab->next;
+        free(slab);
+        slab = next;
+    }
+}
+void polyhedron_destroy(Polyhedron *poly)
+{
+    if (poly->arena != NULL) {
+        pool_destroy(&poly->arena->points);
+        pool_destroy(&poly->arena->edges);
+        pool_destroy(&poly->arena->triangles);
+        free(poly->arena);
+    }
+    *poly = new_polyhedron();
+}
 
 PolyhedronPoint *polyhedron_add_point(Polyhedron *polyhedron, vec3 point)
 {
-    PolyhedronPoint *p = calloc(1, sizeof(PolyhedronPoint));
-    mem_check(p);
+    PolyhedronPoint *p = pool_alloc(&polyhedron_arena(polyhedron)->points, sizeof(PolyhedronPoint));
     p->position = point;
     dl_add(&polyhedron->points, p);
+    return p;
 }
 // It is up to the user of the polyhedron structure to maintain the fact that this is really does represent a polyhedron.
 PolyhedronEdge *polyhedron_add_edge(Polyhedron *polyhedron, PolyhedronPoint *p1, PolyhedronPoint *p2)
 {
-    PolyhedronEdge *e = calloc(1, sizeof(PolyhedronEdge));
-    mem_check(e);
+    PolyhedronEdge *e = pool_alloc(&polyhedron_arena(polyhedron)->edges, sizeof(PolyhedronEdge));
     e->a = p1;
     e->b = p2;
     dl_add(&polyhedron->edges, e);
+    return e;
 }
 // Triangles are added through their edges, so these edges must actually form a triangle for this to make sense.
 
 PolyhedronTriangle *polyhedron_add_triangle(Polyhedron *polyhedron, PolyhedronPoint *a, PolyhedronPoint *b, PolyhedronPoint *c, PolyhedronEdge *e1, PolyhedronEdge *e2, PolyhedronEdge *e3)
 {
-    PolyhedronTriangle *t = calloc(1, sizeof(PolyhedronTriangle));
-    mem_check(t);
+    PolyhedronTriangle *t = pool_alloc(&polyhedron_arena(polyhedron)->triangles, sizeof(PolyhedronTriangle));
     // Get three unequal points from the edges (this complication is because in the polyhedron structure, feature ordering does not matter, only adjacency).
     // t->points[0] = e1->a;
     // t->points[1] = e2->a != e1->a ? e2->a : e2->b;
@@ -373,10 +489,12 @@ PolyhedronTriangle *polyhedron_add_triangle(Polyhedron *polyhedron, PolyhedronPo
     e2->triangles[e2->triangles[0] == NULL ? 0 : 1] = t;
     e3->triangles[e3->triangles[0] == NULL ? 0 : 1] = t;
     dl_add(&polyhedron->triangles, t);
+    return t;
 }
 void polyhedron_remove_point(Polyhedron *poly, PolyhedronPoint *p)
 {
-    dl_remove(&poly->points, p);
+    dl_unlink(&poly->points, p);
+    pool_free(&poly->arena->points, p);
 }
 void polyhedron_remove_edge(Polyhedron *poly, PolyhedronEdge *e)
 {
@@ -387,7 +505,8 @@ void polyhedron_remove_edge(Polyhedron *poly, PolyhedronEdge *e)
             if (e->triangles[i]->edges[j] == e) e->triangles[i]->edges[j] = NULL;
         }
     }
-    dl_remove(&poly->edges, e);
+    dl_unlink(&poly->edges, e);
+    pool_free(&poly->arena->edges, e);
 }
 void polyhedron_remove_triangle(Polyhedron *poly, PolyhedronTriangle *t)
 {
@@ -397,7 +516,8 @@ void polyhedron_remove_triangle(Polyhedron *poly, PolyhedronTriangle *t)
             if (t->edges[i] != NULL) if (t->edges[i]->triangles[j] == t) t->edges[i]->triangles[j] = NULL;
         }
     }
-    dl_remove(&poly->triangles, t);
+    dl_unlink(&poly->triangles, t);
+    pool_free(&poly->arena->triangles, t);
 }
 int polyhedron_num_points(Polyhedron *poly)
 {
@@ -468,177 +588,459 @@ void print_polyhedron(Polyhedron *p)
 
 /*================================================================================
     3-dimensional convex hull. Returns the hull as a polyhedron.
+    Both methods grow the hull from a starting tetrahedron of extreme points, and keep the points not added yet in a
+    conflict graph: each is in the conflict list of one triangle which it can see (its outside set, in Quickhull), and a point
+    which can't see any triangle is in the hull and is dropped. The triangles seen by a new point are found by a search
+    outward from its triangle, and only the points in the conflict lists of the removed triangles are given new triangles,
+    out of the cone of new triangles.
+    The incremental method adds the points in a random order, for an expected time of O(n log n). Quickhull adds the
+    furthest point of a triangle's outside set, so that interior points are dropped early.
+    Flat point sets are handled separately, as polygons, segments or single points.
 ================================================================================*/
-// Definitions of marks this algorithm makes on features, during processing.
-#define VISIBLE true
-#define INVISIBLE false
-#define NEEDED 0x1
-#define BOUNDARY 0x2
-Polyhedron convex_hull(vec3 *points, int num_points)
+ConvexHullMethod convex_hull_method = Quickhull;
+
+// Signed distance of the point above the plane of the triangle, taking the anti-clockwise side as below.
+// This has the sign of tetrahedron_6_times_volume, but is found relative to the triangle, so the rounding error scales with the
+// size of the triangle rather than of the coordinates. Otherwise dense point sets give wrong visibility.
+static float triangle_plane_distance(PolyhedronTriangle *t, vec3 p)
+{
+    vec3 a = t->points[0]->position;
+    vec3 n = vec3_cross(vec3_sub(t->points[1]->position, a), vec3_sub(t->points[2]->position, a));
+    float length = sqrt(vec3_dot(n, n));
+    if (length == 0) return 0;
+    return -vec3_dot(vec3_sub(p, a), n) / length;
+}
+// Find up to four points which span the point set, by taking points furthest from each other, then the line, then the plane.
+// Returns the dimension spanned, up to the tolerance, which is the number of the initial points found after the first.
+static int hull_initial_simplex(vec3 *points, int num_points, float epsilon, int initial[4])
+{
+    initial[0] = 0;
+    for (int i = 1; i < num_points; i++) {
+        if (X(points[i]) < X(points[initial[0]])) initial[0] = i;
+    }
+    vec3 a = points[initial[0]];
+    float best = 0;
+    for (int i = 0; i < num_points; i++) {
+        vec3 d = vec3_sub(points[i], a);
+        if (vec3_dot(d, d) > best) { best = vec3_dot(d, d); initial[1] = i; }
+    }
+    if (best <= epsilon * epsilon) return 0;
+    vec3 ab = vec3_sub(points[initial[1]], a);
+    best = 0;
+    for (int i = 0; i < num_points; i++) {
+        vec3 n = vec3_cross(ab, vec3_sub(points[i], a));
+        if (vec3_dot(n, n) > best) { best = vec3_dot(n, n); initial[2] = i; }
+    }
+    if (best <= epsilon * epsilon * vec3_dot(ab, ab)) return 1;
+    vec3 normal = vec3_normalize(vec3_cross(ab, vec3_sub(points[initial[2]], a)));
+    best = 0;
+    for (int i = 0; i < num_points; i++) {
+        float d = ABS(vec3_dot(vec3_sub(points[i], a), normal));
+        if (d > best) { best = d; initial[3] = i; }
+    }
+    return best > epsilon ? 3 : 2;
+}
+
+// The hull of points which span less than three dimensions. A flat set gives its convex polygon, triangulated as a fan
+// and wound anti-clockwise about the normal of the first three points, like a single triangle. A collinear set gives the
+// segment between its extreme points, and coincident points give one point.
+typedef struct FlatHullPoint_s {
+    float x;
+    float y;
+    int index;
+} FlatHullPoint;
+static int compare_flat_hull_points(const void *a, const void *b)
+{
+    const FlatHullPoint *A = (const FlatHullPoint *) a;
+    const FlatHullPoint *B = (const FlatHullPoint *) b;
+    if (A->x != B->x) return A->x < B->x ? -1 : 1;
+    if (A->y != B->y) return A->y < B->y ? -1 : 1;
+    return 0;
+}
+static Polyhedron flat_hull(vec3 *points, int num_points, int dimension, int initial[4], float epsilon)
 {
-    //note: The auxilliary print marks are left as the indices of the points on the hull, if the caller wants these.
     Polyhedron poly = new_polyhedron();
-    if (num_points == 3) {
-        //---Assumes the triangle is non-degenerate.
-        // Returns the triangle as a polyhedron structure.
-        PolyhedronPoint *ps[3];
-        for (int i = 0; i < 3; i++) {
-            ps[i] = polyhedron_add_point(&poly, points[i]);
-            ps[i]->print_mark = i;
-        }
-        PolyhedronEdge *e1 = polyhedron_add_edge(&poly, ps[0], ps[1]);
-        PolyhedronEdge *e2 = polyhedron_add_edge(&poly, ps[1], ps[2]);
-        PolyhedronEdge *e3 = polyhedron_add_edge(&poly, ps[2], ps[0]);
-        polyhedron_add_triangle(&poly, ps[0], ps[1], ps[2], e1, e2, e3);
+    if (dimension == 0) {
+        PolyhedronPoint *p = polyhedron_add_point(&poly, points[initial[0]]);
+        p->print_mark = initial[0];
         return poly;
     }
-    if (num_points < 3) {
-        //--- Currently just returning the points.
-        for (int i = 0; i < num_points; i++) {
-            PolyhedronPoint *p = polyhedron_add_point(&poly, points[i]);
-            p->print_mark = i;
-        }
+    if (dimension == 1) {
+        PolyhedronPoint *a = polyhedron_add_point(&poly, points[initial[0]]);
+        a->print_mark = initial[0];
+        PolyhedronPoint *b = polyhedron_add_point(&poly, points[initial[1]]);
+        b->print_mark = initial[1];
+        polyhedron_add_edge(&poly, a, b);
         return poly;
     }
-    // Start up a polyhedron data structure as a tetrahedron.
-    {
-        PolyhedronPoint *tetrahedron_points[4];
-        for (int i = 0; i < 4; i++) {
-            tetrahedron_points[i] = polyhedron_add_point(&poly, points[i]);
-            tetrahedron_points[i]->print_mark = i;
-        }
-        bool negative = tetrahedron_6_times_volume(points[0], points[1], points[2], points[3]) < 0;
-        if (negative) {
-            // Fix the orientation by swapping two of the points.
-            PolyhedronPoint *temp = tetrahedron_points[0];
-            tetrahedron_points[0] = tetrahedron_points[1];
-            tetrahedron_points[1] = temp;
-        }
-        PolyhedronEdge *e1 = polyhedron_add_edge(&poly, tetrahedron_points[0], tetrahedron_points[1]);
-        PolyhedronEdge *e2 = polyhedron_add_edge(&poly, tetrahedron_points[1], tetrahedron_points[2]);
-        PolyhedronEdge *e3 = polyhedron_add_edge(&poly, tetrahedron_points[2], tetrahedron_points[0]);
-        polyhedron_add_triangle(&poly, tetrahedron_points[0], tetrahedron_points[1], tetrahedron_points[2], e1, e2, e3);
-        PolyhedronEdge *e4 = polyhedron_add_edge(&poly, tetrahedron_points[0], tetrahedron_points[3]);
-        PolyhedronEdge *e5 = polyhedron_add_edge(&poly, tetrahedron_points[1], tetrahedron_points[3]);
-        PolyhedronEdge *e6 = polyhedron_add_edge(&poly, tetrahedron_points[2], tetrahedron_points[3]);
-        polyhedron_add_triangle(&poly, tetrahedron_points[3], tetrahedron_points[1], tetrahedron_points[0], e1, e5, e4);
-        polyhedron_add_triangle(&poly, tetrahedron_points[3], tetrahedron_points[2], tetrahedron_points[1], e2, e6, e5);
-        polyhedron_add_triangle(&poly, tetrahedron_points[3], tetrahedron_points[0], tetrahedron_points[2], e3, e4, e6);
-    }
-    for (int i = 4; i < num_points; i++) {
-        // Clean up the marks for points and edges (not neccessary for triangles, since they are always set).
-        PolyhedronPoint *p = poly.points.first;
-        while (p != NULL) {
-            p->mark = 0;
-            p->saved_edge = NULL;
-            p = p->next;
-        }
-        PolyhedronEdge *e = poly.edges.first;
-        while (e != NULL) { 
-            e->mark = 0;
-            e = e->next;
-        }
-        // For each triangle, mark as visible or invisible from the point of view of the new point.
-        // If none are visible, then this point is in the hull so far, so continue.
-        // Otherwise, use the marks scratched during the triangle checks to remove all visible triangles and
-        // all other uneccessary features.
-        // Then, add a new triangle for each border edge, which is an edge whose adjacent triangles have opposing visibility/invisibility.
-        bool any_visible = false;
-        PolyhedronTriangle *t = poly.triangles.first;
-        while (t != NULL) {
-            float v = tetrahedron_6_times_volume(t->points[0]->position, t->points[1]->position, t->points[2]->position, points[i]);
-            if (v < 0) {
-                t->mark = VISIBLE;
-                any_visible = true;
-            } else {
-                t->mark = INVISIBLE;
-                // mark edges and vertices of this triangle as necessary (they won't be deleted).
-                t->points[0]->mark |= NEEDED;
-                t->points[1]->mark |= NEEDED;
-                t->points[2]->mark |= NEEDED;
-                t->edges[0]->mark |= NEEDED;
-                t->edges[1]->mark |= NEEDED;
-                t->edges[2]->mark |= NEEDED;
-            }
-            t = t->next;
+    vec3 origin = points[initial[0]];
+    vec3 u = vec3_normalize(vec3_sub(points[initial[1]], origin));
+    vec3 normal = vec3_normalize(vec3_cross(u, vec3_sub(points[initial[2]], origin)));
+    if (vec3_dot(vec3_cross(vec3_sub(points[1], points[0]), vec3_sub(points[2], points[0])), normal) < 0) normal = vec3_neg(normal);
+    vec3 v = vec3_cross(normal, u);
+    // Find the polygon in the plane by Andrew's monotone chain. Points on the boundary between two corners (up to the
+    // tolerance) are dropped.
+    FlatHullPoint *flat = malloc(sizeof(FlatHullPoint) * num_points);
+    mem_check(flat);
+    for (int i = 0; i < num_points; i++) {
+        vec3 d = vec3_sub(points[i], origin);
+        flat[i] = (FlatHullPoint) { vec3_dot(d, u), vec3_dot(d, v), i };
+    }
+    qsort(flat, num_points, sizeof(FlatHullPoint), compare_flat_hull_points);
+    float extent = MAX(ABS(flat[0].x), ABS(flat[num_points - 1].x));
+    for (int i = 0; i < num_points; i++) extent = MAX(extent, ABS(flat[i].y));
+    FlatHullPoint *chain = malloc(sizeof(FlatHullPoint) * 2 * num_points);
+    mem_check(chain);
+    #define turn(A,B,C) (((B).x - (A).x)*((C).y - (A).y) - ((B).y - (A).y)*((C).x - (A).x))
+    int k = 0;
+    for (int i = 0; i < num_points; i++) {
+        while (k >= 2 && turn(chain[k - 2], chain[k - 1], flat[i]) <= epsilon * extent) k--;
+        chain[k++] = flat[i];
+    }
+    for (int i = num_points - 2, lower = k + 1; i >= 0; --i) {
+        while (k >= lower && turn(chain[k - 2], chain[k - 1], flat[i]) <= epsilon * extent) k--;
+        chain[k++] = flat[i];
+    }
+    #undef turn
+    int num_corners = k - 1; // The chain ends where it started.
+
+    PolyhedronPoint **polygon = malloc(sizeof(PolyhedronPoint *) * num_corners);
+    mem_check(polygon);
+    PolyhedronEdge **boundary = malloc(sizeof(PolyhedronEdge *) * num_corners);
+    mem_check(boundary);
+    for (int i = 0; i < num_corners; i++) {
+        polygon[i] = polyhedron_add_point(&poly, points[chain[i].index]);
+        polygon[i]->print_mark = chain[i].index;
+    }
+    for (int i = 0; i < num_corners; i++) boundary[i] = polyhedron_add_edge(&poly, polygon[i], polygon[(i + 1) % num_corners]);
+    PolyhedronEdge *diagonal = boundary[0];
+    for (int i = 1; i < num_corners - 1; i++) {
+        PolyhedronEdge *next_diagonal = i == num_corners - 2 ? boundary[num_corners - 1] : polyhedron_add_edge(&poly, polygon[i + 1], polygon[0]);
+        polyhedron_add_triangle(&poly, polygon[0], polygon[i], polygon[i + 1], diagonal, boundary[i], next_diagonal);
+        diagonal = next_diagonal;
+    }
+    free(flat);
+    free(chain);
+    free(polygon);
+    free(boundary);
+    return poly;
+}
+
+// The state of a hull being grown, shared by both methods.
+typedef struct HullBuilder_s {
+    Polyhedron poly;
+    vec3 *points;
+    int num_points;
+    float epsilon;
+    // The conflict graph. Each point is linked into the conflict list of the triangle it sees, or has no triangle.
+    PolyhedronTriangle **conflict_triangles;
+    int *next_conflict;
+    // Features are marked with a stamp for each new point, so no marks need to be cleared.
+    int stamp;
+    // Scratch lists of the features found for each new point. These grow as needed.
+    int scratch_size;
+    PolyhedronTriangle **visible;
+    PolyhedronEdge **horizon;
+    PolyhedronTriangle **cone; // The new triangles, one for each horizon edge.
+    int num_cone;
+    PolyhedronEdge **removed_edges;
+    PolyhedronPoint **removed_points;
+    int pending_size;
+    int *pending;
+} HullBuilder;
+
+// Put the point in the conflict list of the first of the triangles it can see.
+static void hull_assign_conflict(HullBuilder *b, int point, PolyhedronTriangle **triangles, int num_triangles)
+{
+    b->conflict_triangles[point] = NULL;
+    for (int i = 0; i < num_triangles; i++) {
+        if (triangle_plane_distance(triangles[i], b->points[point]) < -b->epsilon) {
+            b->conflict_triangles[point] = triangles[i];
+            b->next_conflict[point] = triangles[i]->first_conflict;
+            triangles[i]->first_conflict = point;
+            return;
         }
-        if (!any_visible) {
-            continue; // The point is in the hull so far.
+    }
+}
+
+static void hull_scratch_reserve(HullBuilder *b, int length)
+{
+    if (length < b->scratch_size) return;
+    b->scratch_size *= 2;
+    b->visible = realloc(b->visible, sizeof(PolyhedronTriangle *) * b->scratch_size);
+    mem_check(b->visible);
+    b->horizon = realloc(b->horizon, sizeof(PolyhedronEdge *) * b->scratch_size);
+    mem_check(b->horizon);
+    b->cone = realloc(b->cone, sizeof(PolyhedronTriangle *) * b->scratch_size);
+    mem_check(b->cone);
+    b->removed_edges = realloc(b->removed_edges, sizeof(PolyhedronEdge *) * 3 * b->scratch_size);
+    mem_check(b->removed_edges);
+    b->removed_points = realloc(b->removed_points, sizeof(PolyhedronPoint *) * 3 * b->scratch_size);
+    mem_check(b->removed_points);
+}
+
+// Start the hull as the tetrahedron of the initial points, and put the other points in the conflict lists of its triangles.
+static void hull_builder_init(HullBuilder *b, vec3 *points, int num_points, int initial[4], float epsilon)
+{
+    memset(b, 0, sizeof(HullBuilder));
+    b->poly = new_polyhedron();
+    b->points = points;
+    b->num_points = num_points;
+    b->epsilon = epsilon;
+    b->scratch_size = 64;
+    b->visible = malloc(sizeof(PolyhedronTriangle *) * b->scratch_size);
+    mem_check(b->visible);
+    b->horizon = malloc(sizeof(PolyhedronEdge *) * b->scratch_size);
+    mem_check(b->horizon);
+    b->cone = malloc(sizeof(PolyhedronTriangle *) * b->scratch_size);
+    mem_check(b->cone);
+    b->removed_edges = malloc(sizeof(PolyhedronEdge *) * 3 * b->scratch_size);
+    mem_check(b->removed_edges);
+    b->removed_points = malloc(sizeof(PolyhedronPoint *) * 3 * b->scratch_size);
+    mem_check(b->removed_points);
+    b->pending_size = 64;
+    b->pending = malloc(sizeof(int) * b->pending_size);
+    mem_check(b->pending);
+
+    Polyhedron *poly = &b->poly;
+    PolyhedronPoint *tetrahedron_points[4];
+    for (int i = 0; i < 4; i++) {
+        tetrahedron_points[i] = polyhedron_add_point(poly, points[initial[i]]);
+        tetrahedron_points[i]->print_mark = initial[i];
+    }
+    bool negative = tetrahedron_6_times_volume(points[initial[0]], points[initial[1]], points[initial[2]], points[initial[3]]) < 0;
+    if (negative) {
+        // Fix the orientation by swapping two of the points.
+        PolyhedronPoint *temp = tetrahedron_points[0];
+        tetrahedron_points[0] = tetrahedron_points[1];
+        tetrahedron_points[1] = temp;
+    }
+    PolyhedronEdge *e1 = polyhedron_add_edge(poly, tetrahedron_points[0], tetrahedron_points[1]);
+    PolyhedronEdge *e2 = polyhedron_add_edge(poly, tetrahedron_points[1], tetrahedron_points[2]);
+    PolyhedronEdge *e3 = polyhedron_add_edge(poly, tetrahedron_points[2], tetrahedron_points[0]);
+    b->cone[0] = polyhedron_add_triangle(poly, tetrahedron_points[0], tetrahedron_points[1], tetrahedron_points[2], e1, e2, e3);
+    PolyhedronEdge *e4 = polyhedron_add_edge(poly, tetrahedron_points[0], tetrahedron_points[3]);
+    PolyhedronEdge *e5 = polyhedron_add_edge(poly, tetrahedron_points[1], tetrahedron_points[3]);
+    PolyhedronEdge *e6 = polyhedron_add_edge(poly, tetrahedron_points[2], tetrahedron_points[3]);
+    b->cone[1] = polyhedron_add_triangle(poly, tetrahedron_points[3], tetrahedron_points[1], tetrahedron_points[0], e1, e5, e4);
+    b->cone[2] = polyhedron_add_triangle(poly, tetrahedron_points[3], tetrahedron_points[2], tetrahedron_points[1], e2, e6, e5);
+    b->cone[3] = polyhedron_add_triangle(poly, tetrahedron_points[3], tetrahedron_points[0], tetrahedron_points[2], e3, e4, e6);
+    b->num_cone = 4;
+    for (int i = 0; i < 4; i++) b->cone[i]->first_conflict = -1;
+
+    b->conflict_triangles = malloc(sizeof(PolyhedronTriangle *) * num_points);
+    mem_check(b->conflict_triangles);
+    b->next_conflict = malloc(sizeof(int) * num_points);
+    mem_check(b->next_conflict);
+    for (int i = 0; i < num_points; i++) {
+        if (i == initial[0] || i == initial[1] || i == initial[2] || i == initial[3]) b->conflict_triangles[i] = NULL;
+        else hull_assign_conflict(b, i, b->cone, 4);
+    }
+}
+
+static void hull_builder_free(HullBuilder *b)
+{
+    free(b->conflict_triangles);
+    free(b->next_conflict);
+    free(b->visible);
+    free(b->horizon);
+    free(b->cone);
+    free(b->removed_edges);
+    free(b->removed_points);
+    free(b->pending);
+}
+
+// Add a point which sees a triangle of the hull, replacing the triangles it sees with a cone from the point to the horizon.
+// The new triangles are left in the cone list.
+static void hull_add_point(HullBuilder *b, int i)
+{
+    Polyhedron *poly = &b->poly;
+    vec3 point = b->points[i];
+    b->stamp ++;
+    // Triangles are marked VISIBLE or INVISIBLE once tested, and kept points and handled edges with VISIBLE.
+    const int VISIBLE = 2*b->stamp;
+    const int INVISIBLE = 2*b->stamp + 1;
+    // Search outward from the point's triangle for the triangles it can see. The edges from these to triangles it can't see
+    // form the horizon. A triangle which is coplanar with the new point (up to rounding) and next to a visible triangle is also
+    // counted as visible. Otherwise, if the point is coplanar with triangles on two sides of a vertex (which happens with
+    // symmetric point sets), the visible triangles do not form a disc and the cone can't be added.
+    int num_visible = 0;
+    int num_horizon = 0;
+    b->conflict_triangles[i]->mark = VISIBLE;
+    b->visible[num_visible++] = b->conflict_triangles[i];
+    for (int j = 0; j < num_visible; j++) {
+        PolyhedronTriangle *t = b->visible[j];
+        for (int l = 0; l < 3; l++) {
+            PolyhedronEdge *e = t->edges[l];
+            PolyhedronTriangle *neighbour = e->triangles[0] == t ? e->triangles[1] : e->triangles[0];
+            if (neighbour->mark == VISIBLE) continue;
+            if (neighbour->mark != INVISIBLE) {
+                if (triangle_plane_distance(neighbour, point) < b->epsilon) {
+                    hull_scratch_reserve(b, num_visible);
+                    neighbour->mark = VISIBLE;
+                    b->visible[num_visible++] = neighbour;
+                    continue;
+                }
+                neighbour->mark = INVISIBLE;
+            }
+            hull_scratch_reserve(b, num_horizon);
+            b->horizon[num_horizon++] = e;
         }
-        // Before deleting anything, use the visibility information to mark the borders. Then when triangles are deleted, the borders are still known.
-        // This could be done more cleanly without looping over features so many times.
-        e = poly.edges.first;
-        while (e != NULL) {
-            if (e->triangles[0]->mark != e->triangles[1]->mark) {
-                e->mark |= BOUNDARY;
+    }
+    // The horizon is kept, and the edges and points of the visible triangles which are not on the horizon are removed.
+    for (int j = 0; j < num_horizon; j++) {
+        b->horizon[j]->mark = VISIBLE;
+        b->horizon[j]->a->mark = VISIBLE;
+        b->horizon[j]->b->mark = VISIBLE;
+        b->horizon[j]->a->saved_edge = NULL;
+        b->horizon[j]->b->saved_edge = NULL;
+    }
+    int num_removed_edges = 0;
+    int num_removed_points = 0;
+    int num_pending = 0;
+    for (int j = 0; j < num_visible; j++) {
+        PolyhedronTriangle *t = b->visible[j];
+        for (int l = 0; l < 3; l++) {
+            if (t->edges[l]->mark != VISIBLE) {
+                t->edges[l]->mark = VISIBLE;
+                b->removed_edges[num_removed_edges++] = t->edges[l];
             }
-            e = e->next;
-        }
-        // Remove all visible triangles (that weren't just added), and unneeded points and edges.
-        t = poly.triangles.first;
-        while (t != NULL) {
-            if (t->mark == VISIBLE) {
-                PolyhedronTriangle *to_remove = t;
-                t = t->next;
-                polyhedron_remove_triangle(&poly, to_remove);
-            } else t = t->next;
-        }
-        e = poly.edges.first;
-        while (e != NULL) {
-            if ((e->mark & NEEDED) == 0) {
-                PolyhedronEdge *to_remove = e;
-                e = e->next;
-                polyhedron_remove_edge(&poly, to_remove);
-                continue;
+            if (t->points[l]->mark != VISIBLE) {
+                t->points[l]->mark = VISIBLE;
+                b->removed_points[num_removed_points++] = t->points[l];
             }
-            e = e->next;
-        }
-        p = poly.points.first;
-        while (p != NULL) {
-            if ((p->mark & NEEDED) == 0) {
-                PolyhedronPoint *to_remove = p;
-                p = p->next;
-                polyhedron_remove_point(&poly, to_remove);
-                continue;
+        }
+        // Take the points which saw this triangle, to give them new triangles.
+        for (int q = t->first_conflict; q >= 0; q = b->next_conflict[q]) {
+            if (q == i) continue;
+            if (num_pending == b->pending_size) {
+                b->pending_size *= 2;
+                b->pending = realloc(b->pending, sizeof(int) * b->pending_size);
+                mem_check(b->pending);
             }
-            p = p->next;
-        }
-        // Add the new point, and new edges and triangles to create a cone from the new point to the border.
-        PolyhedronPoint *new_point = polyhedron_add_point(&poly, points[i]);
-        new_point->print_mark = i;
-        e = poly.edges.first;
-        while (e != NULL) {
-            if ((e->mark & BOUNDARY) != 0) {
-                // Determine whether a->b is in line with the winding of the invisible triangle incident to ab, and adjust accordingly.
-                bool reverse = false;
-                for (int i = 0; i < 2; i++) {
-                    if (e->triangles[i] != NULL) {
-                        for (int j = 0; j < 3; j++) {
-                            if (e->a == e->triangles[i]->points[j] && e->b == e->triangles[i]->points[(j+1)%3]) reverse = true;
-                        }
-                        break;
-                    }
-                }
-                // In winding order, introduce two new edges, unless an edge has already been made.
-                PolyhedronPoint *p1 = reverse ? e->b : e->a;
-                PolyhedronPoint *p2 = reverse ? e->a : e->b;
-                PolyhedronEdge *e1 = p1->saved_edge;
-                if (e1 == NULL) {
-                    e1 = polyhedron_add_edge(&poly, new_point, p1);
-                    p1->saved_edge = e1;
-                }
-                PolyhedronEdge *e2 = p2->saved_edge;
-                if (e2 == NULL) {
-                    e2 = polyhedron_add_edge(&poly, new_point, p2);
-                    p2->saved_edge = e2;
-                }
-                // Use these to form a new triangle.
-                polyhedron_add_triangle(&poly, new_point, p1, p2, e1, e, e2);
+            b->pending[num_pending++] = q;
+        }
+    }
+    for (int j = 0; j < num_visible; j++) polyhedron_remove_triangle(poly, b->visible[j]);
+    for (int j = 0; j < num_removed_edges; j++) polyhedron_remove_edge(poly, b->removed_edges[j]);
+    for (int j = 0; j < num_removed_points; j++) polyhedron_remove_point(poly, b->removed_points[j]);
+
+    // Add the new point, and new edges and triangles to create a cone from the new point to the horizon.
+    PolyhedronPoint *new_point = polyhedron_add_point(poly, point);
+    new_point->print_mark = i;
+    b->conflict_triangles[i] = NULL;
+    for (int j = 0; j < num_horizon; j++) {
+        PolyhedronEdge *e = b->horizon[j];
+        // Determine whether a->b is in line with the winding of the invisible triangle incident to ab, and adjust accordingly.
+        PolyhedronTriangle *kept = e->triangles[0] != NULL ? e->triangles[0] : e->triangles[1];
+        bool reverse = false;
+        for (int l = 0; l < 3; l++) {
+            if (e->a == kept->points[l] && e->b == kept->points[(l+1)%3]) reverse = true;
+        }
+        // In winding order, introduce two new edges, unless an edge has already been made.
+        PolyhedronPoint *p1 = reverse ? e->b : e->a;
+        PolyhedronPoint *p2 = reverse ? e->a : e->b;
+        PolyhedronEdge *e1 = p1->saved_edge;
+        if (e1 == NULL) {
+            e1 = polyhedron_add_edge(poly, new_point, p1);
+            p1->saved_edge = e1;
+        }
+        PolyhedronEdge *e2 = p2->saved_edge;
+        if (e2 == NULL) {
+            e2 = polyhedron_add_edge(poly, new_point, p2);
+            p2->saved_edge = e2;
+        }
+        // Use these to form a new triangle.
+        b->cone[j] = polyhedron_add_triangle(poly, new_point, p1, p2, e1, e, e2);
+        b->cone[j]->first_conflict = -1;
+    }
+    b->num_cone = num_horizon;
+    // A point which saw a removed triangle is either inside the new hull, or sees one of the new triangles.
+    for (int j = 0; j < num_pending; j++) hull_assign_conflict(b, b->pending[j], b->cone, b->num_cone);
+}
+
+static void incremental_hull(HullBuilder *b)
+{
+    // Shuffle the insertion order. A fixed seed is used, so that the same points give the same hull.
+    int *order = malloc(sizeof(int) * b->num_points);
+    mem_check(order);
+    for (int i = 0; i < b->num_points; i++) order[i] = i;
+    uint32_t random_state = 0x9e3779b9;
+    for (int i = b->num_points - 1; i > 0; --i) {
+        random_state ^= random_state << 13;
+        random_state ^= random_state >> 17;
+        random_state ^= random_state << 5;
+        int j = random_state % (i + 1);
+        int temp = order[i];
+        order[i] = order[j];
+        order[j] = temp;
+    }
+    for (int k = 0; k < b->num_points; k++) {
+        // Skip the points in the hull so far, and those on the starting tetrahedron.
+        if (b->conflict_triangles[order[k]] != NULL) hull_add_point(b, order[k]);
+    }
+    free(order);
+}
+
+static void quickhull(HullBuilder *b)
+{
+    // A stack of the furthest points of the new triangles' outside sets. A point is skipped if it was found to be inside
+    // the hull after it was pushed. If it has moved to the outside set of another triangle, it can still be added.
+    int stack_size = 64;
+    int *stack = malloc(sizeof(int) * stack_size);
+    mem_check(stack);
+    int stack_length = 0;
+    while (1) {
+        for (int i = 0; i < b->num_cone; i++) {
+            PolyhedronTriangle *t = b->cone[i];
+            int furthest = -1;
+            float furthest_distance = 0;
+            for (int q = t->first_conflict; q >= 0; q = b->next_conflict[q]) {
+                float d = -triangle_plane_distance(t, b->points[q]);
+                if (d > furthest_distance) { furthest_distance = d; furthest = q; }
+            }
+            if (furthest < 0) continue;
+            if (stack_length == stack_size) {
+                stack_size *= 2;
+                stack = realloc(stack, sizeof(int) * stack_size);
+                mem_check(stack);
             }
-            e = e->next;
+            stack[stack_length++] = furthest;
+        }
+        b->num_cone = 0;
+        int next = -1;
+        while (stack_length > 0 && next < 0) {
+            int q = stack[--stack_length];
+            if (b->conflict_triangles[q] != NULL) next = q;
         }
+        if (next < 0) break;
+        hull_add_point(b, next);
     }
-    return poly;
+    free(stack);
+}
+
+Polyhedron convex_hull(vec3 *points, int num_points)
+{
+    //note: The auxilliary print marks are left as the indices of the points on the hull, if the caller wants these.
+    if (num_points == 0) return new_polyhedron();
+    // Tolerance for the distance of coplanar points from triangle planes, relative to the size of the point set.
+    float size = 0;
+    for (int i = 0; i < num_points; i++) {
+        for (int j = 0; j < 3; j++) {
+            if (ABS(points[i].vals[j]) > size) size = ABS(points[i].vals[j]);
+        }
+    }
+    float epsilon = 1e-6 * size;
+    int initial[4];
+    int dimension = hull_initial_simplex(points, num_points, epsilon, initial);
+    if (dimension < 3) return flat_hull(points, num_points, dimension, initial, epsilon);
+
+    HullBuilder builder;
+    hull_builder_init(&builder, points, num_points, initial, epsilon);
+    if (convex_hull_method == Quickhull) quickhull(&builder);
+    else incremental_hull(&builder);
+    hull_builder_free(&builder);
+    return builder.poly;
 }
 
 
@@ -646,16 +1048,14 @@ bool point_in_convex_polyhedron(vec3 p, Polyhedron poly)
 {
     // Uses "visibility" from the point. If any triangle is visible (as in, from the point of view of the point, the triangle is non-degenerate and in anti-clockwise order),
     // then the point is outside the convex polyhedron.
-    bool any_visible = false;
+    // To test many points against one polyhedron, use the planes from polyhedron_planes instead.
     PolyhedronTriangle *t = poly.triangles.first;
     while (t != NULL) {
         float v = tetrahedron_6_times_volume(t->points[0]->position, t->points[1]->position, t->points[2]->position, p);
-        if (v < 0) {
-            any_visible = true;
-        }
+        if (v < 0) return false;
         t = t->next;
     }
-    return !any_visible;
+    return true;
 }
 
 float polyhedron_volume(Polyhedron poly)
@@ -724,6 +1124,451 @@ vec3 polyhedron_center_of_mass(Polyhedron poly)
     return center_of_mass;
 }
 
+mat3x3 brute_force_polyhedron_inertia_tensor(Polyhedron poly, vec3 center, float mass)
+{
+    float integrals[6] = {0}; // x^2, y^2, z^2, xy, xz, yz
+    float volume = 0;
+
+    PolyhedronPoint *point = poly.points.first;
+    vec3 min = point->position;
+    vec3 max = point->position;
+    while (point != NULL) {
+        for (int i = 0; i < 3; i++) {
+            if (point->position.vals[i] < min.vals[i]) min.vals[i] = point->position.vals[i];
+            if (point->position.vals[i] > max.vals[i]) max.vals[i] = point->position.vals[i];
+        }
+        point = point->next;
+    }
+    float min_extent = MIN(max.vals[0] - min.vals[0], max.vals[1] - min.vals[1]);
+    min_extent = MIN(min_extent, max.vals[2] - min.vals[2]);
+    float d = 0.05 * min_extent;
+    float dcubed = d*d*d;
+
+    // The grid points are classified a row along z at a time.
+    ConvexPlanes planes = polyhedron_planes(poly);
+    int row_capacity = (max.vals[2] - min.vals[2]) / d + 3;
+    vec3 *row = malloc(sizeof(vec3) * row_capacity);
+    mem_check(row);
+    bool *inside = malloc(sizeof(bool) * row_capacity);
+    mem_check(inside);
+    for (float x = min.vals[0]; x <= max.vals[0]; x += d) {
+        for (float y = min.vals[1]; y <= max.vals[1]; y += d) {
+            int num_row_points = 0;
+            for (float z = min.vals[2]; z <= max.vals[2] && num_row_points < row_capacity; z += d) {
+                row[num_row_points++] = new_vec3(x,y,z);
+            }
+            if (points_in_convex_planes(row, num_row_points, &planes, inside) == 0) continue;
+            for (int i = 0; i < num_row_points; i++) {
+                if (!inside[i]) continue;
+                volume += dcubed;
+                float xc = x - center.vals[0];
+                float yc = y - center.vals[1];
+                float zc = row[i].vals[2] - center.vals[2];
+                integrals[0] += xc*xc * dcubed;
+                integrals[1] += yc*yc * dcubed;
+                integrals[2] += zc*zc * dcubed;
+                integrals[3] += xc*yc * dcubed;
+                integrals[4] += xc*zc * dcubed;
+                integrals[5] += yc*zc * dcubed;
+            }
+        }
+    }
+    free(row);
+    free(inside);
+    convex_planes_destroy(&planes);
+    float inverse_volume = volume == 0 ? 0 : 1.0 / volume;
+    mat3x3 inertia_tensor;
+    fill_mat3x3_rmaj(inertia_tensor, integrals[1]+integrals[2], -integrals[3], -integrals[4],
+                                 -integrals[3], integrals[0]+integrals[2], -integrals[5],
+                                 -integrals[4], -integrals[5], integrals[0]+integrals[1]);
+    for (int i = 0; i < 9; i++) {
+        inertia_tensor.vals[i] *= inverse_volume * mass;
+    }
+    return inertia_tensor;
+}
+
+/*--------------------------------------------------------------------------------
+    Mass properties of a solid polyhedron of uniform density.
+    The volume integrals of 1, x, y, z, x^2, y^2, z^2, xy, yz, zx are converted to integrals over the boundary
+    by the divergence theorem, and these are computed exactly over each triangle in closed form.
+    See Eberly, Polyhedral Mass Properties (Revisited), which simplifies Mirtich, Fast and Accurate Computation of Polyhedral Mass Properties.
+--------------------------------------------------------------------------------*/
+static void mass_properties_subexpressions(float w0, float w1, float w2, float *f1, float *f2, float *f3, float *g0, float *g1, float *g2)
+{
+    float temp0 = w0 + w1;
+    *f1 = temp0 + w2;
+    float temp1 = w0 * w0;
+    float temp2 = temp1 + w1 * temp0;
+    *f2 = temp2 + w2 * (*f1);
+    *f3 = w0 * temp1 + w1 * temp2 + w2 * (*f2);
+    *g0 = *f2 + w0 * (*f1 + w0);
+    *g1 = *f2 + w1 * (*f1 + w1);
+    *g2 = *f2 + w2 * (*f1 + w2);
+}
+void polyhedron_mass_properties(Polyhedron poly, float mass, float *volume, vec3 *center_of_mass, mat3x3 *inertia_tensor)
+{
+    // The integrals are taken relative to a point on the polyhedron, to reduce rounding error for polyhedra far from the origin.
+    vec3 origin = poly.points.first->position;
+    float integrals[10] = {0}; // 1, x, y, z, x^2, y^2, z^2, xy, yz, zx
+    PolyhedronTriangle *t = poly.triangles.first;
+    while (t != NULL) {
+        vec3 p0 = vec3_sub(t->points[0]->position, origin);
+        vec3 p1 = vec3_sub(t->points[1]->position, origin);
+        vec3 p2 = vec3_sub(t->points[2]->position, origin);
+        vec3 d = vec3_cross(vec3_sub(p1, p0), vec3_sub(p2, p0));
+        float f1x, f2x, f3x, g0x, g1x, g2x;
+        float f1y, f2y, f3y, g0y, g1y, g2y;
+        float f1z, f2z, f3z, g0z, g1z, g2z;
+        mass_properties_subexpressions(X(p0), X(p1), X(p2), &f1x, &f2x, &f3x, &g0x, &g1x, &g2x);
+        mass_properties_subexpressions(Y(p0), Y(p1), Y(p2), &f1y, &f2y, &f3y, &g0y, &g1y, &g2y);
+        mass_properties_subexpressions(Z(p0), Z(p1), Z(p2), &f1z, &f2z, &f3z, &g0z, &g1z, &g2z);
+        integrals[0] += X(d) * f1x;
+        integrals[1] += X(d) * f2x;
+        integrals[2] += Y(d) * f2y;
+        integrals[3] += Z(d) * f2z;
+        integrals[4] += X(d) * f3x;
+        integrals[5] += Y(d) * f3y;
+        integrals[6] += Z(d) * f3z;
+        integrals[7] += X(d) * (Y(p0)*g0x + Y(p1)*g1x + Y(p2)*g2x);
+        integrals[8] += Y(d) * (Z(p0)*g0y + Z(p1)*g1y + Z(p2)*g2y);
+        integrals[9] += Z(d) * (X(p0)*g0z + X(p1)*g1z + X(p2)*g2z);
+        t = t->next;
+    }
+    const float factors[10] = {1.0/6, 1.0/24, 1.0/24, 1.0/24, 1.0/60, 1.0/60, 1.0/60, 1.0/120, 1.0/120, 1.0/120};
+    for (int i = 0; i < 10; i++) integrals[i] *= factors[i];
+
+    // The volume is signed by the winding order of the triangles, but the division by it below cancels the sign.
+    float v = integrals[0];
+    vec3 c = new_vec3(integrals[1] / v, integrals[2] / v, integrals[3] / v);
+    // Translate the second moments to the center of mass, and scale them by the density.
+    float density = mass / v;
+    float xx = density * (integrals[4] - v*X(c)*X(c));
+    float yy = density * (integrals[5] - v*Y(c)*Y(c));
+    float zz = density * (integrals[6] - v*Z(c)*Z(c));
+    float xy = density * (integrals[7] - v*X(c)*Y(c));
+    float yz = density * (integrals[8] - v*Y(c)*Z(c));
+    float zx = density * (integrals[9] - v*Z(c)*X(c));
+    fill_mat3x3_rmaj(*inertia_tensor, yy + zz, -xy, -zx,
+                                      -xy, xx + zz, -yz,
+                                      -zx, -yz, xx + yy);
+    *volume = ABS(v);
+    *center_of_mass = vec3_add(c, origin);
+}
+
+/*--------------------------------------------------------------------------------
+    Half-edge meshes.
+--------------------------------------------------------------------------------*/
+HalfEdgeMesh new_half_edge_mesh(int num_vertices, int num_triangles)
+{
+    if (num_vertices < 0 || num_triangles < 0) {
+        fprintf(stderr, "ERROR: new_half_edge_mesh: Invalid number of vertices (%d) or triangles (%d).\n", num_vertices, num_triangles);
+        exit(EXIT_FAILURE);
+    }
+    HalfEdgeMesh mesh = {0};
+    mesh.num_vertices = num_vertices;
+    mesh.num_triangles = num_triangles;
+    size_t size = sizeof(vec3) * num_vertices + sizeof(uint32_t) * (6 * num_triangles + num_vertices);
+    uint8_t *data = malloc(MAX(size, 1));
+    mem_check(data);
+    mesh.positions = (vec3 *) data;
+    mesh.origins = (uint32_t *) (mesh.positions + num_vertices);
+    mesh.twins = mesh.origins + 3 * num_triangles;
+    mesh.vertex_half_edges = mesh.twins + 3 * num_triangles;
+    return mesh;
+}
+
+void half_edge_mesh_destroy(HalfEdgeMesh *mesh)
+{
+    free(mesh->positions);
+    memset(mesh, 0, sizeof(HalfEdgeMesh));
+}
+
+void half_edge_mesh_link_twins(HalfEdgeMesh *mesh)
+{
+    // The half-edges are bucketed by their origin with a counting sort. The twin of a half-edge from a to b is then found
+    // by searching only the half-edges leaving b.
+    uint32_t num_vertices = mesh->num_vertices;
+    uint32_t num_half_edges = 3 * mesh->num_triangles;
+    uint32_t *bucket_starts = calloc(num_vertices + 1, sizeof(uint32_t));
+    mem_check(bucket_starts);
+    uint32_t *buckets = malloc(sizeof(uint32_t) * MAX(num_half_edges, 1));
+    mem_check(buckets);
+    for (uint32_t h = 0; h < num_half_edges; h++) {
+        if (mesh->origins[h] >= num_vertices) {
+            fprintf(stderr, "ERROR: half_edge_mesh_link_twins: Half-edge %u has an invalid origin %u.\n", h, mesh->origins[h]);
+            exit(EXIT_FAILURE);
+        }
+        bucket_starts[mesh->origins[h] + 1] ++;
+    }
+    for (uint32_t i = 0; i < num_vertices; i++) bucket_starts[i + 1] += bucket_starts[i];
+    // Filling the buckets moves each start to the start of the next bucket, so they are shifted back afterward.
+    for (uint32_t h = 0; h < num_half_edges; h++) buckets[bucket_starts[mesh->origins[h]]++] = h;
+    for (uint32_t i = num_vertices; i > 0; --i) bucket_starts[i] = bucket_starts[i - 1];
+    bucket_starts[0] = 0;
+
+    for (uint32_t i = 0; i < num_vertices; i++) {
+        mesh->vertex_half_edges[i] = bucket_starts[i] < bucket_starts[i + 1] ? buckets[bucket_starts[i]] : HALF_EDGE_NONE;
+    }
+    for (uint32_t h = 0; h < num_half_edges; h++) mesh->twins[h] = HALF_EDGE_NONE;
+    for (uint32_t h = 0; h < num_half_edges; h++) {
+        if (mesh->twins[h] != HALF_EDGE_NONE) continue;
+        uint32_t a = mesh->origins[h];
+        uint32_t b = mesh->origins[half_edge_next(h)];
+        for (uint32_t i = bucket_starts[b]; i < bucket_starts[b + 1]; i++) {
+            uint32_t g = buckets[i];
+            if (g != h && mesh->twins[g] == HALF_EDGE_NONE && mesh->origins[half_edge_next(g)] == a) {
+                mesh->twins[h] = g;
+                mesh->twins[g] = h;
+                break;
+            }
+        }
+    }
+    free(bucket_starts);
+    free(buckets);
+}
+
+HalfEdgeMesh polyhedron_to_half_edge_mesh(Polyhedron poly)
+{
+    // The point marks are used for the vertex indices.
+    int num_vertices = 0;
+    int num_triangles = 0;
+    PolyhedronPoint *p = poly.points.first;
+    while (p != NULL) {
+        p->mark = num_vertices++;
+        p = p->next;
+    }
+    PolyhedronTriangle *t = poly.triangles.first;
+    while (t != NULL) {
+        num_triangles ++;
+        t = t->next;
+    }
+    HalfEdgeMesh mesh = new_half_edge_mesh(num_vertices, num_triangles);
+    p = poly.points.first;
+    while (p != NULL) {
+        mesh.positions[p->mark] = p->position;
+        p = p->next;
+    }
+    t = poly.triangles.first;
+    uint32_t h = 0;
+    while (t != NULL) {
+        for (int i = 0; i < 3; i++) mesh.origins[h++] = t->points[i]->mark;
+        t = t->next;
+    }
+    half_edge_mesh_link_twins(&mesh);
+    return mesh;
+}
+
+// The print marks of the points are left as their vertex indices.
+Polyhedron half_edge_mesh_to_polyhedron(HalfEdgeMesh *mesh)
+{
+    Polyhedron poly = new_polyhedron();
+    uint32_t num_half_edges = 3 * mesh->num_triangles;
+    PolyhedronPoint **points = malloc(sizeof(PolyhedronPoint *) * MAX(mesh->num_vertices, 1));
+    mem_check(points);
+    PolyhedronEdge **edges = malloc(sizeof(PolyhedronEdge *) * MAX(num_half_edges, 1));
+    mem_check(edges);
+    for (int i = 0; i < mesh->num_vertices; i++) {
+        points[i] = polyhedron_add_point(&poly, mesh->positions[i]);
+        points[i]->print_mark = i;
+    }
+    // Each pair of twins shares one edge, which is added for the first of the two.
+    for (uint32_t h = 0; h < num_half_edges; h++) {
+        uint32_t twin = mesh->twins[h];
+        if (twin != HALF_EDGE_NONE && twin < h) continue;
+        edges[h] = polyhedron_add_edge(&poly, points[mesh->origins[h]], points[mesh->origins[half_edge_next(h)]]);
+        if (twin != HALF_EDGE_NONE) edges[twin] = edges[h];
+    }
+    for (int i = 0; i < mesh->num_triangles; i++) {
+        uint32_t *origins = &mesh->origins[3*i];
+        polyhedron_add_triangle(&poly, points[origins[0]], points[origins[1]], points[origins[2]], edges[3*i], edges[3*i+1], edges[3*i+2]);
+    }
+    poly.num_points = mesh->num_vertices;
+    poly.num_edges = -1;
+    poly.num_triangles = mesh->num_triangles;
+    free(points);
+    free(edges);
+    return poly;
+}
+
+bool point_in_convex_half_edge_mesh(vec3 p, HalfEdgeMesh *mesh)
+{
+    // As for polyhedra, the point is outside if it can see any triangle.
+    for (int i = 0; i < mesh->num_triangles; i++) {
+        uint32_t *origins = &mesh->origins[3*i];
+        vec3 a = mesh->positions[origins[0]];
+        vec3 b = mesh->positions[origins[1]];
+        vec3 c = mesh->positions[origins[2]];
+        if (tetrahedron_6_times_volume(a, b, c, p) < 0) return false;
+    }
+    return true;
+}
+
+float half_edge_mesh_volume(HalfEdgeMesh *mesh)
+{
+    float volume = 0.0;
+    vec3 zero = vec3_zero();
+    for (int i = 0; i < mesh->num_triangles; i++) {
+        uint32_t *origins = &mesh->origins[3*i];
+        vec3 a = mesh->positions[origins[0]];
+        vec3 b = mesh->positions[origins[1]];
+        vec3 c = mesh->positions[origins[2]];
+        volume += tetrahedron_6_times_volume(a, b, c, zero);
+    }
+    return volume / 6.0;
+}
+
+vec3 half_edge_mesh_extreme_point(HalfEdgeMesh *mesh, vec3 direction)
+{
+    if (mesh->num_vertices == 0) {
+        fprintf(stderr, "ERROR: half_edge_mesh_extreme_point: Need at least one vertex.\n");
+        exit(EXIT_FAILURE);
+    }
+    int index = 0;
+    float d = vec3_dot(mesh->positions[0], direction);
+    for (int i = 1; i < mesh->num_vertices; i++) {
+        float new_d = vec3_dot(mesh->positions[i], direction);
+        if (new_d > d) {
+            d = new_d;
+            index = i;
+        }
+    }
+    return mesh->positions[index];
+}
+
+/*--------------------------------------------------------------------------------
+    Face planes of convex polyhedra.
+--------------------------------------------------------------------------------*/
+static ConvexPlanes new_convex_planes(int max_num_planes)
+{
+    ConvexPlanes planes = {0};
+    planes.num_padded_planes = (max_num_planes + 3) & ~3;
+    planes.nxs = malloc(sizeof(float) * 4 * MAX(planes.num_padded_planes, 1));
+    mem_check(planes.nxs);
+    planes.nys = planes.nxs + planes.num_padded_planes;
+    planes.nzs = planes.nys + planes.num_padded_planes;
+    planes.offsets = planes.nzs + planes.num_padded_planes;
+    return planes;
+}
+static void convex_planes_add(ConvexPlanes *planes, vec3 a, vec3 b, vec3 c)
+{
+    vec3 normal = vec3_cross(vec3_sub(b, a), vec3_sub(c, a));
+    float length = vec3_length(normal);
+    if (length == 0) return;
+    normal = vec3_mul(normal, 1.0 / length);
+    planes->nxs[planes->num_planes] = X(normal);
+    planes->nys[planes->num_planes] = Y(normal);
+    planes->nzs[planes->num_planes] = Z(normal);
+    planes->offsets[planes->num_planes++] = vec3_dot(normal, a);
+}
+// Pad with zero planes, which every point is on, so the last block of four can be tested like the others.
+static void convex_planes_pad(ConvexPlanes *planes)
+{
+    planes->num_padded_planes = (planes->num_planes + 3) & ~3;
+    for (int i = planes->num_planes; i < planes->num_padded_planes; i++) {
+        planes->nxs[i] = 0;
+        planes->nys[i] = 0;
+        planes->nzs[i] = 0;
+        planes->offsets[i] = 0;
+    }
+}
+
+ConvexPlanes polyhedron_planes(Polyhedron poly)
+{
+    int num_triangles = 0;
+    PolyhedronTriangle *t = poly.triangles.first;
+    while (t != NULL) {
+        num_triangles ++;
+        t = t->next;
+    }
+    ConvexPlanes planes = new_convex_planes(num_triangles);
+    t = poly.triangles.first;
+    while (t != NULL) {
+        convex_planes_add(&planes, t->points[0]->position, t->points[1]->position, t->points[2]->position);
+        t = t->next;
+    }
+    convex_planes_pad(&planes);
+    return planes;
+}
+
+ConvexPlanes half_edge_mesh_planes(HalfEdgeMesh *mesh)
+{
+    ConvexPlanes planes = new_convex_planes(mesh->num_triangles);
+    for (int i = 0; i < mesh->num_triangles; i++) {
+        uint32_t *origins = &mesh->origins[3*i];
+        convex_planes_add(&planes, mesh->positions[origins[0]], mesh->positions[origins[1]], mesh->positions[origins[2]]);
+    }
+    convex_planes_pad(&planes);
+    return planes;
+}
+
+void convex_planes_destroy(ConvexPlanes *planes)
+{
+    free(planes->nxs);
+    memset(planes, 0, sizeof(ConvexPlanes));
+}
+
+bool point_in_convex_planes(vec3 p, ConvexPlanes *planes)
+{
+#ifdef __SSE2__
+    // Test four planes at a time.
+    __m128 px = _mm_set1_ps(X(p));
+    __m128 py = _mm_set1_ps(Y(p));
+    __m128 pz = _mm_set1_ps(Z(p));
+    for (int i = 0; i < planes->num_padded_planes; i += 4) {
+        __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(&planes->nxs[i]), px),
+                                         _mm_mul_ps(_mm_loadu_ps(&planes->nys[i]), py)),
+                                         _mm_mul_ps(_mm_loadu_ps(&planes->nzs[i]), pz));
+        if (_mm_movemask_ps(_mm_cmpgt_ps(d, _mm_loadu_ps(&planes->offsets[i]))) != 0) return false;
+    }
+    return true;
+#else
+    for (int i = 0; i < planes->num_planes; i++) {
+        float d = planes->nxs[i]*X(p) + planes->nys[i]*Y(p) + planes->nzs[i]*Z(p);
+        if (d > planes->offsets[i]) return false;
+    }
+    return true;
+#endif
+}
+
+int points_in_convex_planes(vec3 *points, int num_points, ConvexPlanes *planes, bool *inside)
+{
+    int num_inside = 0;
+#ifdef __SSE2__
+    // Test four points at a time against each plane, stopping when all four are outside.
+    for (int i = 0; i < num_points; i += 4) {
+        int n = MIN(4, num_points - i);
+        float x[4], y[4], z[4];
+        for (int j = 0; j < 4; j++) {
+            vec3 p = points[i + (j < n ? j : 0)];
+            x[j] = X(p);
+            y[j] = Y(p);
+            z[j] = Z(p);
+        }
+        __m128 px = _mm_loadu_ps(x);
+        __m128 py = _mm_loadu_ps(y);
+        __m128 pz = _mm_loadu_ps(z);
+        __m128 outside = _mm_setzero_ps();
+        for (int j = 0; j < planes->num_planes; j++) {
+            __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(planes->nxs[j]), px),
+                                             _mm_mul_ps(_mm_set1_ps(planes->nys[j]), py)),
+                                             _mm_mul_ps(_mm_set1_ps(planes->nzs[j]), pz));
+            outside = _mm_or_ps(outside, _mm_cmpgt_ps(d, _mm_set1_ps(planes->offsets[j])));
+            if (_mm_movemask_ps(outside) == 0xF) break;
+        }
+        int mask = _mm_movemask_ps(outside);
+        for (int j = 0; j < n; j++) {
+            inside[i + j] = (mask & (1 << j)) == 0;
+            if (inside[i + j]) num_inside ++;
+        }
+    }
+#else
+    for (int i = 0; i < num_points; i++) {
+        inside[i] = point_in_convex_planes(points[i], planes);
+        if (inside[i]) num_inside ++;
+    }
+#endif
+    return num_inside;
+}
 
 /*--------------------------------------------------------------------------------
     Polytope methods. Polytopes are represented by only their points, and their polyhedron can be recovered at any time by taking the convex hull.
@@ -733,10 +1578,17 @@ vec3 polytope_center_of_mass(vec3 *points, int num_points)
 {
     Polyhedron hull = convex_hull(points, num_points);
     vec3 center_of_mass = polyhedron_center_of_mass(hull);
-    //----------////// Destroy the polyhedron.
+    polyhedron_destroy(&hull);
     return center_of_mass;
 }
 
+void polytope_mass_properties(vec3 *points, int num_points, float mass, float *volume, vec3 *center_of_mass, mat3x3 *inertia_tensor)
+{
+    Polyhedron hull = convex_hull(points, num_points);
+    polyhedron_mass_properties(hull, mass, volume, center_of_mass, inertia_tensor);
+    polyhedron_destroy(&hull);
+}
+
 vec3 polytope_extreme_point(vec3 *points, int num_points, vec3 direction)
 {
     if (num_points == 0) {
@@ -755,6 +1607,170 @@ vec3 polytope_extreme_point(vec3 *points, int num_points, vec3 direction)
     return p;
 }
 
+// The smallest sphere through the given boundary points (at most four), with its squared radius.
+// If the boundary points are degenerate, the smallest sphere containing them is used instead.
+static void sphere_through_points(vec3 *boundary, int n, vec3 *center, float *square_radius)
+{
+    if (n == 0) {
+        *center = vec3_zero();
+        *square_radius = -1;
+        return;
+    }
+    if (n == 1) {
+        *center = boundary[0];
+        *square_radius = 0;
+        return;
+    }
+    if (n == 2) {
+        *center = vec3_mul(vec3_add(boundary[0], boundary[1]), 0.5);
+        vec3 d = vec3_sub(boundary[0], *center);
+        *square_radius = vec3_dot(d, d);
+        return;
+    }
+    vec3 a = vec3_sub(boundary[1], boundary[0]);
+    vec3 b = vec3_sub(boundary[2], boundary[0]);
+    if (n == 3) {
+        // The circumcircle of the triangle.
+        vec3 axb = vec3_cross(a, b);
+        float denom = 2 * vec3_dot(axb, axb);
+        if (denom > 1e-12 * vec3_dot(a, a) * vec3_dot(b, b)) {
+            vec3 offset = vec3_mul(vec3_add(vec3_mul(vec3_cross(axb, a), vec3_dot(b, b)), vec3_mul(vec3_cross(b, axb), vec3_dot(a, a))), 1.0 / denom);
+            *center = vec3_add(boundary[0], offset);
+            *square_radius = vec3_dot(offset, offset);
+            return;
+        }
+    } else {
+        // The circumsphere of the tetrahedron.
+        vec3 c = vec3_sub(boundary[3], boundary[0]);
+        float denom = 2 * vec3_dot(a, vec3_cross(b, c));
+        float size = vec3_dot(a, a) + vec3_dot(b, b) + vec3_dot(c, c);
+        if (ABS(denom) > 1e-6 * size * sqrt(size)) {
+            vec3 offset = vec3_mul(vec3_add(vec3_add(vec3_mul(vec3_cross(b, c), vec3_dot(a, a)),
+                                                     vec3_mul(vec3_cross(c, a), vec3_dot(b, b))),
+                                                     vec3_mul(vec3_cross(a, b), vec3_dot(c, c))), 1.0 / denom);
+            *center = vec3_add(boundary[0], offset);
+            *square_radius = vec3_dot(offset, offset);
+            return;
+        }
+    }
+    // The points are degenerate, so take the sphere with the furthest pair as its diameter, grown to contain the rest.
+    int fi = 0, fj = 1;
+    float furthest = -1;
+    for (int i = 0; i < n; i++) {
+        for (int j = i + 1; j < n; j++) {
+            vec3 d = vec3_sub(boundary[i], boundary[j]);
+            if (vec3_dot(d, d) > furthest) { furthest = vec3_dot(d, d); fi = i; fj = j; }
+        }
+    }
+    *center = vec3_mul(vec3_add(boundary[fi], boundary[fj]), 0.5);
+    *square_radius = 0;
+    for (int i = 0; i < n; i++) {
+        vec3 d = vec3_sub(boundary[i], *center);
+        *square_radius = MAX(*square_radius, vec3_dot(d, d));
+    }
+}
+
+// Welzl's algorithm, in the move-to-front form. Points which are outside the current sphere are moved to the front of the array,
+// so that they are tested first in later passes.
+static void move_to_front_bounding_sphere(vec3 *points, int n, vec3 *boundary, int num_boundary, vec3 *center, float *square_radius)
+{
+    sphere_through_points(boundary, num_boundary, center, square_radius);
+    if (num_boundary == 4) return;
+    for (int i = 0; i < n; i++) {
+        vec3 d = vec3_sub(points[i], *center);
+        if (vec3_dot(d, d) <= *square_radius * (1 + 1e-5)) continue;
+        boundary[num_boundary] = points[i];
+        move_to_front_bounding_sphere(points, i, boundary, num_boundary + 1, center, square_radius);
+        vec3 p = points[i];
+        memmove(points + 1, points, sizeof(vec3) * i);
+        points[0] = p;
+    }
+}
+
+void polytope_bounding_sphere(vec3 *points, int num_points, vec3 *center, float *radius)
+{
+    if (num_points == 0) {
+        fprintf(stderr, "ERROR: polytope_bounding_sphere: Need at least one point.\n");
+        exit(EXIT_FAILURE);
+    }
+    vec3 *shuffled = malloc(sizeof(vec3) * num_points);
+    mem_check(shuffled);
+    memcpy(shuffled, points, sizeof(vec3) * num_points);
+    // The expected running time is linear for points in a random order. A fixed generator is used so that the result does not depend on rand().
+    uint32_t state = 2463534242;
+    for (int i = num_points - 1; i > 0; i--) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        int j = state % (i + 1);
+        vec3 temp = shuffled[i];
+        shuffled[i] = shuffled[j];
+        shuffled[j] = temp;
+    }
+    vec3 boundary[4];
+    float square_radius;
+    move_to_front_bounding_sphere(shuffled, num_points, boundary, 0, center, &square_radius);
+    free(shuffled);
+    // Make sure that rounding has not left any point outside.
+    for (int i = 0; i < num_points; i++) {
+        vec3 d = vec3_sub(points[i], *center);
+        square_radius = MAX(square_radius, vec3_dot(d, d));
+    }
+    *radius = sqrt(square_radius);
+}
+
+void polytope_bounding_box(vec3 *points, int num_points, vec3 *center, mat3x3 *axes, vec3 *half_extents)
+{
+    if (num_points == 0) {
+        fprintf(stderr, "ERROR: polytope_bounding_box: Need at least one point.\n");
+        exit(EXIT_FAILURE);
+    }
+    // Find the principal axes from the covariance of the points.
+    vec3 mean = vec3_zero();
+    for (int i = 0; i < num_points; i++) mean = vec3_add(mean, points[i]);
+    mean = vec3_mul(mean, 1.0 / num_points);
+    mat3x3 covariance = {0};
+    for (int i = 0; i < num_points; i++) {
+        vec3 d = vec3_sub(points[i], mean);
+        for (int j = 0; j < 3; j++) {
+            for (int k = 0; k < 3; k++) covariance.vals[3*j + k] += d.vals[j] * d.vals[k];
+        }
+    }
+    mat3x3 principal_axes;
+    vec3 variances;
+    symmetric_mat3x3_eigenvectors(covariance, &principal_axes, &variances);
+    // Make the axes right-handed.
+    vec3 u = new_vec3(principal_axes.vals[0], principal_axes.vals[1], principal_axes.vals[2]);
+    vec3 v = new_vec3(principal_axes.vals[3], principal_axes.vals[4], principal_axes.vals[5]);
+    vec3 w = vec3_cross(u, v);
+    for (int i = 0; i < 3; i++) principal_axes.vals[6 + i] = w.vals[i];
+
+    // Fit a box along the principal axes and one along the coordinate axes, and keep the one with the smaller volume.
+    // (The principal axes of a symmetric point cloud, such as a cube's corners, can be arbitrary.)
+    mat3x3 candidate_axes[2] = { principal_axes, identity_mat3x3() };
+    float best_volume = -1;
+    for (int c = 0; c < 2; c++) {
+        float min_vals[3], max_vals[3];
+        for (int i = 0; i < num_points; i++) {
+            for (int j = 0; j < 3; j++) {
+                float x = X(points[i]) * candidate_axes[c].vals[3*j] + Y(points[i]) * candidate_axes[c].vals[3*j + 1] + Z(points[i]) * candidate_axes[c].vals[3*j + 2];
+                if (i == 0 || x < min_vals[j]) min_vals[j] = x;
+                if (i == 0 || x > max_vals[j]) max_vals[j] = x;
+            }
+        }
+        float volume = (max_vals[0] - min_vals[0]) * (max_vals[1] - min_vals[1]) * (max_vals[2] - min_vals[2]);
+        if (best_volume >= 0 && volume >= best_volume) continue;
+        best_volume = volume;
+        *axes = candidate_axes[c];
+        vec3 box_coordinates;
+        for (int j = 0; j < 3; j++) {
+            box_coordinates.vals[j] = 0.5 * (min_vals[j] + max_vals[j]);
+            half_extents->vals[j] = 0.5 * (max_vals[j] - min_vals[j]);
+        }
+        *center = matrix_vec3(*axes, box_coordinates);
+    }
+}
+
 // Shapes and object creation.
 // ---------------------------
 Polyhedron make_block(float width, float height, float depth)
@@ -298,6 +298,49 @@ void mat3x3_orthonormalize(mat3x3 *m)
     m->vals[5] = c.vals[1];
     m->vals[8] = c.vals[2];
 }
+// Diagonalize a symmetric matrix by Jacobi rotations. The columns of the eigenvectors matrix are the unit eigenvectors, in the order of the eigenvalues.
+void symmetric_mat3x3_eigenvectors(mat3x3 m, mat3x3 *eigenvectors, vec3 *eigenvalues)
+{
+    mat3x3 v = identity_mat3x3();
+    for (int sweep = 0; sweep < 16; sweep++) {
+        float off_diagonal = ABS(m.vals[3*1+0]) + ABS(m.vals[3*2+0]) + ABS(m.vals[3*2+1]);
+        float diagonal = ABS(m.vals[0]) + ABS(m.vals[4]) + ABS(m.vals[8]);
+        if (off_diagonal <= 1e-9 * diagonal) break;
+        for (int p = 0; p < 2; p++) {
+            for (int q = p + 1; q < 3; q++) {
+                float apq = m.vals[3*q+p];
+                if (apq == 0) continue;
+                // Rotate in the p-q plane by the angle which zeroes the (p, q) entry.
+                float theta = (m.vals[3*q+q] - m.vals[3*p+p]) / (2*apq);
+                float t = (theta >= 0 ? 1 : -1) / (ABS(theta) + sqrt(theta*theta + 1));
+                float c = 1.0 / sqrt(t*t + 1);
+                float s = t * c;
+                for (int k = 0; k < 3; k++) {
+                    // Columns p and q of m.
+                    float mkp = m.vals[3*p+k];
+                    float mkq = m.vals[3*q+k];
+                    m.vals[3*p+k] = c*mkp - s*mkq;
+                    m.vals[3*q+k] = s*mkp + c*mkq;
+                }
+                for (int k = 0; k < 3; k++) {
+                    // Rows p and q of m.
+                    float mpk = m.vals[3*k+p];
+                    float mqk = m.vals[3*k+q];
+                    m.vals[3*k+p] = c*mpk - s*mqk;
+                    m.vals[3*k+q] = s*mpk + c*mqk;
+                }
+                for (int k = 0; k < 3; k++) {
+                    float vkp = v.vals[3*p+k];
+                    float vkq = v.vals[3*q+k];
+                    v.vals[3*p+k] = c*vkp - s*vkq;
+                    v.vals[3*q+k] = s*vkp + c*vkq;
+                }
+            }
+        }
+    }
+    *eigenvectors = v;
+    *eigenvalues = new_vec3(m.vals[0], m.vals[4], m.vals[8]);
+}
 mat3x3 mat3x3_mul(mat3x3 m, float x)
 {
     for (int i = 0; i < 9; i++) m.vals[i] *= x;
@@ -427,6 +470,16 @@ vec3 rigid_matrix_vec3(mat4x4 matrix, vec3 v)
     vec4 vp = matrix_vec4(matrix, new_vec4(X(v), Y(v), Z(v), 1));
     return new_vec3(X(vp), Y(vp), Z(vp));
 }
+// Act on a direction vector with the transpose of the top-left 3x3 block. For a rigid matrix this takes
+// a world-space direction into model space, scaled by the matrix's scale.
+vec3 rigid_matrix_transpose_vec3(mat4x4 matrix, vec3 v)
+{
+    vec3 tv;
+    for (int i = 0; i < 3; i++) {
+        tv.vals[i] = matrix.vals[4*i + 0]*X(v) + matrix.vals[4*i + 1]*Y(v) + matrix.vals[4*i + 2]*Z(v);
+    }
+    return tv;
+}
 
 // Printing
 //--------------------------------------------------------------------------------
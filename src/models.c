@@ -271,7 +271,7 @@ Model make_icosahedron(float radius)
 {
     vec3 points[12];
     icosahedron_points(points, radius);
-    return polyhedron_to_model(convex_hull(points, 12));
+    return convex_hull_model(points, 12);
 }
 Model make_dodecahedron(float radius)
 {
@@ -286,8 +286,8 @@ Model make_dodecahedron(float radius)
         tri = tri->next;
         i++;
     }
-    //-------destroy the polyhedra!
-    return polyhedron_to_model(convex_hull(points, 20));
+    polyhedron_destroy(&ico_poly);
+    return convex_hull_model(points, 20);
 }
 Model make_tetrahedron(float size)
 {
@@ -301,7 +301,7 @@ Model make_tetrahedron(float size)
     float h = sqrt(x*x - a*a);
     points[3] = new_vec3(0,0,h);
     for (int i = 0; i < 4; i++) points[i] = vec3_mul(points[i], size);
-    return polyhedron_to_model(convex_hull(points, 4));
+    return convex_hull_model(points, 4);
 }
 Model make_octahedron(float size)
 {
@@ -314,7 +314,7 @@ Model make_octahedron(float size)
     float h = 2*x / sqrt(2);
     points[4] = new_vec3(0,0,h);
     points[5] = new_vec3(0,0,-h);
-    return polyhedron_to_model(convex_hull(points, 6));
+    return convex_hull_model(points, 6);
 }
 
 // Polyhedron structures are more useful for interacting with the geometry. If the geometry is completed and it is wanted to
@@ -344,6 +344,51 @@ Model polyhedron_to_model(Polyhedron polyhedron)
     model.num_triangles = ti;
     return model;
 }
+// Make a model of the convex hull of the points, without keeping the hull.
+Model convex_hull_model(vec3 *points, int num_points)
+{
+    Polyhedron hull = convex_hull(points, num_points);
+    Model model = polyhedron_to_model(hull);
+    polyhedron_destroy(&hull);
+    return model;
+}
+// Free the vertices, triangles and vertex attributes of a model. The texture is not freed, as models can share textures.
+void model_destroy(Model *model)
+{
+    free(model->vertices);
+    free(model->triangles);
+    free(model->normals);
+    free(model->uvs);
+    memset(model, 0, sizeof(Model));
+}
+
+// Triangles which share vertex indices in the model are adjacent in the mesh, so models with vertices duplicated
+// along their edges (for example to give faces their own normals) give meshes of separate triangles.
+HalfEdgeMesh model_to_half_edge_mesh(Model model)
+{
+    HalfEdgeMesh mesh = new_half_edge_mesh(model.num_vertices, model.num_triangles);
+    memcpy(mesh.positions, model.vertices, sizeof(vec3) * model.num_vertices);
+    for (int i = 0; i < 3*model.num_triangles; i++) mesh.origins[i] = model.triangles[i];
+    half_edge_mesh_link_twins(&mesh);
+    return mesh;
+}
+Model half_edge_mesh_to_model(HalfEdgeMesh *mesh)
+{
+    if (mesh->num_vertices > UINT16_MAX + 1) {
+        fprintf(stderr, "ERROR: half_edge_mesh_to_model: Too many vertices (%d) for a model.\n", mesh->num_vertices);
+        exit(EXIT_FAILURE);
+    }
+    Model model = {0};
+    model.num_vertices = mesh->num_vertices;
+    model.vertices = malloc(sizeof(vec3) * model.num_vertices);
+    mem_check(model.vertices);
+    memcpy(model.vertices, mesh->positions, sizeof(vec3) * model.num_vertices);
+    model.num_triangles = mesh->num_triangles;
+    model.triangles = malloc(sizeof(uint16_t) * 3 * model.num_triangles);
+    mem_check(model.triangles);
+    for (int i = 0; i < 3*model.num_triangles; i++) model.triangles[i] = mesh->origins[i];
+    return model;
+}
 
 bool ray_model_intersection(vec3 origin, vec3 direction, Model *model, mat4x4 model_matrix, vec3 *intersection)
 {
@@ -27,9 +27,9 @@ Camera *main_camera = NULL;
 Entity *main_camera_entity = NULL;
 //--------------------------------------------------------------------------------
 
-void update_time(int value) // the int parameter is needed by glut, but not used.
+void update_time(void)
 {
-    // Update global time information.
+    // Update global time information. This is called once per frame, so dt is the length of the last frame.
     static bool set_time = false;
     if (!set_time) {
         total_time = glutGet(GLUT_ELAPSED_TIME) / 1000.0;
@@ -38,15 +38,15 @@ void update_time(int value) // the int parameter is needed by glut, but not used
     float new_time = glutGet(GLUT_ELAPSED_TIME) / 1000.0;
     dt = new_time - total_time;
     total_time = new_time;
-    glutTimerFunc(1, update_time, 0); // Update the time every millisecond.
 }
 
 void update(void)
 {
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    update_time();
 
     // Update global systems.
-    rigid_body_dynamics();
+    physics_update();
     // Update the entities by invoking their behaviours.
     for (int i = 0; i < entity_list_length; i++) {
         Entity *entity = &entity_list[i];
@@ -114,7 +114,7 @@ void make_tree(vec3 position, float size)
     trunk_model.textured = true;
     ModelRenderer *trunk_renderer = add_model_renderer(tree, trunk_model);
     // Add a collider to the trunk.
-    add_collider(tree, trunk_model.vertices, trunk_model.num_vertices, false);
+    add_cylinder_collider(tree, vec3_zero(), size * 0.2, size, 8);
 }
 void create_nature(void)
 {
@@ -127,8 +127,7 @@ void create_nature(void)
         floor_model.flat_color = new_vec4(0.73,0.73,0.73,1);
         model_compute_normals(&floor_model);
         ModelRenderer *renderer = add_model_renderer(floor, floor_model);
-        Model collider = make_tessellated_block(1000,10,1000, 2,2,2);
-        add_collider(floor, collider.vertices, collider.num_vertices, false);
+        add_box_collider(floor, vec3_zero(), 1000,10,1000);
     }
     // Create some hilly terrain. Some semi-random rolly hills are wanted, and this is done by using random-number seeds,
     // and generating random point clouds, and taking their convex hulls.
@@ -149,7 +148,7 @@ void create_nature(void)
             random[1] *= random[0]*random[0] + random[1]*random[1];
             hilly_points[i] = new_vec3(10*random[0]*s, 0.8 * random[1]*s, 10*random[2]*s);
         }
-        Model hills_model = polyhedron_to_model(convex_hull(hilly_points, N));
+        Model hills_model = convex_hull_model(hilly_points, N);
         model_compute_normals(&hills_model);
         // Orthogonally project a texture onto the hill from above.
         float *uvs = malloc(sizeof(float) * 2*hills_model.num_vertices);
@@ -166,7 +165,7 @@ void create_nature(void)
 
         Entity *hills = add_entity(new_vec3(-60,-14,10), new_vec3(0,-M_PI/2,0));
         ModelRenderer *renderer = add_model_renderer(hills, hills_model);
-        add_collider(hills, hills_model.vertices, hills_model.num_vertices, true);
+        add_collider(hills, hills_model.vertices, hills_model.num_vertices);
         #undef N
     }
     // Create trees.
@@ -198,8 +197,7 @@ void create_museum(void)
         foundations_model.flat_color = GRAY;
         model_compute_normals(&foundations_model);
         ModelRenderer *renderer = add_model_renderer(foundations, foundations_model);
-        Model collider_model = make_tessellated_block(w,h,d, 2,2,2);
-        add_collider(foundations, collider_model.vertices, collider_model.num_vertices, false);
+        add_box_collider(foundations, vec3_zero(), w,h,d);
     }
     // Create pillars to hold up the roof. These are surfaces of revolution designed on grid paper.
     {
@@ -230,26 +228,11 @@ void create_museum(void)
             pillar->scale = 0.3;
             ModelRenderer *renderer = add_model_renderer(pillar, pillar_model);
             // The pillar is not convex, so break it apart into approximate convex pieces for its collider geometry.
-            {
-                Model collider_model = make_tessellated_block(14.5,4,14.5, 2,2,2);
-                for (int i = 0; i < collider_model.num_vertices; i++) {
-                    Y(collider_model.vertices[i]) += 2;
-                }
-                Collider *collider = add_collider(pillar, collider_model.vertices, collider_model.num_vertices, false);
-            }
-            {
-                Model collider_model = make_tessellated_block(16.5,4,16.5, 2,2,2);
-                for (int i = 0; i < collider_model.num_vertices; i++) {
-                    Y(collider_model.vertices[i]) -= 0.5;
-                }
-                Collider *collider = add_collider(pillar, collider_model.vertices, collider_model.num_vertices, false);
-            }
-            {
-                float pillar_collider_ys[2] = {0, 69};
-                float pillar_collider_xs[2] = {6.1, 6.1};
-                Model collider_model = make_surface_of_revolution(pillar_collider_xs, pillar_collider_ys, 2, 10);
-                Collider *collider = add_collider(pillar, collider_model.vertices, collider_model.num_vertices, false);
-            }
+            Collider *pillar_collider = begin_compound_collider(pillar);
+            add_box_collider(pillar, new_vec3(0,2,0), 14.5,4,14.5);
+            add_box_collider(pillar, new_vec3(0,-0.5,0), 16.5,4,16.5);
+            add_cylinder_collider(pillar, new_vec3(0,34.5,0), 6.1, 69, 10);
+            end_compound_collider(pillar_collider);
         }
     }
     // Add a roof.
@@ -261,8 +244,7 @@ void create_museum(void)
         model_compute_normals(&roof_model);
         ModelRenderer *renderer = add_model_renderer(roof, roof_model);
         
-        Model collider_model = make_tessellated_block(60,3,30, 2,2,2);
-        add_collider(roof, collider_model.vertices, collider_model.num_vertices, false);
+        add_box_collider(roof, vec3_zero(), 60,3,30);
     }
     // Create a staircase.
     {
@@ -273,7 +255,7 @@ void create_museum(void)
         for (int i = 0; i < 9; i++) {
             Entity *step = add_entity(vec3_add(new_vec3(0,0.3*i,-0.8*i), pos), new_vec3(0,-0.36,0));
             ModelRenderer *renderer = add_model_renderer(step, step_model);
-            add_collider(step, step_model.vertices, step_model.num_vertices, false);
+            add_box_collider(step, vec3_zero(), 6,3,1.6);
         }
     }
 }
@@ -323,12 +305,158 @@ void initialize(int argc, char *argv[])
     window_width = glutGet(GLUT_WINDOW_WIDTH);
     window_height = glutGet(GLUT_WINDOW_HEIGHT);
 
-    update_time(0);
+    update_time();
+}
+
+// Compare the exact mass properties against the sampled inertia tensor, for the platonic solids used in the rigid body exhibit.
+static void test_mass_properties(void)
+{
+    Model solids[5];
+    solids[0] = make_tetrahedron(1);
+    solids[1] = make_tessellated_block(1,1,1, 2,2,2);
+    solids[2] = make_octahedron(1);
+    solids[3] = make_dodecahedron(1);
+    solids[4] = make_icosahedron(1);
+    for (int i = 0; i < 5; i++) {
+        Polyhedron hull = convex_hull(solids[i].vertices, solids[i].num_vertices);
+        float volume;
+        vec3 center_of_mass;
+        mat3x3 inertia_tensor;
+        polyhedron_mass_properties(hull, 1, &volume, &center_of_mass, &inertia_tensor);
+        vec3 expected_center_of_mass = polyhedron_center_of_mass(hull);
+        mat3x3 sampled_inertia_tensor = brute_force_polyhedron_inertia_tensor(hull, center_of_mass, 1);
+        float scale = inertia_tensor.vals[0] + inertia_tensor.vals[4] + inertia_tensor.vals[8];
+        float error = 0;
+        for (int j = 0; j < 9; j++) {
+            error = MAX(error, ABS(inertia_tensor.vals[j] - sampled_inertia_tensor.vals[j]) / scale);
+        }
+        vec3 center_difference = vec3_sub(center_of_mass, expected_center_of_mass);
+        // The sampled inertia tensor is only accurate to a few percent, as the grid spacing is a twentieth of the polyhedron's size.
+        if (ABS(volume - ABS(polyhedron_volume(hull))) > 1e-4 * volume || vec3_dot(center_difference, center_difference) > 1e-8 || error > 0.03) {
+            fprintf(stderr, "ERROR: test_mass_properties: Solid %d does not match, volume %.6f, inertia tensor error %.6f.\n", i, volume, error);
+            exit(EXIT_FAILURE);
+        }
+        polyhedron_destroy(&hull);
+        model_destroy(&solids[i]);
+    }
+}
+
+// The geometry tests use an evenly spread cloud of points in the cube from -scale to scale on each axis.
+// This doesn't use rand, so the scene is unchanged by the tests.
+static void test_point_cloud(vec3 *points, int n, float scale)
+{
+    for (int i = 0; i < n; i++) {
+        points[i] = vec3_mul(new_vec3(fmod(i*0.618034, 1)*2 - 1, fmod(i*0.414214, 1)*2 - 1, fmod(i*0.732051, 1)*2 - 1), scale);
+    }
+}
+static void test_check(bool ok, const char *test, const char *message)
+{
+    if (!ok) {
+        fprintf(stderr, "ERROR: %s: %s\n", test, message);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Compare the hulls given by the two convex hull methods, and check the hulls of flat and collinear points.
+static void test_convex_hull(void)
+{
+    ConvexHullMethod method = convex_hull_method;
+    Model solid = make_dodecahedron(1);
+    // Most of the points of the cloud are inside its hull.
+    vec3 cloud[200];
+    test_point_cloud(cloud, 200, 0.5);
+    vec3 *points[2] = { cloud, solid.vertices };
+    int num_points[2] = { 200, solid.num_vertices };
+    for (int i = 0; i < 2; i++) {
+        convex_hull_method = IncrementalHull;
+        Polyhedron incremental = convex_hull(points[i], num_points[i]);
+        convex_hull_method = Quickhull;
+        Polyhedron quick = convex_hull(points[i], num_points[i]);
+        float volume = polyhedron_volume(incremental);
+        test_check(polyhedron_num_points(&incremental) == polyhedron_num_points(&quick) && ABS(volume - polyhedron_volume(quick)) <= 1e-4 * ABS(volume),
+                   "test_convex_hull", i == 0 ? "The hull methods do not match for the point cloud." : "The hull methods do not match for the solid.");
+        polyhedron_destroy(&incremental);
+        polyhedron_destroy(&quick);
+    }
+    convex_hull_method = method;
+    // A square with points on its edges and inside gives the square, and a line of points gives its end points.
+    vec3 flat[9];
+    vec3 line[5];
+    for (int i = 0; i < 9; i++) flat[i] = new_vec3(i % 3, 0, i / 3);
+    for (int i = 0; i < 5; i++) line[i] = new_vec3(i, 2*i, 3*i);
+    Polyhedron square = convex_hull(flat, 9);
+    Polyhedron segment = convex_hull(line, 5);
+    test_check(polyhedron_num_points(&square) == 4 && polyhedron_num_triangles(&square) == 2
+               && polyhedron_num_points(&segment) == 2 && polyhedron_num_edges(&segment) == 1,
+               "test_convex_hull", "The hull of flat or collinear points is wrong.");
+    polyhedron_destroy(&square);
+    polyhedron_destroy(&segment);
+    model_destroy(&solid);
+}
+
+// Check that a hull converted to a half-edge mesh is closed, and that the mesh queries and conversions agree with the polyhedron.
+static void test_half_edge_mesh(void)
+{
+    Model solid = make_dodecahedron(1);
+    Polyhedron hull = convex_hull(solid.vertices, solid.num_vertices);
+    HalfEdgeMesh mesh = polyhedron_to_half_edge_mesh(hull);
+    HalfEdgeMesh model_mesh = model_to_half_edge_mesh(solid);
+    Polyhedron round_trip = half_edge_mesh_to_polyhedron(&mesh);
+    bool ok = mesh.num_vertices == 20 && mesh.num_triangles == 36 && model_mesh.num_triangles == 36;
+    for (uint32_t i = 0; i < 3 * (uint32_t) mesh.num_triangles; i++) {
+        if (mesh.twins[i] == HALF_EDGE_NONE || mesh.twins[mesh.twins[i]] != i || model_mesh.twins[i] == HALF_EDGE_NONE) ok = false;
+    }
+    float volume = polyhedron_volume(hull);
+    ok = ok && ABS(half_edge_mesh_volume(&mesh) - volume) < 1e-4 * volume && ABS(half_edge_mesh_volume(&model_mesh) - volume) < 1e-4 * volume;
+    ok = ok && ABS(polyhedron_volume(round_trip) - volume) < 1e-4 * volume && polyhedron_num_edges(&round_trip) == 54;
+    vec3 points[20];
+    test_point_cloud(points, 20, 1);
+    for (int i = 0; i < 20; i++) {
+        vec3 p = points[i];
+        vec3 extreme_difference = vec3_sub(half_edge_mesh_extreme_point(&mesh, p), polyhedron_extreme_point(hull, p));
+        if (vec3_dot(extreme_difference, extreme_difference) != 0) ok = false;
+        if (point_in_convex_half_edge_mesh(p, &mesh) != point_in_convex_polyhedron(p, hull)) ok = false;
+    }
+    test_check(ok, "test_half_edge_mesh", "The half-edge mesh does not match the polyhedron.");
+    polyhedron_destroy(&hull);
+    polyhedron_destroy(&round_trip);
+    half_edge_mesh_destroy(&mesh);
+    half_edge_mesh_destroy(&model_mesh);
+    model_destroy(&solid);
+}
+
+// Check that the face planes of a hull classify points as the polyhedron does, one at a time and in a batch.
+static void test_convex_planes(void)
+{
+    Model solid = make_dodecahedron(1);
+    Polyhedron hull = convex_hull(solid.vertices, solid.num_vertices);
+    ConvexPlanes planes = polyhedron_planes(hull);
+    // An odd number of points, so that the last batch of four is partial.
+    vec3 points[201];
+    bool inside[201];
+    test_point_cloud(points, 201, 2);
+    int num_inside = points_in_convex_planes(points, 201, &planes, inside);
+    int expected_num_inside = 0;
+    bool ok = planes.num_planes == 36;
+    for (int i = 0; i < 201; i++) {
+        bool expected = point_in_convex_polyhedron(points[i], hull);
+        if (expected) expected_num_inside ++;
+        if (inside[i] != expected || point_in_convex_planes(points[i], &planes) != expected) ok = false;
+    }
+    test_check(ok && num_inside == expected_num_inside && num_inside > 0, "test_convex_planes",
+               "The face planes do not classify points as the polyhedron does.");
+    convex_planes_destroy(&planes);
+    polyhedron_destroy(&hull);
+    model_destroy(&solid);
 }
 
 void run_tests(void)
 {
     // Put initialization tests here.
+    test_mass_properties();
+    test_convex_hull();
+    test_half_edge_mesh();
+    test_convex_planes();
 }
 
 int main(int argc, char *argv[])
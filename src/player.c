@@ -41,39 +41,44 @@ void player_controller_update(Entity *e, Behaviour *b)
     #endif 
     if (vec3_dot(player->velocity, player->velocity) > 0.1*0.1) e->position = vec3_add(e->position, vec3_mul(player->velocity, dt));
 
-    for_behaviour(Collider, collider, collider_entity)
-        if (collider == player->collider) continue;
-        if (!collider_bounding_test(player->collider, e, collider, collider_entity)) continue;
-
-        #if 0
-        // Visualize culling, for debugging.
-        prepare_entity_matrix(collider_entity);
-        glDisable(GL_LIGHTING);
-        glDisable(GL_DEPTH);
-        glBegin(GL_LINE_STRIP);
-        glColor3f(0,1,0);
-        for (int i = 0; i < collider->num_points; i++) {
-            glVertex3f(UNPACK_VEC3(collider->points[i]));
+    // Bring the broadphase up to date with the player's movement, then only test the colliders near the player, in one batch.
+    broadphase_update_collider(player->collider);
+    static CollisionPair **pairs = NULL;
+    static GJKManifold *manifolds = NULL;
+    static bool *hits = NULL;
+    static int pairs_size = 0;
+    int num_pairs = 0;
+    for_collision_pair(pair)
+        if (pair->A != player->collider && pair->B != player->collider) continue;
+        if (num_pairs == pairs_size) {
+            pairs_size = pairs_size == 0 ? 16 : 2*pairs_size;
+            pairs = realloc(pairs, sizeof(CollisionPair *) * pairs_size);
+            mem_check(pairs);
+            manifolds = realloc(manifolds, sizeof(GJKManifold) * pairs_size);
+            mem_check(manifolds);
+            hits = realloc(hits, sizeof(bool) * pairs_size);
+            mem_check(hits);
         }
-        glEnd();
-        #endif
-
-        GJKManifold contact_manifold;
-        mat4x4 player_matrix = entity_matrix(e);
-        mat4x4 object_matrix = entity_matrix(collider_entity);
-        if (!convex_hull_intersection(player->collider->points,
-                                      player->collider->num_points,
-                                      player_matrix,
-                                      collider->points,
-                                      collider->num_points,
-                                      object_matrix,
-                                      &contact_manifold)) continue;
-        if (vec3_dot(player->velocity, contact_manifold.separating_vector) <= 0) continue;
-        vec3 n = vec3_normalize(contact_manifold.separating_vector);
+        pairs[num_pairs++] = pair;
+    end_for_collision_pair()
+    collider_intersection_batch(pairs, num_pairs, manifolds, hits);
+
+    bool pushed = false;
+    for (int i = 0; i < num_pairs; i++) {
+        if (!hits[i]) continue;
+        CollisionPair *pair = pairs[i];
+        GJKManifold contact_manifold = manifolds[i];
+        // Once the player has been pushed out of a collider, the others it was touching are tested again from its new position.
+        if (pushed && !collider_intersection(pair->A, entity_matrix(pair->A_entity), pair->B, entity_matrix(pair->B_entity), &pair->cache, &contact_manifold)) continue;
+        // The separating vector moves B out of A.
+        vec3 push = pair->A == player->collider ? vec3_neg(contact_manifold.separating_vector) : contact_manifold.separating_vector;
+        if (vec3_dot(player->velocity, push) >= 0) continue;
+        vec3 n = vec3_normalize(push);
         player->velocity = vec3_sub(player->velocity, vec3_mul(n, vec3_dot(player->velocity, n)));
 
-        e->position = vec3_add(e->position, vec3_neg(contact_manifold.separating_vector));
-    end_for_behaviour()
+        e->position = vec3_add(e->position, push);
+        pushed = true;
+    }
 
     // Turning.
     float turn_speed = 2;
@@ -175,8 +180,11 @@ void create_player(vec3 start_position, float camera_near_plane, float camera_fa
     player->euler_controlled = true;
 
     // The player collider is a capsule. This means that the player can walk up things like stairs.
-    Model player_capsule = make_capsule(0.6, 1.9);
-    Collider *collider = add_collider(player, player_capsule.vertices, player_capsule.num_vertices, true);
+    Collider *collider = add_capsule_collider(player, vec3_zero(), 0.6, 1.9);
+    // The player is moved by its controller, so it is classed as dynamic to be paired with the static world.
+    // Rigid bodies can clear CollisionLayerPlayer from their mask to ignore the player.
+    set_collider_filter(collider, CollisionLayerPlayer, COLLISION_LAYERS_ALL);
+    set_collider_motion(collider, ColliderDynamic);
 
     Behaviour *controller_behaviour = add_behaviour(player, player_controller_update, sizeof(PlayerController), PlayerControllerID);
     controller_behaviour->key_listener = player_controller_key_listener;
@@ -0,0 +1,92 @@
+/*================================================================================
+    Thread pool.
+    The workers sleep on a condition variable until a parallel loop is started. The indices of the loop are handed out
+    in chunks from an atomic counter, so faster threads take more chunks.
+================================================================================*/
+#include "museum.h"
+#include <pthread.h>
+#include <unistd.h>
+
+#define MAX_NUM_WORKER_THREADS 32
+
+int num_worker_threads = -1;
+static bool thread_pool_started = false;
+static pthread_t worker_threads[MAX_NUM_WORKER_THREADS];
+static pthread_mutex_t thread_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_started = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t job_finished = PTHREAD_COND_INITIALIZER;
+
+// The current parallel loop.
+static ParallelFunction job_function;
+static void *job_data;
+static int job_count;
+static int job_chunk_size;
+static int job_next_index;
+static int job_generation = 0; // Incremented for each loop, so the workers can tell a new loop has started.
+static int num_busy_workers = 0;
+
+static void run_job(void)
+{
+    int start;
+    while ((start = __atomic_fetch_add(&job_next_index, job_chunk_size, __ATOMIC_RELAXED)) < job_count) {
+        int end = MIN(start + job_chunk_size, job_count);
+        for (int i = start; i < end; i++) job_function(i, job_data);
+    }
+}
+
+static void *worker_thread(void *arg)
+{
+    int generation = 0;
+    while (1) {
+        pthread_mutex_lock(&thread_pool_mutex);
+        while (job_generation == generation) pthread_cond_wait(&job_started, &thread_pool_mutex);
+        generation = job_generation;
+        pthread_mutex_unlock(&thread_pool_mutex);
+
+        run_job();
+
+        pthread_mutex_lock(&thread_pool_mutex);
+        if (--num_busy_workers == 0) pthread_cond_signal(&job_finished);
+        pthread_mutex_unlock(&thread_pool_mutex);
+    }
+    return NULL;
+}
+
+static void start_thread_pool(void)
+{
+    thread_pool_started = true;
+    if (num_worker_threads < 0) num_worker_threads = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+    num_worker_threads = MAX(0, MIN(num_worker_threads, MAX_NUM_WORKER_THREADS));
+    for (int i = 0; i < num_worker_threads; i++) {
+        if (pthread_create(&worker_threads[i], NULL, worker_thread, NULL) != 0) {
+            fprintf(stderr, "ERROR: Failed to create a worker thread.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+void parallel_for(int count, ParallelFunction function, void *data)
+{
+    if (!thread_pool_started) start_thread_pool();
+    if (num_worker_threads == 0 || count <= 1) {
+        for (int i = 0; i < count; i++) function(i, data);
+        return;
+    }
+    pthread_mutex_lock(&thread_pool_mutex);
+    job_function = function;
+    job_data = data;
+    job_count = count;
+    // Split the loop into a few chunks per thread, so that uneven work is balanced.
+    job_chunk_size = MAX(1, count / (4 * (num_worker_threads + 1)));
+    job_next_index = 0;
+    num_busy_workers = num_worker_threads;
+    job_generation ++;
+    pthread_cond_broadcast(&job_started);
+    pthread_mutex_unlock(&thread_pool_mutex);
+
+    run_job();
+
+    pthread_mutex_lock(&thread_pool_mutex);
+    while (num_busy_workers > 0) pthread_cond_wait(&job_finished, &thread_pool_mutex);
+    pthread_mutex_unlock(&thread_pool_mutex);
+}